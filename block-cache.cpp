@@ -0,0 +1,368 @@
+/*
+ * Block Cache
+ */
+#include "block-cache.h"
+#include <infos/util/lock.h>
+
+using namespace infos::fs;
+using namespace infos::drivers::block;
+using namespace infos::util;
+
+/**
+ * Constructs a block cache in front of a device.
+ * @param device The device to cache blocks from.
+ * @param nr_buffers The number of blocks to cache.
+ */
+BlockCache::BlockCache(BlockDevice& device, unsigned int nr_buffers)
+	: _device(device),
+	_block_size(device.block_size()),
+	_nr_buffers(nr_buffers),
+	_clock_hand(0),
+	_stats(),
+	_prefetch_busy(false)
+{
+	_buffers = new BlockBuffer[nr_buffers];
+	_storage = new uint8_t[nr_buffers * _block_size];
+	_prefetch_buffer = new uint8_t[BLOCK_CACHE_MAX_PREFETCH * _block_size];
+
+	for (unsigned int i = 0; i < nr_buffers; i++) {
+		_buffers[i]._block = 0;
+		_buffers[i]._data = _storage + (i * _block_size);
+		_buffers[i]._refcount = 0;
+		_buffers[i]._referenced = false;
+		_buffers[i]._valid = false;
+		_buffers[i]._hash_next = NULL;
+	}
+
+	// Size the hash table to the next power of two, so a bucket holds one block on average.
+	unsigned int nr_buckets = 1;
+	while (nr_buckets < nr_buffers) {
+		nr_buckets <<= 1;
+	}
+
+	_hash = new BlockBuffer *[nr_buckets];
+	_hash_mask = nr_buckets - 1;
+
+	for (unsigned int i = 0; i < nr_buckets; i++) {
+		_hash[i] = NULL;
+	}
+}
+
+BlockCache::~BlockCache()
+{
+	delete[] _hash;
+	delete[] _prefetch_buffer;
+	delete[] _storage;
+	delete[] _buffers;
+}
+
+/**
+ * Finds the buffer holding the given block.
+ * @return Returns the buffer, or NULL if the block is not cached.
+ */
+BlockBuffer *BlockCache::lookup(size_t block) const
+{
+	for (BlockBuffer *buffer = _hash[block & _hash_mask]; buffer; buffer = buffer->_hash_next) {
+		if (buffer->_block == block) {
+			return buffer;
+		}
+	}
+
+	return NULL;
+}
+
+void BlockCache::hash_insert(BlockBuffer *buffer)
+{
+	BlockBuffer **bucket = &_hash[buffer->_block & _hash_mask];
+
+	buffer->_hash_next = *bucket;
+	*bucket = buffer;
+}
+
+void BlockCache::hash_remove(BlockBuffer *buffer)
+{
+	BlockBuffer **link = &_hash[buffer->_block & _hash_mask];
+
+	while (*link != buffer) {
+		link = &(*link)->_hash_next;
+	}
+
+	*link = buffer->_hash_next;
+	buffer->_hash_next = NULL;
+}
+
+/**
+ * Picks a buffer to load a new block into, by sweeping the clock hand past buffers that
+ * have been used recently.  The buffer is taken out of the hash table and pinned.
+ * @return Returns the buffer, or NULL if every buffer is pinned.
+ */
+BlockBuffer *BlockCache::claim()
+{
+	// Two sweeps are enough: the first clears every referenced bit it passes.
+	for (unsigned int i = 0; i < _nr_buffers * 2; i++) {
+		BlockBuffer *buffer = &_buffers[_clock_hand];
+		_clock_hand = (_clock_hand + 1) % _nr_buffers;
+
+		if (buffer->_refcount) {
+			continue;
+		}
+
+		if (buffer->_referenced) {
+			buffer->_referenced = false;
+			continue;
+		}
+
+		if (buffer->_valid) {
+			hash_remove(buffer);
+			buffer->_valid = false;
+			_stats.evictions++;
+		}
+
+		buffer->_refcount = 1;
+		return buffer;
+	}
+
+	return NULL;
+}
+
+/**
+ * Retrieves a block, reading it from the device if it is not cached.  The buffer is pinned
+ * until it is given back with put().
+ * @param block The number of the block.
+ * @return Returns the buffer holding the block, or NULL if every buffer is pinned.
+ */
+BlockBuffer *BlockCache::get(size_t block)
+{
+	BlockBuffer *buffer;
+
+	{
+		UniqueIRQLock l;
+
+		buffer = lookup(block);
+		if (buffer) {
+			_stats.hits++;
+
+			buffer->_refcount++;
+			buffer->_referenced = true;
+			return buffer;
+		}
+
+		_stats.misses++;
+
+		buffer = claim();
+		if (!buffer) {
+			_stats.bypasses++;
+			return NULL;
+		}
+	}
+
+	// The device is read without the lock held.  The buffer is pinned and not in the hash
+	// table, so nothing else can see it in the meantime.
+	_device.read_blocks(buffer->_data, block, 1);
+
+	UniqueIRQLock l;
+	return install(buffer, block);
+}
+
+/**
+ * Enters a freshly read buffer into the hash table.  The caller must hold the lock.
+ * @param buffer The claimed buffer, holding the contents of the block.
+ * @param block The number of the block.
+ * @return Returns the buffer now holding the block, still pinned.
+ */
+BlockBuffer *BlockCache::install(BlockBuffer *buffer, size_t block)
+{
+	// Someone else may have loaded the same block while this one was being read, in which
+	// case theirs is used, and this buffer goes back to be claimed again.
+	BlockBuffer *existing = lookup(block);
+	if (existing) {
+		buffer->_refcount = 0;
+
+		existing->_refcount++;
+		existing->_referenced = true;
+		return existing;
+	}
+
+	buffer->_block = block;
+	buffer->_valid = true;
+	buffer->_referenced = true;
+	hash_insert(buffer);
+
+	return buffer;
+}
+
+/**
+ * Gives back a buffer retrieved with get(), unpinning it.
+ * @param buffer The buffer to give back.
+ */
+void BlockCache::put(BlockBuffer *buffer)
+{
+	UniqueIRQLock l;
+
+	assert(buffer->_refcount > 0);
+	buffer->_refcount--;
+}
+
+/**
+ * Copies part of a block into a buffer, through the cache.
+ * @param buffer The buffer to copy into.
+ * @param block The number of the block.
+ * @param offset The offset within the block to start copying from.
+ * @param length The number of bytes to copy, which must not run past the end of the block.
+ */
+void BlockCache::read(void *buffer, size_t block, size_t offset, size_t length)
+{
+	BlockBuffer *cached = get(block);
+
+	if (cached) {
+		memcpy(buffer, cached->data() + offset, length);
+		put(cached);
+		return;
+	}
+
+	// Every buffer is pinned, so read the block around the cache.
+	uint8_t *bounce = new uint8_t[_block_size];
+
+	_device.read_blocks(bounce, block, 1);
+	memcpy(buffer, bounce + offset, length);
+
+	delete[] bounce;
+}
+
+/**
+ * Copies the blocks at the start of a range that are already cached, without reading the
+ * device.  Copying stops at the first block that is not cached.
+ * @param buffer The buffer to copy into, which must hold the whole range.
+ * @param block The first block of the range.
+ * @param count The number of blocks in the range.
+ * @return Returns the number of blocks copied.
+ */
+size_t BlockCache::read_cached(void *buffer, size_t block, size_t count)
+{
+	size_t copied = 0;
+
+	while (copied < count) {
+		BlockBuffer *cached;
+
+		{
+			UniqueIRQLock l;
+
+			cached = lookup(block + copied);
+			if (!cached) {
+				break;
+			}
+
+			_stats.hits++;
+
+			cached->_refcount++;
+			cached->_referenced = true;
+		}
+
+		memcpy((uint8_t *) buffer + (copied * _block_size), cached->data(), _block_size);
+		put(cached);
+
+		copied++;
+	}
+
+	return copied;
+}
+
+/**
+ * Counts the blocks at the start of a range that are not cached.
+ * @param block The first block of the range.
+ * @param count The number of blocks in the range.
+ * @return Returns the number of blocks before the first cached one, or the whole range.
+ */
+size_t BlockCache::count_uncached(size_t block, size_t count) const
+{
+	UniqueIRQLock l;
+
+	size_t uncached = 0;
+	while (uncached < count && !lookup(block + uncached)) {
+		uncached++;
+	}
+
+	return uncached;
+}
+
+/**
+ * Reads a range of blocks into the cache ahead of them being needed, reading each run of
+ * blocks that are not cached already with a single device request.  This is only a hint, so
+ * it gives up quietly if there are no buffers to spare, or another prefetch is in progress.
+ * @param block The first block of the range.
+ * @param count The number of blocks in the range.
+ */
+void BlockCache::prefetch(size_t block, size_t count)
+{
+	BlockBuffer *claimed[BLOCK_CACHE_MAX_PREFETCH];
+
+	{
+		UniqueIRQLock l;
+
+		if (_prefetch_busy) {
+			return;
+		}
+
+		_prefetch_busy = true;
+	}
+
+	size_t end = block + count;
+	while (block < end) {
+		size_t start, nr_claimed = 0;
+
+		{
+			UniqueIRQLock l;
+
+			// skip over the blocks that are already cached
+			while (block < end && lookup(block)) {
+				block++;
+			}
+
+			start = block;
+			while (block < end && nr_claimed < BLOCK_CACHE_MAX_PREFETCH && !lookup(block)) {
+				BlockBuffer *buffer = claim();
+				if (!buffer) {
+					break;
+				}
+
+				claimed[nr_claimed++] = buffer;
+				block++;
+			}
+		}
+
+		if (!nr_claimed) {
+			break;
+		}
+
+		_device.read_blocks(_prefetch_buffer, start, nr_claimed);
+
+		for (size_t i = 0; i < nr_claimed; i++) {
+			memcpy(claimed[i]->_data, _prefetch_buffer + (i * _block_size), _block_size);
+		}
+
+		UniqueIRQLock l;
+
+		for (size_t i = 0; i < nr_claimed; i++) {
+			// Read-ahead blocks keep the referenced bit install() gives them.  Without it
+			// they would be the first victims of the next prefetch, before they are used.
+			BlockBuffer *buffer = install(claimed[i], start + i);
+			buffer->_refcount--;
+		}
+
+		_stats.prefetched += nr_claimed;
+	}
+
+	UniqueIRQLock l;
+	_prefetch_busy = false;
+}
+
+/**
+ * Retrieves the counters for this cache.
+ * @param st Populated with the counters.
+ */
+void BlockCache::stats(BlockCacheStats& st) const
+{
+	UniqueIRQLock l;
+
+	st = _stats;
+}
@@ -0,0 +1,97 @@
+/*
+ * Block Cache
+ */
+#pragma once
+
+#include <infos/drivers/block/block-device.h>
+
+// The most blocks a single prefetch reads from the device.
+#define BLOCK_CACHE_MAX_PREFETCH	64
+
+namespace infos
+{
+	namespace fs
+	{
+		class BlockCache;
+
+		/**
+		 * The counters a block cache keeps, for judging how well it is sized.
+		 */
+		struct BlockCacheStats
+		{
+			uint64_t hits;			// lookups served from a cached block
+			uint64_t misses;		// lookups that had to read the device
+			uint64_t evictions;		// cached blocks dropped to make room for another
+			uint64_t bypasses;		// misses that found every buffer pinned, and so were not cached
+			uint64_t prefetched;		// blocks read into the cache ahead of being asked for
+		};
+
+		/**
+		 * A cached copy of one device block.  A buffer handed out by the cache is pinned, and
+		 * will not be evicted until it is given back.
+		 */
+		class BlockBuffer
+		{
+			friend class BlockCache;
+
+		public:
+			size_t block() const { return _block; }
+			const uint8_t *data() const { return _data; }
+
+		private:
+			size_t _block;
+			uint8_t *_data;
+			unsigned int _refcount;
+			bool _referenced;		// used since the clock hand last passed
+			bool _valid;			// holds the contents of _block
+			BlockBuffer *_hash_next;
+		};
+
+		/**
+		 * A fixed size cache of blocks from a block device, for read-only file-systems.
+		 * Blocks are found by number through a hash table, and evicted by the CLOCK
+		 * algorithm, skipping any that are pinned.
+		 */
+		class BlockCache
+		{
+		public:
+			BlockCache(drivers::block::BlockDevice& device, unsigned int nr_buffers);
+			~BlockCache();
+
+			BlockBuffer *get(size_t block);
+			void put(BlockBuffer *buffer);
+
+			void read(void *buffer, size_t block, size_t offset, size_t length);
+			size_t read_cached(void *buffer, size_t block, size_t count);
+			size_t count_uncached(size_t block, size_t count) const;
+			void prefetch(size_t block, size_t count);
+
+			void stats(BlockCacheStats& st) const;
+
+			drivers::block::BlockDevice& device() const { return _device; }
+
+		private:
+			drivers::block::BlockDevice& _device;
+			size_t _block_size;
+
+			BlockBuffer *_buffers;
+			uint8_t *_storage;
+			unsigned int _nr_buffers;
+			unsigned int _clock_hand;
+
+			BlockBuffer **_hash;
+			unsigned int _hash_mask;
+
+			BlockCacheStats _stats;
+
+			uint8_t *_prefetch_buffer;	// a run of prefetched blocks is read into here first
+			bool _prefetch_busy;
+
+			BlockBuffer *lookup(size_t block) const;
+			void hash_insert(BlockBuffer *buffer);
+			void hash_remove(BlockBuffer *buffer);
+			BlockBuffer *claim();
+			BlockBuffer *install(BlockBuffer *buffer, size_t block);
+		};
+	}
+}
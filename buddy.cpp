@@ -19,12 +19,86 @@ using namespace infos::util;
 
 #define MAX_ORDER	17
 
+// The number of per-CPU page caches, and their default watermarks (in pages).
+#define NR_PCP_CPUS		1
+#define PCP_DEFAULT_HIGH	186
+#define PCP_DEFAULT_LOW		124
+#define PCP_DEFAULT_BATCH	31
+
+// The default number of blocks per order that lazy mode leaves unmerged.
+#define LAZY_DEFAULT_THRESHOLD	32
+
+// The order of a pageblock, the unit that pages are grouped into by migrate type (2MiB, a
+// large page).
+#define PAGEBLOCK_ORDER		9
+
+/**
+ * How an allocation's pages can be moved about, which decides which pageblocks it comes from.
+ */
+namespace MigrateType {
+	enum MigrateType {
+		UNMOVABLE = 0,
+		RECLAIMABLE = 1,
+		MOVABLE = 2,
+	};
+}
+
+#define NR_MIGRATE_TYPES	3
+
+// The order in which the other migrate types are tried, when one runs out.
+static const MigrateType::MigrateType migrate_fallbacks[NR_MIGRATE_TYPES][NR_MIGRATE_TYPES - 1] = {
+	{ MigrateType::RECLAIMABLE, MigrateType::MOVABLE },	// UNMOVABLE
+	{ MigrateType::UNMOVABLE, MigrateType::MOVABLE },	// RECLAIMABLE
+	{ MigrateType::RECLAIMABLE, MigrateType::UNMOVABLE },	// MOVABLE
+};
+
+/**
+ * The counters the buddy allocator keeps for each order.
+ */
+struct BuddyOrderStats
+{
+	uint64_t free_blocks;	// blocks currently on the free list
+	uint64_t allocs;	// successful allocations
+	uint64_t frees;		// blocks freed
+	uint64_t splits;	// blocks split in half, to satisfy smaller allocations
+	uint64_t merges;	// pairs of buddies merged into the order above
+	uint64_t failed_allocs;	// allocations that could not be satisfied
+	uint64_t fallbacks;	// allocations that took a block from another migrate type
+};
+
+/**
+ * The counters the lazy buddy allocator keeps for merging its deferred blocks.
+ */
+struct BuddyCoalesceStats
+{
+	uint64_t runs;		// times every deferred block was merged, for want of a free block
+	uint64_t visited;	// free blocks looked at, to find the deferred ones
+	uint64_t merged;	// deferred blocks freed again with merging
+};
+
 /**
  * A buddy page allocation algorithm.
  */
 class BuddyPageAllocator : public PageAllocatorAlgorithm
 {
 private:
+	// A cache of order-0 pages that belongs to a single CPU, with a list per migrate type.
+	struct PerCPUPages {
+		PageDescriptor *pages[NR_MIGRATE_TYPES];	// singly linked through next_free, most recently freed first
+		unsigned int count;	// across all the lists
+		unsigned int high, low, batch;
+		uint64_t hits, misses;
+	};
+
+	/**
+	 * Returns the index of the CPU that is currently executing, for selecting its page cache.
+	 * InfOS only brings up the boot processor, so this is always zero.
+	 */
+	static inline unsigned int current_cpu()
+	{
+		return 0;
+	}
+
 	/**
 	 * Returns the number of pages that comprise a 'block', in a given order.
 	 * @param order The order to base the calculation off of.
@@ -81,30 +155,160 @@ private:
 	}
 
 	/**
-	 * Inserts a block into the free list of the given order.  The block is inserted in ascending order.
+	 * Returns the index of the free-area bit that tracks the block starting at the
+	 * given page-frame-number, in the given order.  Each order has its own region of
+	 * the bitmap, with one bit per naturally aligned block of that order.
+	 * @param pfn The page-frame-number of the first page in the block.
+	 * @param order The order of the block.
+	 * @return Returns the bit index into _free_map.
+	 */
+	inline uint64_t free_map_bit(uint64_t pfn, int order) const
+	{
+		// Order k starts after the regions of all the lower orders.  Order j needs
+		// (_map_pages >> j) bits, and summing that for j < k gives the offset below.
+		return 2 * (_map_pages - (_map_pages >> order)) + (pfn >> order);
+	}
+
+	/**
+	 * Returns TRUE if the block starting at the given page-frame-number is currently
+	 * on the free list of the given order.  This is a constant-time bitmap test.
+	 * @param pfn The page-frame-number of the first page in the block.
+	 * @param order The order to test.
+	 */
+	bool is_free_block(uint64_t pfn, int order) const
+	{
+		if (pfn >= _nr_pages) {
+			return false;
+		}
+
+		uint64_t bit = free_map_bit(pfn, order);
+		return (_free_map[bit / 64] >> (bit % 64)) & 1;
+	}
+
+	/**
+	 * Marks the block starting at the given page-frame-number as free (or not) in the given order.
+	 * @param pfn The page-frame-number of the first page in the block.
+	 * @param order The order of the block.
+	 * @param free TRUE if the block is now on the free list, FALSE otherwise.
+	 */
+	void set_free_block(uint64_t pfn, int order, bool free)
+	{
+		uint64_t bit = free_map_bit(pfn, order);
+
+		if (free) {
+			_free_map[bit / 64] |= (1ULL << (bit % 64));
+		} else {
+			_free_map[bit / 64] &= ~(1ULL << (bit % 64));
+		}
+	}
+
+	/**
+	 * Returns TRUE if the free block starting at the given page-frame-number was freed in lazy
+	 * mode, and has not yet been considered for merging with its buddy.
+	 * @param pfn The page-frame-number of the first page in the block.
+	 * @param order The order of the block.
+	 */
+	bool is_deferred_block(uint64_t pfn, int order) const
+	{
+		uint64_t bit = free_map_bit(pfn, order);
+		return (_deferred_map[bit / 64] >> (bit % 64)) & 1;
+	}
+
+	/**
+	 * Marks the free block starting at the given page-frame-number as deferred (or not), and
+	 * keeps the per-order count of deferred blocks up to date.
+	 * @param pfn The page-frame-number of the first page in the block.
+	 * @param order The order of the block.
+	 * @param deferred TRUE if the block has not been merged with its buddy, FALSE otherwise.
+	 */
+	void set_deferred_block(uint64_t pfn, int order, bool deferred)
+	{
+		uint64_t bit = free_map_bit(pfn, order);
+
+		if (deferred) {
+			_deferred_map[bit / 64] |= (1ULL << (bit % 64));
+			_nr_deferred[order]++;
+		} else {
+			_deferred_map[bit / 64] &= ~(1ULL << (bit % 64));
+			_nr_deferred[order]--;
+		}
+	}
+
+	/**
+	 * Returns the migrate type of the pageblock that contains the given page, which is the
+	 * free list a free block starting at that page belongs on.
+	 * @param pfn The page-frame-number of the page.
+	 */
+	MigrateType::MigrateType block_type(uint64_t pfn) const
+	{
+		if (!_grouping) {
+			return MigrateType::UNMOVABLE;
+		}
+
+		return (MigrateType::MigrateType) _pageblock_types[pfn >> PAGEBLOCK_ORDER];
+	}
+
+	/**
+	 * Links a block in at the head of one free list.  The free lists are unsorted, so the
+	 * block simply becomes the new head of the list.
+	 * @param pgd The page descriptor of the block to link in.
+	 * @param order The order of the free list.
+	 * @param type The migrate type of the free list.
+	 */
+	void link_block(PageDescriptor *pgd, int order, MigrateType::MigrateType type)
+	{
+		uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		PageDescriptor **head = &_free_areas[order][type];
+
+		pgd->next_free = *head;
+		if (pgd->next_free) {
+			_prev_free[sys.mm().pgalloc().pgd_to_pfn(pgd->next_free)] = pfn;
+		}
+
+		_prev_free[pfn] = NO_PFN;
+		*head = pgd;
+	}
+
+	/**
+	 * Unlinks a block from the free list it is on.
+	 * @param pgd The page descriptor of the block to unlink.
+	 * @param order The order of the free list.
+	 * @param type The migrate type of the free list.
+	 */
+	void unlink_block(PageDescriptor *pgd, int order, MigrateType::MigrateType type)
+	{
+		uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+
+		// The head of the list has no predecessor, so the free area itself points past it.
+		if (_prev_free[pfn] == NO_PFN) {
+			_free_areas[order][type] = pgd->next_free;
+		} else {
+			sys.mm().pgalloc().pfn_to_pgd(_prev_free[pfn])->next_free = pgd->next_free;
+		}
+
+		if (pgd->next_free) {
+			_prev_free[sys.mm().pgalloc().pgd_to_pfn(pgd->next_free)] = _prev_free[pfn];
+		}
+
+		pgd->next_free = NULL;
+	}
+
+	/**
+	 * Inserts a block into the free list of the given order, for its pageblock's migrate type.
 	 * @param pgd The page descriptor of the block to insert.
 	 * @param order The order in which to insert the block.
-	 * @return Returns the slot (i.e. a pointer to the pointer that points to the block) that the block
-	 * was inserted into.
 	 */
-	PageDescriptor **insert_block(PageDescriptor *pgd, int order)
+	void insert_block(PageDescriptor *pgd, int order)
 	{
-		// Starting from the _free_area array, find the slot in which the page descriptor
-		// should be inserted.
-		PageDescriptor **slot = &_free_areas[order];
+		uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
 
-		// Iterate whilst there is a slot, and whilst the page descriptor pointer is numerically
-		// greater than what the slot is pointing to.
-		while (*slot && pgd > *slot) {
-			slot = &(*slot)->next_free;
-		}
+		// The block must not already be free in this order.
+		assert(!is_free_block(pfn, order));
 
-		// Insert the page descriptor into the linked list.
-		pgd->next_free = *slot;
-		*slot = pgd;
+		link_block(pgd, order, block_type(pfn));
 
-		// Return the insert point (i.e. slot)
-		return slot;
+		set_free_block(pfn, order, true);
+		_stats[order].free_blocks++;
 	}
 
 	/**
@@ -115,324 +319,1233 @@ private:
 	 */
 	void remove_block(PageDescriptor *pgd, int order)
 	{
+		uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
 
-		// Starting from the _free_area array, iterate until the block has been located in the linked-list.
-		PageDescriptor **slot = &_free_areas[order];
-		while (*slot && pgd != *slot) {
-			slot = &(*slot)->next_free;
+		// Make sure the block actually exists.  Panic the system if it does not.
+		assert(is_free_block(pfn, order));
 
-		}
+		unlink_block(pgd, order, block_type(pfn));
 
-		// Make sure the block actually exists.  Panic the system if it does not.
-		assert(*slot == pgd);
+		set_free_block(pfn, order, false);
+		_stats[order].free_blocks--;
 
-		// Remove the block from the free list.
-		*slot = pgd->next_free;
-		pgd->next_free = NULL;
+		if (is_deferred_block(pfn, order)) {
+			set_deferred_block(pfn, order, false);
+		}
 	}
 
 	/**
-	 * Given a pointer to a block of free memory in the order "source_order", this function will
-	 * split the block in half, and insert it into the order below.
-	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
-	 * @param source_order The order in which the block of free memory exists.  Naturally,
-	 * the split will insert the two new blocks into the order below.
-	 * @return Returns the left-hand-side of the new block.
+	 * Changes the migrate type of a pageblock, moving the free blocks that lie in it onto the
+	 * free lists of the new type.
+	 * @param pfn The page-frame-number of any page in the pageblock.
+	 * @param type The new migrate type.
 	 */
-	PageDescriptor *split_block(PageDescriptor **block_pointer, int source_order)
+	void set_pageblock_type(uint64_t pfn, MigrateType::MigrateType type)
 	{
-		// Make sure there is an incoming pointer.
-		assert(*block_pointer);
-
-		// Make sure the block_pointer is correctly aligned.
-		assert(is_correct_alignment_for_order(*block_pointer, source_order));
+		uint64_t start = pfn & ~(pages_per_block(PAGEBLOCK_ORDER) - 1);
+		uint64_t end = start + pages_per_block(PAGEBLOCK_ORDER);
+		MigrateType::MigrateType old_type = block_type(start);
 
-		assert(source_order>0 && source_order<MAX_ORDER);
+		if (end > _nr_pages) {
+			end = _nr_pages;
+		}
 
-		// remove block from current order
-		remove_block(*block_pointer, source_order);
+		for (pfn = start; pfn < end;) {
+			int order;
+			uint64_t block_pfn = find_free_block(pfn, order);
 
-		//insert 2 blocks at lower order
-		insert_block((*block_pointer), source_order-1);
-		insert_block(*block_pointer+pages_per_block(source_order-1), source_order-1);
+			if (block_pfn == NO_PFN) {
+				pfn++;
+				continue;
+			}
 
+			PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(block_pfn);
+			unlink_block(pgd, order, old_type);
+			link_block(pgd, order, type);
 
-		return *block_pointer;
+			pfn = block_pfn + pages_per_block(order);
+		}
 
+		_pageblock_types[start >> PAGEBLOCK_ORDER] = type;
 	}
 
 	/**
-	 * Takes a block in the given source order, and merges it (and it's buddy) into the next order.
-	 * This function assumes both the source block and the buddy block are in the free list for the
-	 * source order.  If they aren't this function will panic the system.
-	 * @param block_pointer A pointer to a pointer containing a block in the pair to merge.
-	 * @param source_order The order in which the pair of blocks live.
-	 * @return Returns the new slot that points to the merged block.
+	 * Sets the migrate type of every pageblock in a block of a pageblock or more, none of which
+	 * may be on a free list.
+	 * @param pfn The page-frame-number of the first page in the block.
+	 * @param order The order of the block.
+	 * @param type The new migrate type.
 	 */
-	PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order) //merge_block(&_free_areas[up_id])
+	void set_pageblock_range_type(uint64_t pfn, int order, MigrateType::MigrateType type)
 	{
+		for (uint64_t i = 0; i < pages_per_block(order); i += pages_per_block(PAGEBLOCK_ORDER)) {
+			_pageblock_types[(pfn + i) >> PAGEBLOCK_ORDER] = type;
+		}
+	}
 
-		assert(*block_pointer);
+	/**
+	 * Counts the free pages in a pageblock, other than those on the per-CPU page caches.
+	 * @param pfn The page-frame-number of any page in the pageblock.
+	 */
+	uint64_t pageblock_free_pages(uint64_t pfn) const
+	{
+		uint64_t start = pfn & ~(pages_per_block(PAGEBLOCK_ORDER) - 1);
+		uint64_t end = start + pages_per_block(PAGEBLOCK_ORDER);
+		uint64_t nr = 0;
 
-		// Make sure the area_pointer is correctly aligned.
-		assert(is_correct_alignment_for_order(*block_pointer, source_order));
+		for (pfn = start; pfn < end && pfn < _nr_pages;) {
+			int order;
+			uint64_t block_pfn = find_free_block(pfn, order);
 
-		//remove the source and its buddy
-		remove_block(buddy_of(*block_pointer, source_order), source_order);
-		remove_block((*block_pointer), source_order);
+			if (block_pfn == NO_PFN) {
+				pfn++;
+				continue;
+			}
 
-		//insert up whichever lower page, onto a higher order
-		if ((*block_pointer)<buddy_of(*block_pointer, source_order)) {
-			return insert_block(*block_pointer, source_order+1);
+			nr += pages_per_block(order);
+			pfn = block_pfn + pages_per_block(order);
 		}
 
-		else {
-			return insert_block(buddy_of(*block_pointer, source_order), source_order+1);
+		return nr;
+	}
+
+	/**
+	 * Claims a block taken from a fallback migrate type for the requested type.  A block bigger
+	 * than a pageblock is split down to one pageblock first, with the rest going back to the
+	 * fallback type, and the pageblock changes type.  A smaller block changes its pageblock's
+	 * type only when at least half of the pageblock is free, as Linux does, so that the next
+	 * allocations of this type come from the same pageblock rather than stealing again.
+	 * @param pgd The block, already off its free list.
+	 * @param found_order The order of the block, updated if it is split.
+	 * @param order The order of the allocation.
+	 * @param type The migrate type of the allocation.
+	 */
+	void steal_fallback_block(PageDescriptor *pgd, int& found_order, int order, MigrateType::MigrateType type)
+	{
+		uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+
+		if (found_order >= PAGEBLOCK_ORDER) {
+			int keep = order > PAGEBLOCK_ORDER ? order : PAGEBLOCK_ORDER;
+
+			while (found_order > keep) {
+				_stats[found_order].splits++;
+				found_order--;
+
+				insert_block(pgd + pages_per_block(found_order), found_order);
+			}
+
+			// nothing in the block is on a free list, so only the types change
+			set_pageblock_range_type(pfn, found_order, type);
+
+			return;
 		}
 
+		// the block itself is off its list, so counts separately
+		uint64_t free = pages_per_block(found_order) + pageblock_free_pages(pfn);
 
+		if (free >= pages_per_block(PAGEBLOCK_ORDER - 1)) {
+			set_pageblock_type(pfn, type);
+		}
 	}
 
-public:
 	/**
-	 * Constructs a new instance of the Buddy Page Allocator.
+	 * Takes a free block of at least the given order off its free list.  The smallest block of
+	 * the requested migrate type is preferred.  Failing that, the largest block of a fallback type
+	 * is taken, so that as few pageblocks as possible end up mixing types, and its pageblock is
+	 * claimed for the requested type if enough of it is free.
+	 * @param order The smallest acceptable order.
+	 * @param type The migrate type of the allocation.
+	 * @param found_order Populated with the order of the block taken.
+	 * @return Returns the block taken, or NULL if there is no block big enough.
 	 */
-	BuddyPageAllocator() {
-		// Iterate over each free area, and clear it.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			_free_areas[i] = NULL;
+	PageDescriptor *take_free_block(int order, MigrateType::MigrateType type, int& found_order)
+	{
+		if (!_grouping) {
+			type = MigrateType::UNMOVABLE;
+		}
+
+		for (found_order = order; found_order < MAX_ORDER; found_order++) {
+			PageDescriptor *pgd = _free_areas[found_order][type];
+
+			if (pgd) {
+				remove_block(pgd, found_order);
+				return pgd;
+			}
+		}
+
+		if (!_grouping) {
+			return NULL;
+		}
+
+		for (int i = 0; i < NR_MIGRATE_TYPES - 1; i++) {
+			MigrateType::MigrateType fallback = migrate_fallbacks[type][i];
+
+			for (found_order = MAX_ORDER - 1; found_order >= order; found_order--) {
+				PageDescriptor *pgd = _free_areas[found_order][fallback];
+				if (!pgd) {
+					continue;
+				}
+
+				remove_block(pgd, found_order);
+				_stats[order].fallbacks++;
+
+				steal_fallback_block(pgd, found_order, order, type);
+				return pgd;
+			}
 		}
+
+		return NULL;
 	}
 
 	/**
-	 * Allocates 2^order number of contiguous pages
+	 * Allocates 2^order number of contiguous pages directly from the free areas, bypassing
+	 * the per-CPU page caches.
 	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param type The migrate type of the allocation.
 	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
 	 * allocation failed.
 	 */
-	PageDescriptor *alloc_pages(int order) override
+	PageDescriptor *buddy_alloc_pages(int order, MigrateType::MigrateType type)
 	{
 		//make sure order is within limits
 		assert(order >= 0 && order < MAX_ORDER);
 
+		int found_idx;
+		PageDescriptor *pgd = take_free_block(order, type, found_idx);
 
-		int found_idx = order;
-
-		// ascend the order list to find a free area
-		while ((found_idx < MAX_ORDER-1) && (_free_areas[found_idx] == NULL)) {
-			found_idx++;
-		}
+		// return NULL if can't find a free area, unless merging the deferred blocks
+		// can make one
+		if (!pgd) {
+			if (!coalesce_deferred()) {
+				return NULL;
+			}
 
-		// return NULL if can't find a free area
-		if (found_idx >= MAX_ORDER) {
-			return NULL;
+			return buddy_alloc_pages(order, type);
 		}
 
-		// found free area
-		PageDescriptor *pgd = _free_areas[found_idx];
-
-
-		// keep on splitting until find desired order
+		// keep on splitting until find desired order, giving back the right-hand halves
 		while (found_idx != order) {
-			pgd = split_block(&pgd, found_idx);
-
+			_stats[found_idx].splits++;
 			found_idx--;
-		}
 
-		// dont split this pgd, remove it and return it
-		remove_block(pgd, order);
+			insert_block(pgd + pages_per_block(found_idx), found_idx);
+		}
 
 		return pgd;
-
 	}
 
 	/**
-	 * Frees 2^order contiguous pages.
+	 * Frees 2^order contiguous pages directly into the free areas, bypassing the per-CPU
+	 * page caches.  In lazy mode the block is not merged with its buddy, unless the order
+	 * already has its threshold of deferred blocks.
 	 * @param pgd A pointer to an array of page descriptors to be freed.
 	 * @param order The power of two number of contiguous pages to free.
 	 */
-	void free_pages(PageDescriptor *pgd, int order) override
+	void buddy_free_pages(PageDescriptor *pgd, int order)
 	{
-
 		// Make sure that the incoming page descriptor is correctly aligned
 		// for the order on which it is being freed, for example, it is
 		// illegal to free page 1 in order-1.
 		assert(is_correct_alignment_for_order(pgd, order));
 
-		//free all the pages here.
-		insert_block(pgd, order);
-
-		//start iterating from desired order
-		int up_id = order;
+		if (_lazy && order < MAX_ORDER - 1 && _nr_deferred[order] < _lazy_threshold) {
+			insert_block(pgd, order);
+			set_deferred_block(sys.mm().pgalloc().pgd_to_pfn(pgd), order, true);
+			return;
+		}
 
-		// go up the list
-		while (up_id < MAX_ORDER-1) {
+		merge_free_pages(pgd, order);
+	}
 
-			//find buddy of this page
-			PageDescriptor **slot = &_free_areas[up_id];
+	/**
+	 * Frees 2^order contiguous pages into the free areas, merging the block with its buddy
+	 * all the way up.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+	void merge_free_pages(PageDescriptor *pgd, int order)
+	{
+		// go up the orders, absorbing the buddy for as long as it is free.  The
+		// buddy test is a bitmap lookup, so this is O(MAX_ORDER) in the worst case.
+		while (order < MAX_ORDER - 1) {
+			PageDescriptor *buddy = buddy_of(pgd, order);
 
-			while (*slot && (buddy_of(pgd, up_id) != *slot)) {
-				slot = &(*slot)->next_free;
+			if (!is_free_block(sys.mm().pgalloc().pgd_to_pfn(buddy), order)) {
+				break;
 			}
 
-			//buddy found, merge
-			if (buddy_of(pgd, up_id) == *slot) {
-				pgd = *merge_block(&pgd, up_id);
-				up_id ++;
-				// mm_log.messagef(LogLevel::DEBUG, "successfully merged!: ---------- %d", order);
+			remove_block(buddy, order);
+
+			// a buddy of a pageblock or more takes the type of the block being freed, as in
+			// Linux, so that every free block is of one type and splits onto one set of lists
+			uint64_t buddy_pfn = sys.mm().pgalloc().pgd_to_pfn(buddy);
+			MigrateType::MigrateType type = block_type(sys.mm().pgalloc().pgd_to_pfn(pgd));
+
+			if (order >= PAGEBLOCK_ORDER && block_type(buddy_pfn) != type) {
+				set_pageblock_range_type(buddy_pfn, order, type);
 			}
-			//else next order
-			else {
-				break;
-				// mm_log.messagef(LogLevel::DEBUG, "DID NOT merged!: ---------- %d", order);
+
+			if (buddy < pgd) {
+				pgd = buddy;
 			}
+
+			_stats[order].merges++;
+			order++;
 		}
 
+		insert_block(pgd, order);
 	}
 
-
 	/**
-	 * Reserves a specific page, so that it cannot be allocated.
-	 * @param pgd The page descriptor of the page to reserve.
-	 * @return Returns TRUE if the reservation was successful, FALSE otherwise.
+	 * Merges every deferred block with its buddy, where possible.  Only the orders that have
+	 * deferred blocks are visited, lowest order first, so pairs of deferred buddies meet up and
+	 * carry on into the orders above.
+	 * @return Returns TRUE if there were any deferred blocks, FALSE otherwise.
 	 */
-
-	bool reserve_page(PageDescriptor *pgd)
+	bool coalesce_deferred()
 	{
-			// find the closest order with a free area
-			int found_idx = 0;
-			while ((found_idx < MAX_ORDER-1) && (NULL == _free_areas[found_idx])) {
-				found_idx++;
+		bool any = false;
+		for (int order = 0; order < MAX_ORDER - 1; order++) {
+			if (_nr_deferred[order]) {
+				any = true;
 			}
+		}
 
-			// if no spaces found return false
-			if (found_idx >= MAX_ORDER) {
-				return false;
+		if (!any) {
+			return false;
+		}
+
+		_coalesce.runs++;
+
+		for (int order = 0; order < MAX_ORDER - 1; order++) {
+			if (_nr_deferred[order]) {
+				coalesce_order(order);
 			}
+		}
 
-			// found a free area
-			PageDescriptor **slot = &_free_areas[found_idx];
-			PageDescriptor *right_child;
+		return true;
+	}
 
+	/**
+	 * Takes the deferred blocks of one order off their free lists, and frees each of them again
+	 * with merging.  The blocks that were merged eagerly stay where they are, and each list is
+	 * only walked until all the order's deferred blocks have been found.
+	 * @param order The order to coalesce.
+	 */
+	void coalesce_order(int order)
+	{
+		PageDescriptor *deferred = NULL;
 
-			while (*slot && (pgd >= *slot)) {
+		// take all of them off first, so that a block never sees its buddy as free until
+		// the buddy has been freed again itself
+		for (int type = 0; type < NR_MIGRATE_TYPES && _nr_deferred[order]; type++) {
+			PageDescriptor *pgd = _free_areas[order][type];
 
-				// if the requested page is in the range of this block, split and search this block
-				if (pgd < (*slot)->next_free) {
+			while (pgd && _nr_deferred[order]) {
+				PageDescriptor *next = pgd->next_free;
+				_coalesce.visited++;
 
-							// while the block hasn't been found. keep on splitting
-							while (pgd != *slot && found_idx>0) {
+				if (is_deferred_block(sys.mm().pgalloc().pgd_to_pfn(pgd), order)) {
+					remove_block(pgd, order);
 
-									// split and obtain left, right child blocks at lower order
-									*slot = split_block(slot, found_idx);
+					pgd->next_free = deferred;
+					deferred = pgd;
+				}
 
-									// make sure buddy of this slot is in free list
-									PageDescriptor **search_buddy = slot;
-									while (*search_buddy && (buddy_of(*slot, found_idx-1) > *slot)) {
-										search_buddy = &(*search_buddy)->next_free;
+				pgd = next;
+			}
+		}
 
-										if(buddy_of(*slot, found_idx-1) == *search_buddy) {
-											right_child = buddy_of(*slot, found_idx-1);
-											break;
-										}
-									}
+		while (deferred) {
+			PageDescriptor *next = deferred->next_free;
+			deferred->next_free = NULL;
 
-									// if pgd is less than the right child, split and search left child
-									if (pgd < right_child) {
-										found_idx--;
+			merge_free_pages(deferred, order);
+			_coalesce.merged++;
 
-									}
-									// else split and search the right child
-									else if (pgd >= right_child) {
-										*slot = right_child;
-										found_idx--;
-									}
+			deferred = next;
+		}
+	}
 
-							}
+	/**
+	 * Frees the pages in [pfn, end) by breaking the range up into the largest naturally aligned
+	 * blocks that fit.  This takes O((end - pfn) / 2^(MAX_ORDER-1) + MAX_ORDER) steps.
+	 * @param pfn The page-frame-number of the first page in the range.
+	 * @param end The page-frame-number one past the last page in the range.
+	 */
+	void free_pfn_range(uint64_t pfn, uint64_t end)
+	{
+		while (pfn < end) {
+			// the largest order this PFN is aligned to...
+			int order = (pfn == 0) ? MAX_ORDER - 1 : __builtin_ctzll(pfn);
+			if (order > MAX_ORDER - 1) {
+				order = MAX_ORDER - 1;
+			}
 
-							break;
-				}
+			// ...that also fits in what is left of the range
+			while (pfn + pages_per_block(order) > end) {
+				order--;
+			}
 
-				slot = &(*slot)->next_free;
+			// freeing (rather than just inserting) lets blocks at the edges merge with
+			// neighbouring free blocks
+			merge_free_pages(sys.mm().pgalloc().pfn_to_pgd(pfn), order);
+			pfn += pages_per_block(order);
+		}
+	}
 
+	/**
+	 * Finds the free block that contains the given page.  In each order there is only one
+	 * aligned block that can contain the page, so this is one bitmap test per order.
+	 * @param pfn The page-frame-number of the page.
+	 * @param order Populated with the order of the free block, if one was found.
+	 * @return Returns the page-frame-number of the first page in the free block, or NO_PFN
+	 * if the page is not free.
+	 */
+	uint64_t find_free_block(uint64_t pfn, int& order) const
+	{
+		for (order = 0; order < MAX_ORDER; order++) {
+			uint64_t block_pfn = pfn & ~(pages_per_block(order) - 1);
 
+			if (is_free_block(block_pfn, order)) {
+				return block_pfn;
+			}
 		}
 
-	remove_block(*slot, found_idx);
-	return true;
+		return NO_PFN;
 	}
 
-
 	/**
-	 * Initialises the allocation algorithm.
-	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	 * Allocates 2^order number of contiguous pages, with single pages coming from the per-CPU
+	 * page cache.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param type The migrate type of the allocation.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
 	 */
-	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	PageDescriptor *pcp_or_buddy_alloc_pages(int order, MigrateType::MigrateType type)
 	{
-		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator Initialising pd=%p, nr=0x%lx", page_descriptors, nr_page_descriptors); //0xff..80147000
+		// single pages come from this CPU's page cache, which is refilled a batch at a time
+		if (order == 0) {
+			PerCPUPages& pcp = _pcp[current_cpu()];
 
-		// if there are no pages to be allocated, fail to initialise
-		if (nr_page_descriptors == 0) {
-			return false;
-		}
+			if (!_grouping) {
+				type = MigrateType::UNMOVABLE;
+			}
 
-		// only the highest order contains blocks
-		for (uint64_t i = 0; i < MAX_ORDER-1; i++) {
-			_free_areas[i] = NULL;
-		}
+			if (pcp.pages[type]) {
+				pcp.hits++;
+			} else {
+				pcp.misses++;
+				pcp_refill(pcp, type, pcp.batch);
 
-		_free_areas[MAX_ORDER-1] = &page_descriptors[0]; //17th order has the address of the first physical page
-		PageDescriptor **slot = &_free_areas[MAX_ORDER-1];
+				if (!pcp.pages[type]) {
+					return NULL;
+				}
+			}
 
+			PageDescriptor *pgd = pcp.pages[type];
+			pcp.pages[type] = pgd->next_free;
+			pcp.count--;
 
-		// only if total # physical pages is divisible by the biggest block
-		if (( nr_page_descriptors % pages_per_block(MAX_ORDER-1)) == 0) {
+			pgd->next_free = NULL;
+			return pgd;
+		}
 
-			for (uint64_t i = pages_per_block(MAX_ORDER-1); i < nr_page_descriptors; i+=pages_per_block(MAX_ORDER-1)) {
-				(*slot)->next_free = &page_descriptors[i];
-				slot = &(*slot)->next_free;
+		PageDescriptor *pgd = buddy_alloc_pages(order, type);
 
-			}
+		// pages sitting in the per-CPU caches may be all that stops this block from forming
+		if (!pgd) {
+			pcp_drain_all();
+			pgd = buddy_alloc_pages(order, type);
 		}
-		return true;
-}
 
+		return pgd;
+	}
+
+	/**
+	 * Moves up to 'count' order-0 pages from the free areas onto one list of the per-CPU page cache.
+	 * @param pcp The per-CPU page cache to refill.
+	 * @param type The migrate type of the list to refill.
+	 * @param count The number of pages to move.
+	 */
+	void pcp_refill(PerCPUPages& pcp, MigrateType::MigrateType type, unsigned int count)
+	{
+		while (count--) {
+			PageDescriptor *pgd = buddy_alloc_pages(0, type);
+			if (!pgd) {
+				break;
+			}
 
+			pgd->next_free = pcp.pages[type];
+			pcp.pages[type] = pgd;
+			pcp.count++;
+		}
+	}
 
 	/**
-	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	 * Adds a freed order-0 page to the per-CPU page cache, on the list for its pageblock's
+	 * migrate type, and spills a batch back to the free areas once the cache is over its high
+	 * watermark.
+	 * @param pcp The per-CPU page cache.
+	 * @param pgd The page descriptor of the page.
+	 * @param drain TRUE to drain the cache if it is over its high watermark, FALSE to leave that to the caller.
 	 */
-	const char* name() const override { return "buddy"; }
+	void pcp_free(PerCPUPages& pcp, PageDescriptor *pgd, bool drain)
+	{
+		MigrateType::MigrateType type = block_type(sys.mm().pgalloc().pgd_to_pfn(pgd));
+
+		pgd->next_free = pcp.pages[type];
+		pcp.pages[type] = pgd;
+		pcp.count++;
+
+		if (drain && pcp.count > pcp.high) {
+			pcp_drain(pcp, pcp.count - pcp.low);
+		}
+	}
 
 	/**
-	 * Dumps out the current state of the buddy system
+	 * Returns up to 'count' pages from the per-CPU page cache to the free areas, taking from
+	 * each list in turn.
+	 * @param pcp The per-CPU page cache to drain.
+	 * @param count The number of pages to move.
 	 */
-	void dump_state() const override
+	void pcp_drain(PerCPUPages& pcp, unsigned int count)
 	{
-		// Print out a header, so we can find the output in the logs.
-		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
+		unsigned int type = 0;
 
-		// Iterate over each free area.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			char buffer[256];
-			snprintf(buffer, sizeof(buffer), "[%d] ", i);
+		while (count && pcp.count) {
+			PageDescriptor *pgd = pcp.pages[type];
 
-			// Iterate over each block in the free area.
-			PageDescriptor *pg = _free_areas[i];
-			while (pg) {
-				// Append the PFN of the free block to the output buffer.
-				snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
-				pg = pg->next_free;
+			if (pgd) {
+				pcp.pages[type] = pgd->next_free;
+				pcp.count--;
+				count--;
+
+				pgd->next_free = NULL;
+				buddy_free_pages(pgd, 0);
 			}
 
-			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+			type = (type + 1) % NR_MIGRATE_TYPES;
+		}
+	}
+
+	/**
+	 * Returns every page held in every per-CPU page cache to the free areas.  This is
+	 * needed before anything that must see all of free memory, e.g. a high-order allocation
+	 * that would otherwise fail, or reserving a particular page.
+	 */
+	void pcp_drain_all()
+	{
+		for (unsigned int cpu = 0; cpu < ARRAY_SIZE(_pcp); cpu++) {
+			pcp_drain(_pcp[cpu], _pcp[cpu].count);
 		}
 	}
 
+public:
+	/**
+	 * Constructs a new instance of the Buddy Page Allocator.
+	 */
+	BuddyPageAllocator(bool lazy = false)
+		: _pageblock_types(NULL),
+		_grouping(true),
+		_free_map(NULL),
+		_deferred_map(NULL),
+		_prev_free(NULL),
+		_nr_pages(0),
+		_map_pages(0),
+		_meta_pfn(0),
+		_meta_end(0),
+		_lazy(lazy),
+		_lazy_threshold(LAZY_DEFAULT_THRESHOLD)
+	{
+		// Iterate over each free area, and clear it.
+		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
+			for (unsigned int type = 0; type < NR_MIGRATE_TYPES; type++) {
+				_free_areas[i][type] = NULL;
+			}
+
+			_nr_deferred[i] = 0;
+			_stats[i] = BuddyOrderStats();
+		}
 
-private:
-	PageDescriptor *_free_areas[MAX_ORDER]; //there are 18 items, from orders 0-17
+		_coalesce = BuddyCoalesceStats();
 
+		// Start each per-CPU page cache empty, with the default watermarks.
+		for (unsigned int i = 0; i < ARRAY_SIZE(_pcp); i++) {
+			for (unsigned int type = 0; type < NR_MIGRATE_TYPES; type++) {
+				_pcp[i].pages[type] = NULL;
+			}
+
+			_pcp[i].count = 0;
+			_pcp[i].high = PCP_DEFAULT_HIGH;
+			_pcp[i].low = PCP_DEFAULT_LOW;
+			_pcp[i].batch = PCP_DEFAULT_BATCH;
+			_pcp[i].hits = 0;
+			_pcp[i].misses = 0;
+		}
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *alloc_pages(int order) override
+	{
+		// callers that do not say otherwise are the kernel itself, which cannot move its pages
+		return alloc_pages(order, MigrateType::UNMOVABLE);
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages, from pageblocks of the given migrate type
+	 * where possible.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param type How the allocated pages can be moved about.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *alloc_pages(int order, MigrateType::MigrateType type)
+	{
+		PageDescriptor *pgd = pcp_or_buddy_alloc_pages(order, type);
+
+		if (pgd) {
+			_stats[order].allocs++;
+		} else {
+			_stats[order].failed_allocs++;
+		}
+
+		return pgd;
+	}
+
+	/**
+	 * Frees 2^order contiguous pages.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+	void free_pages(PageDescriptor *pgd, int order) override
+	{
+		_stats[order].frees++;
+
+		// single pages go back onto this CPU's page cache, and spill back to the free
+		// areas a batch at a time once it reaches its high watermark
+		if (order == 0) {
+			pcp_free(_pcp[current_cpu()], pgd, true);
+			return;
+		}
+
+		buddy_free_pages(pgd, order);
+	}
+
+	/**
+	 * Allocates up to 'count' blocks of 2^order contiguous pages in one pass.  Rather than
+	 * searching and splitting once per block, each free block found is taken once and all of
+	 * its pieces are handed out, with any unused tail going straight back to the free areas.
+	 * @param order The power of two, of the number of contiguous pages in each block.
+	 * @param count The number of blocks to allocate.
+	 * @param pages Populated with the first page descriptor of each allocated block.
+	 * @param type The migrate type of the allocation.
+	 * @return Returns the number of blocks allocated, which is less than 'count' if memory ran out.
+	 */
+	unsigned int alloc_pages_bulk(int order, unsigned int count, PageDescriptor **pages,
+		MigrateType::MigrateType type = MigrateType::UNMOVABLE)
+	{
+		assert(order >= 0 && order < MAX_ORDER);
+
+		unsigned int nr = 0;
+
+		if (!_grouping) {
+			type = MigrateType::UNMOVABLE;
+		}
+
+		// single pages come from this CPU's page cache first, while it lasts
+		if (order == 0) {
+			PerCPUPages& pcp = _pcp[current_cpu()];
+
+			while (nr < count && pcp.pages[type]) {
+				PageDescriptor *pgd = pcp.pages[type];
+				pcp.pages[type] = pgd->next_free;
+				pcp.count--;
+				pcp.hits++;
+
+				pgd->next_free = NULL;
+				pages[nr++] = pgd;
+			}
+		}
+
+		bool drained = false;
+		while (nr < count) {
+			int found_idx;
+			PageDescriptor *block = take_free_block(order, type, found_idx);
+
+			if (!block) {
+				// give the per-CPU caches back and merge the deferred blocks once, in case
+				// that is what is missing
+				if (drained) {
+					break;
+				}
+
+				pcp_drain_all();
+				coalesce_deferred();
+				drained = true;
+				continue;
+			}
+
+			// carve the whole block into as many pieces as are still wanted
+
+			uint64_t pieces = pages_per_block(found_idx - order);
+			uint64_t used = (count - nr < pieces) ? (count - nr) : pieces;
+
+			for (int i = order + 1; i <= found_idx; i++) {
+				_stats[i].splits++;
+			}
+
+			for (uint64_t i = 0; i < used; i++) {
+				pages[nr++] = block + (i << order);
+			}
+
+			// anything left over is returned as the largest aligned blocks that fit
+			if (used < pieces) {
+				uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+				free_pfn_range(pfn + (used << order), pfn + pages_per_block(found_idx));
+			}
+		}
+
+		_stats[order].allocs += nr;
+		if (nr < count) {
+			_stats[order].failed_allocs++;
+		}
+
+		return nr;
+	}
+
+	/**
+	 * Frees 'count' blocks of 2^order contiguous pages in one pass.  Runs of blocks that follow
+	 * on from each other in memory, as alloc_pages_bulk() hands them out, are freed as the
+	 * largest aligned blocks that make them up, rather than being merged one block at a time.
+	 * Single pages on their own go onto this CPU's page cache, which is drained at most once.
+	 * @param order The power of two number of contiguous pages in each block.
+	 * @param count The number of blocks to free.
+	 * @param pages The first page descriptor of each block to free.
+	 */
+	void free_pages_bulk(int order, unsigned int count, PageDescriptor **pages)
+	{
+		PerCPUPages& pcp = _pcp[current_cpu()];
+
+		_stats[order].frees += count;
+
+		unsigned int i = 0;
+		while (i < count) {
+			uint64_t start = sys.mm().pgalloc().pgd_to_pfn(pages[i]);
+			uint64_t end = start + pages_per_block(order);
+
+			assert(is_correct_alignment_for_order(pages[i], order));
+
+			for (i++; i < count && sys.mm().pgalloc().pgd_to_pfn(pages[i]) == end; i++) {
+				end += pages_per_block(order);
+			}
+
+			if (order == 0 && end == start + 1) {
+				pcp_free(pcp, pages[i - 1], false);
+			} else if (end == start + pages_per_block(order)) {
+				buddy_free_pages(pages[i - 1], order);
+			} else {
+				free_pfn_range(start, end);
+			}
+		}
+
+		if (pcp.count > pcp.high) {
+			pcp_drain(pcp, pcp.count - pcp.low);
+		}
+	}
+
+	/**
+	 * Turns grouping of pages by migrate type on or off.  With grouping off, every allocation
+	 * shares one set of free lists, whatever its type.  This can only be changed before init().
+	 * @param grouping TRUE to group pages by migrate type, FALSE otherwise.
+	 * @return Returns TRUE if the setting was applied, FALSE if the allocator is already initialised.
+	 */
+	bool set_migrate_grouping(bool grouping)
+	{
+		if (_nr_pages) {
+			return false;
+		}
+
+		_grouping = grouping;
+		return true;
+	}
+
+	/**
+	 * Sets how many blocks each order may hold without merging them, in lazy mode.
+	 * @param threshold The maximum number of deferred blocks per order.
+	 */
+	void set_lazy_threshold(unsigned int threshold)
+	{
+		_lazy_threshold = threshold;
+	}
+
+	/**
+	 * Sets the watermarks of the per-CPU page caches.
+	 * @param high The number of cached pages above which a cache is drained.
+	 * @param low The number of pages a cache is drained down to.
+	 * @param batch The number of pages an empty cache is refilled with.
+	 * @return Returns TRUE if the watermarks were valid and applied, FALSE otherwise.
+	 */
+	bool set_pcp_watermarks(unsigned int high, unsigned int low, unsigned int batch)
+	{
+		if (low > high || batch == 0 || batch > high) {
+			return false;
+		}
+
+		for (unsigned int cpu = 0; cpu < ARRAY_SIZE(_pcp); cpu++) {
+			_pcp[cpu].high = high;
+			_pcp[cpu].low = low;
+			_pcp[cpu].batch = batch;
+
+			if (_pcp[cpu].count > high) {
+				pcp_drain(_pcp[cpu], _pcp[cpu].count - low);
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Retrieves the hit and miss counters of a per-CPU page cache.
+	 * @param cpu The CPU whose page cache to query.
+	 * @param hits Populated with the number of order-0 allocations served from the cache.
+	 * @param misses Populated with the number of order-0 allocations that needed a refill.
+	 * @return Returns TRUE if the CPU number was valid, FALSE otherwise.
+	 */
+	bool pcp_stats(unsigned int cpu, uint64_t& hits, uint64_t& misses) const
+	{
+		if (cpu >= ARRAY_SIZE(_pcp)) {
+			return false;
+		}
+
+		hits = _pcp[cpu].hits;
+		misses = _pcp[cpu].misses;
+		return true;
+	}
+
+	/**
+	 * Reserves a specific page, so that it cannot be allocated.
+	 * @param pgd The page descriptor of the page to reserve.
+	 * @return Returns TRUE if the reservation was successful, FALSE otherwise.
+	 */
+	bool reserve_page(PageDescriptor *pgd)
+	{
+		return reserve_range(sys.mm().pgalloc().pgd_to_pfn(pgd), 1);
+	}
+
+	/**
+	 * Reserves a range of pages, so that none of them can be allocated.  Free blocks that lie
+	 * wholly inside the range are taken off their free lists whole, and only the (at most two)
+	 * blocks straddling the edges of the range are split.
+	 * @param start_pfn The page-frame-number of the first page to reserve.
+	 * @param nr_pages The number of pages to reserve.
+	 * @return Returns TRUE if the reservation was successful, or FALSE (having changed nothing) if
+	 * any page in the range is not free.
+	 */
+	bool reserve_range(uint64_t start_pfn, uint64_t nr_pages)
+	{
+		uint64_t end_pfn = start_pfn + nr_pages;
+
+		if (nr_pages == 0 || end_pfn > _nr_pages) {
+			return false;
+		}
+
+		// pages in the range might be sitting in a per-CPU cache, so give those back first
+		pcp_drain_all();
+
+		// make sure the whole range is free before touching anything
+		uint64_t pfn = start_pfn;
+		while (pfn < end_pfn) {
+			int order;
+			uint64_t block_pfn = find_free_block(pfn, order);
+
+			if (block_pfn == NO_PFN) {
+				return false;
+			}
+
+			pfn = block_pfn + pages_per_block(order);
+		}
+
+		// now take each free block out, and give back whatever sticks out of the range
+		pfn = start_pfn;
+		while (pfn < end_pfn) {
+			int order;
+			uint64_t block_pfn = find_free_block(pfn, order);
+			uint64_t block_end = block_pfn + pages_per_block(order);
+
+			remove_block(sys.mm().pgalloc().pfn_to_pgd(block_pfn), order);
+
+			if (block_pfn < start_pfn) {
+				free_pfn_range(block_pfn, start_pfn);
+			}
+
+			if (block_end > end_pfn) {
+				free_pfn_range(end_pfn, block_end);
+			}
+
+			pfn = block_end;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Initialises the allocation algorithm.
+	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	 */
+	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	{
+		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator Initialising pd=%p, nr=0x%lx", page_descriptors, nr_page_descriptors);
+
+		// if there are no pages to be allocated, fail to initialise
+		if (nr_page_descriptors == 0) {
+			return false;
+		}
+
+		// the free list back-links are 32-bit page-frame-numbers (16TiB of 4KiB pages)
+		if (nr_page_descriptors >= NO_PFN) {
+			mm_log.messagef(LogLevel::ERROR, "Buddy Allocator can only manage 0x%lx of 0x%lx pages", (uint64_t) NO_PFN, nr_page_descriptors);
+			return false;
+		}
+
+		if (_meta_end == 0) {
+			mm_log.messagef(LogLevel::ERROR, "Buddy Allocator has not been given a usable range for its bookkeeping");
+			return false;
+		}
+
+		if (!alloc_bookkeeping(nr_page_descriptors)) {
+			mm_log.messagef(LogLevel::ERROR, "Buddy Allocator has no room for its bookkeeping in pfn 0x%lx-0x%lx", _meta_pfn, _meta_end);
+			return false;
+		}
+
+		// start with every free area empty
+		for (uint64_t i = 0; i < MAX_ORDER; i++) {
+			for (unsigned int type = 0; type < NR_MIGRATE_TYPES; type++) {
+				_free_areas[i][type] = NULL;
+			}
+		}
+
+		// every pageblock starts out movable, and unmovable allocations claim whole
+		// pageblocks from them as they need to
+		for (uint64_t i = 0; i < (_map_pages >> PAGEBLOCK_ORDER); i++) {
+			_pageblock_types[i] = MigrateType::MOVABLE;
+		}
+
+		for (uint64_t i = 0; i < (2 * _map_pages) / 64; i++) {
+			_free_map[i] = 0;
+			_deferred_map[i] = 0;
+		}
+
+		for (uint64_t i = 0; i < MAX_ORDER; i++) {
+			_nr_deferred[i] = 0;
+			_stats[i] = BuddyOrderStats();
+		}
+
+		_coalesce = BuddyCoalesceStats();
+
+		// the whole descriptor array is one usable range; any holes in it are
+		// taken out afterwards by reserving them
+		add_free_range(page_descriptors, nr_page_descriptors);
+
+		return true;
+	}
+
+	/**
+	 * Gives the allocator a range of pages that the memory map reports as usable RAM, for init()
+	 * to place its bookkeeping in.  Nothing else is known to be safe to write to before the
+	 * holes in memory have been reserved, so init() fails without one.  This can only be set
+	 * before init().
+	 * @param start_pfn The page-frame-number of the first page in the range.
+	 * @param nr_pages The number of pages in the range.
+	 * @return Returns TRUE if the range was applied, FALSE if the allocator is already initialised.
+	 */
+	bool set_bookkeeping_range(uint64_t start_pfn, uint64_t nr_pages)
+	{
+		if (_nr_pages) {
+			return false;
+		}
+
+		_meta_pfn = start_pfn;
+		_meta_end = start_pfn + nr_pages;
+		return true;
+	}
+
+	/**
+	 * Sizes the free-area bookkeeping for the given number of pages, and places it at the start
+	 * of the range given to set_bookkeeping_range().  Those pages are then never handed out.  The
+	 * bitmaps cover the page count rounded up to a whole top-order block, so every order's
+	 * region divides evenly.
+	 * @param nr_pages The number of pages to manage.
+	 * @return Returns TRUE if the bookkeeping fits in the range, FALSE otherwise.
+	 */
+	bool alloc_bookkeeping(uint64_t nr_pages)
+	{
+		uint64_t map_pages = (nr_pages + pages_per_block(MAX_ORDER - 1) - 1) & ~(pages_per_block(MAX_ORDER - 1) - 1);
+
+		uint64_t map_bytes = (2 * map_pages) / 8;
+		uint64_t bytes = (2 * map_bytes) + (nr_pages * sizeof(uint32_t)) + (map_pages >> PAGEBLOCK_ORDER);
+		uint64_t meta_pages = (bytes + 0xfff) >> 12;
+
+		if (_meta_end > nr_pages || _meta_pfn + meta_pages > _meta_end) {
+			return false;
+		}
+
+		_nr_pages = nr_pages;
+		_map_pages = map_pages;
+		_meta_end = _meta_pfn + meta_pages;
+
+		uintptr_t base = (uintptr_t) sys.mm().pgalloc().pgd_to_kva(sys.mm().pgalloc().pfn_to_pgd(_meta_pfn));
+
+		_free_map = (uint64_t *) base;
+		_deferred_map = (uint64_t *) (base + map_bytes);
+		_prev_free = (uint32_t *) (base + (2 * map_bytes));
+		_pageblock_types = (uint8_t *) (base + (2 * map_bytes) + (nr_pages * sizeof(uint32_t)));
+
+		mm_log.messagef(LogLevel::DEBUG, "Buddy Allocator bookkeeping takes 0x%lx pages at pfn 0x%lx", meta_pages, _meta_pfn);
+		return true;
+	}
+
+	/**
+	 * Adds a range of usable pages to the free areas, e.g. one usable region of the memory map.
+	 * The range is broken up into the largest naturally aligned blocks that fit, so this takes
+	 * O(count / 2^(MAX_ORDER-1) + MAX_ORDER) steps, and never touches the pages in between.
+	 * @param start The page descriptor of the first page in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void add_free_range(PageDescriptor *start, uint64_t count)
+	{
+		uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(start);
+		uint64_t end = pfn + count;
+
+		// leave out the pages that hold the allocator's own bookkeeping
+		if (pfn < _meta_pfn) {
+			free_pfn_range(pfn, end < _meta_pfn ? end : _meta_pfn);
+		}
+
+		if (end > _meta_end) {
+			free_pfn_range(pfn > _meta_end ? pfn : _meta_end, end);
+		}
+	}
+
+	/**
+	 * Returns the counters for the given order.  This reads a snapshot of counters the allocator
+	 * keeps up to date as it goes, so it never walks the free lists.
+	 * @param order The order to query.
+	 */
+	const BuddyOrderStats& order_stats(int order) const
+	{
+		assert(order >= 0 && order < MAX_ORDER);
+		return _stats[order];
+	}
+
+	/**
+	 * Returns the counters for merging deferred blocks, which stay at zero unless merging is lazy.
+	 */
+	const BuddyCoalesceStats& coalesce_stats() const
+	{
+		return _coalesce;
+	}
+
+	/**
+	 * Returns the number of free pages, including those held in the per-CPU page caches.
+	 */
+	uint64_t nr_free_pages() const
+	{
+		uint64_t nr = 0;
+
+		for (int order = 0; order < MAX_ORDER; order++) {
+			nr += _stats[order].free_blocks * pages_per_block(order);
+		}
+
+		for (unsigned int cpu = 0; cpu < ARRAY_SIZE(_pcp); cpu++) {
+			nr += _pcp[cpu].count;
+		}
+
+		return nr;
+	}
+
+	/**
+	 * Computes the fragmentation index of the given order, in thousandths.  Values towards 0
+	 * mean an allocation of this order would fail for lack of memory, values towards 1000 mean
+	 * it would fail because free memory is fragmented.  Returns -1000 when a block of this
+	 * order (or larger) is free, as an allocation would succeed.
+	 * @param order The order of the allocation to consider.
+	 */
+	int fragmentation_index(int order) const
+	{
+		assert(order >= 0 && order < MAX_ORDER);
+
+		uint64_t free_pages = 0, free_blocks = 0;
+		for (int i = 0; i < MAX_ORDER; i++) {
+			if (i >= order && _stats[i].free_blocks) {
+				return -1000;
+			}
+
+			free_pages += _stats[i].free_blocks * pages_per_block(i);
+			free_blocks += _stats[i].free_blocks;
+		}
+
+		if (free_blocks == 0) {
+			return 0;
+		}
+
+		return 1000 - (int)((1000 + (free_pages * 1000) / pages_per_block(order)) / free_blocks);
+	}
+
+	/**
+	 * Walks every free list and checks the allocator's invariants: each free block is aligned,
+	 * in range, on the list for its order and migrate type, and marked in the free bitmap; no
+	 * free block overlaps another; and no two buddies are both free unless one was freed lazily.
+	 * This visits every free block, so it is for debugging rather than for a live system.
+	 * @return Returns TRUE if every invariant holds, FALSE (having logged the first violation) otherwise.
+	 */
+	bool check_invariants() const
+	{
+		for (int order = 0; order < MAX_ORDER; order++) {
+			uint64_t nr_blocks = 0;
+
+			for (int type = 0; type < NR_MIGRATE_TYPES; type++) {
+				uint64_t prev = NO_PFN;
+
+				for (PageDescriptor *pg = _free_areas[order][type]; pg; pg = pg->next_free) {
+					uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pg);
+					nr_blocks++;
+
+					if (pfn + pages_per_block(order) > _nr_pages || (pfn % pages_per_block(order)) != 0) {
+						mm_log.messagef(LogLevel::ERROR, "buddy: block %lx is misaligned or out of range in order %d", pfn, order);
+						return false;
+					}
+
+					if (!is_free_block(pfn, order) || block_type(pfn) != type || _prev_free[pfn] != prev) {
+						mm_log.messagef(LogLevel::ERROR, "buddy: block %lx is on the wrong list in order %d", pfn, order);
+						return false;
+					}
+
+					// a free block must not lie inside a larger free block
+					for (int above = order + 1; above < MAX_ORDER; above++) {
+						if (is_free_block(pfn & ~(pages_per_block(above) - 1), above)) {
+							mm_log.messagef(LogLevel::ERROR, "buddy: block %lx in order %d overlaps a block in order %d", pfn, order, above);
+							return false;
+						}
+					}
+
+					// nor can its buddy be free, unless merging one of them was deferred
+					if (order < MAX_ORDER - 1 && !is_deferred_block(pfn, order)) {
+						uint64_t buddy_pfn = pfn ^ pages_per_block(order);
+
+						if (is_free_block(buddy_pfn, order) && !is_deferred_block(buddy_pfn, order)) {
+							mm_log.messagef(LogLevel::ERROR, "buddy: block %lx and its buddy are both free in order %d", pfn, order);
+							return false;
+						}
+					}
+
+					prev = pfn;
+				}
+			}
+
+			if (nr_blocks != _stats[order].free_blocks) {
+				mm_log.messagef(LogLevel::ERROR, "buddy: order %d has %lu free blocks, but counted %lu", order, nr_blocks, _stats[order].free_blocks);
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "buddy"; }
+
+	/**
+	 * Dumps out the current state of the buddy system
+	 */
+	void dump_state() const override
+	{
+		// Print out a header, so we can find the output in the logs.
+		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
+
+		// Print out the counters for each order, rather than walking the free lists.
+		for (int i = 0; i < MAX_ORDER; i++) {
+			const BuddyOrderStats& st = _stats[i];
+
+			mm_log.messagef(LogLevel::DEBUG, "[%d] free=%lu allocs=%lu frees=%lu splits=%lu merges=%lu failed=%lu frag=%d",
+				i, st.free_blocks, st.allocs, st.frees, st.splits, st.merges, st.failed_allocs, fragmentation_index(i));
+		}
+
+		// Print out the per-CPU page caches, so the batch sizes can be tuned.
+		for (unsigned int i = 0; i < ARRAY_SIZE(_pcp); i++) {
+			mm_log.messagef(LogLevel::DEBUG, "PCP[%d] count=%d high=%d low=%d batch=%d hits=%lu misses=%lu",
+				i, _pcp[i].count, _pcp[i].high, _pcp[i].low, _pcp[i].batch, _pcp[i].hits, _pcp[i].misses);
+		}
+
+		if (_lazy) {
+			mm_log.messagef(LogLevel::DEBUG, "COALESCE runs=%lu visited=%lu merged=%lu",
+				_coalesce.runs, _coalesce.visited, _coalesce.merged);
+		}
+	}
+
+
+private:
+	// Marks the end of a free list in _prev_free.
+	static const uint32_t NO_PFN = 0xffffffff;
+
+	PageDescriptor *_free_areas[MAX_ORDER][NR_MIGRATE_TYPES]; //there are 17 orders, from 0-16, with a list per migrate type
+
+	// The migrate type of each pageblock, and whether it is used to pick free lists at all.
+	uint8_t *_pageblock_types;
+	bool _grouping;
+
+	// One bit per naturally aligned block, per order, set when that block is on its free list.
+	uint64_t *_free_map;
+
+	// One bit per block, laid out as _free_map, set when a free block was freed lazily
+	// and has not yet been merged with its buddy.
+	uint64_t *_deferred_map;
+	unsigned int _nr_deferred[MAX_ORDER];
+
+	// The back-links of the (doubly linked) free lists, indexed by page-frame-number.
+	uint32_t *_prev_free;
+
+	// The bookkeeping above is sized at init(), and lives in the pages [_meta_pfn, _meta_end),
+	// which before init() is the range it may be placed in.
+	uint64_t _nr_pages;
+	uint64_t _map_pages;		// the pages the bitmaps cover, a whole number of top-order blocks
+	uint64_t _meta_pfn;
+	uint64_t _meta_end;
+
+	// The order-0 page caches, one per CPU.
+	PerCPUPages _pcp[NR_PCP_CPUS];
+
+	// The counters for each order, and for merging deferred blocks.
+	BuddyOrderStats _stats[MAX_ORDER];
+	BuddyCoalesceStats _coalesce;
+
+	// Whether freed blocks are merged lazily, and how many may be left unmerged per order.
+	bool _lazy;
+	unsigned int _lazy_threshold;
+
+};
+
+/**
+ * A buddy page allocation algorithm that defers merging freed blocks with their buddies,
+ * so that blocks freed and reallocated at the same order are not merged and split again.
+ */
+class LazyBuddyPageAllocator : public BuddyPageAllocator
+{
+public:
+	LazyBuddyPageAllocator() : BuddyPageAllocator(true) { }
+
+	/**
+	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "lazy-buddy"; }
 };
 
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
@@ -441,3 +1554,4 @@ private:
  * Allocation algorithm registration framework
  */
 RegisterPageAllocator(BuddyPageAllocator);
+RegisterPageAllocator(LazyBuddyPageAllocator);
@@ -0,0 +1,741 @@
+/*
+ * Gzip Block Device
+ */
+#include "gzip-device.h"
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+
+using namespace infos::drivers::block;
+using namespace infos::kernel;
+using namespace infos::locking;
+using namespace infos::util;
+
+// The base values and extra bits of the deflate length and distance codes.
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t distance_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t distance_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// The order the lengths of the code length code are stored in.
+static const uint8_t code_length_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+uint32_t GzipBlockDevice::crc_table[256];
+
+/**
+ * Fills in the table for computing the CRC-32 of the output a byte at a time, the first time
+ * it is needed.
+ */
+void GzipBlockDevice::build_crc_table()
+{
+	if (crc_table[1]) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (unsigned int bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+		}
+
+		crc_table[i] = crc;
+	}
+}
+
+/**
+ * Constructs a device that presents the decompressed contents of a gzip stream, by inflating
+ * the whole stream once.  valid() says whether the stream could be inflated.
+ * @param compressed The device holding the gzip stream.
+ */
+GzipBlockDevice::GzipBlockDevice(BlockDevice& compressed)
+	: _compressed(compressed),
+	_compressed_length((uint64_t) compressed.block_count() * 512),
+	_valid(false),
+	_length(0),
+	_stored_remaining(0),
+	_match_length(0),
+	_match_distance(0),
+	_failed(false),
+	_input_block(0),
+	_input_blocks(0),
+	_checkpoints(NULL),
+	_nr_checkpoints(0),
+	_checkpoint_capacity(0),
+	_scanning(true),
+	_crc(0),
+	_member_start(0)
+{
+	build_crc_table();
+
+	_window = new uint8_t[GZIP_WINDOW_SIZE];
+	_input = new uint8_t[GZIP_INPUT_BLOCKS * 512];
+
+	_state.mode = GzipMode::MEMBER_HEADER;
+	_state.last = false;
+	_state.in_pos = 0;
+	_state.bit_buffer = 0;
+	_state.bit_count = 0;
+	_state.out_pos = 0;
+	_state.nr_members = 0;
+
+	// Inflate the whole stream, throwing the output away, to find how long it is, to record
+	// the checkpoints, and to check the CRC and length of each member.
+	while (inflate(NULL, GZIP_CHECKPOINT_SPACING));
+
+	_scanning = false;
+	_valid = _state.mode == GzipMode::END;
+	_length = _state.out_pos;
+
+	if (_valid) {
+		syslog.messagef(LogLevel::INFO, "gzip: %lu bytes inflate to %lu, with %u checkpoints",
+			(unsigned long) _compressed_length, (unsigned long) _length, _nr_checkpoints);
+	} else {
+		syslog.messagef(LogLevel::WARNING, "gzip: stream is corrupt after %lu bytes of output", (unsigned long) _length);
+	}
+}
+
+GzipBlockDevice::~GzipBlockDevice()
+{
+	for (unsigned int i = 0; i < _nr_checkpoints; i++) {
+		delete[] _checkpoints[i].window;
+	}
+
+	delete[] _checkpoints;
+	delete[] _input;
+	delete[] _window;
+}
+
+/**
+ * Checks whether a device holds a gzip stream, by looking for the gzip magic number.
+ * @param device The device to check.
+ * @return Returns true if the device starts with a gzip header.
+ */
+bool GzipBlockDevice::is_gzip(BlockDevice& device)
+{
+	if (device.block_count() == 0) {
+		return false;
+	}
+
+	uint8_t *block = new uint8_t[device.block_size()];
+	device.read_blocks(block, 0, 1);
+
+	bool gzip = block[0] == 0x1f && block[1] == 0x8b && block[2] == 8;
+
+	delete[] block;
+	return gzip;
+}
+
+/**
+ * Returns the next byte of compressed input, reading more from the device when needed.
+ * @return Returns the byte, or -1 at the end of the device.
+ */
+int GzipBlockDevice::next_byte()
+{
+	if (_state.in_pos >= _compressed_length) {
+		return -1;
+	}
+
+	uint64_t block = _state.in_pos / 512;
+
+	if (block < _input_block || block >= _input_block + _input_blocks) {
+		size_t count = GZIP_INPUT_BLOCKS;
+		if (count > _compressed.block_count() - block) {
+			count = _compressed.block_count() - block;
+		}
+
+		_compressed.read_blocks(_input, block, count);
+		_input_block = block;
+		_input_blocks = count;
+	}
+
+	return _input[_state.in_pos++ - (_input_block * 512)];
+}
+
+/**
+ * Returns the next whole byte of input, which must be at a byte boundary, taking it from the
+ * bit buffer first if that still holds any.
+ * @return Returns the byte, or -1 at the end of the device.
+ */
+int GzipBlockDevice::read_byte()
+{
+	if (_state.bit_count >= 8) {
+		return bits(8);
+	}
+
+	return next_byte();
+}
+
+/**
+ * Returns the given number of bits of input, least significant first.
+ * @param count The number of bits, which must be at most 16.
+ * @return Returns the bits, or zero if the input ran out, in which case the stream is failed.
+ */
+int GzipBlockDevice::bits(unsigned int count)
+{
+	while (_state.bit_count < count) {
+		int byte = next_byte();
+		if (byte < 0) {
+			_failed = true;
+			return 0;
+		}
+
+		_state.bit_buffer |= (uint64_t) byte << _state.bit_count;
+		_state.bit_count += 8;
+	}
+
+	int value = _state.bit_buffer & ((1u << count) - 1);
+	_state.bit_buffer >>= count;
+	_state.bit_count -= count;
+
+	return value;
+}
+
+/**
+ * Throws away the bits up to the next byte boundary.
+ */
+void GzipBlockDevice::align()
+{
+	unsigned int partial = _state.bit_count & 7;
+
+	_state.bit_buffer >>= partial;
+	_state.bit_count -= partial;
+}
+
+/**
+ * Builds a canonical Huffman code from the code length of each symbol.
+ * @param h Populated with the code.
+ * @param lengths The code length of each symbol, where zero means the symbol is unused.
+ * @param count The number of symbols.
+ * @return Returns false if the lengths describe more codes than there is room for.
+ */
+bool GzipBlockDevice::build(Huffman& h, const uint8_t *lengths, unsigned int count)
+{
+	for (unsigned int length = 0; length < 16; length++) {
+		h.count[length] = 0;
+	}
+
+	for (unsigned int symbol = 0; symbol < count; symbol++) {
+		h.count[lengths[symbol]]++;
+	}
+
+	if (h.count[0] == count) {
+		return true;
+	}
+
+	int left = 1;
+	for (unsigned int length = 1; length < 16; length++) {
+		left <<= 1;
+		left -= h.count[length];
+
+		if (left < 0) {
+			return false;
+		}
+	}
+
+	// Lay the symbols out in code order: by length, and then by symbol.
+	uint16_t offsets[16];
+	offsets[1] = 0;
+	for (unsigned int length = 1; length < 15; length++) {
+		offsets[length + 1] = offsets[length] + h.count[length];
+	}
+
+	for (unsigned int symbol = 0; symbol < count; symbol++) {
+		if (lengths[symbol]) {
+			h.symbol[offsets[lengths[symbol]]++] = symbol;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Decodes one symbol from the input, one bit at a time.  Canonical codes of each length are
+ * consecutive, so it is enough to know the first code and the number of codes of each length.
+ * @param h The code to decode with.
+ * @return Returns the symbol, or -1 if the input is not a valid code.
+ */
+int GzipBlockDevice::decode(const Huffman& h)
+{
+	int code = 0, first = 0, index = 0;
+
+	for (unsigned int length = 1; length < 16; length++) {
+		code |= bits(1);
+
+		int count = h.count[length];
+		if (code - count < first) {
+			return h.symbol[index + (code - first)];
+		}
+
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+
+	return -1;
+}
+
+/**
+ * Sets up the fixed codes used by deflate blocks of type 1.
+ */
+bool GzipBlockDevice::fixed_codes()
+{
+	uint8_t lengths[288];
+
+	for (unsigned int symbol = 0; symbol < 288; symbol++) {
+		if (symbol < 144) {
+			lengths[symbol] = 8;
+		} else if (symbol < 256) {
+			lengths[symbol] = 9;
+		} else if (symbol < 280) {
+			lengths[symbol] = 7;
+		} else {
+			lengths[symbol] = 8;
+		}
+	}
+
+	build(_lencode, lengths, 288);
+
+	for (unsigned int symbol = 0; symbol < 30; symbol++) {
+		lengths[symbol] = 5;
+	}
+
+	build(_distcode, lengths, 30);
+	return true;
+}
+
+/**
+ * Reads the codes of a deflate block of type 2, which are themselves Huffman coded.
+ * @return Returns false if the codes are malformed.
+ */
+bool GzipBlockDevice::dynamic_codes()
+{
+	uint8_t lengths[286 + 30];
+
+	unsigned int nr_lengths = bits(5) + 257;
+	unsigned int nr_distances = bits(5) + 1;
+	unsigned int nr_codes = bits(4) + 4;
+
+	if (nr_lengths > 286 || nr_distances > 30) {
+		return false;
+	}
+
+	for (unsigned int i = 0; i < 19; i++) {
+		lengths[code_length_order[i]] = i < nr_codes ? bits(3) : 0;
+	}
+
+	// The code lengths code goes in the length code for now, as it is rebuilt below.
+	if (!build(_lencode, lengths, 19)) {
+		return false;
+	}
+
+	unsigned int index = 0;
+	while (index < nr_lengths + nr_distances) {
+		int symbol = decode(_lencode);
+		if (symbol < 0 || _failed) {
+			return false;
+		}
+
+		if (symbol < 16) {
+			lengths[index++] = symbol;
+			continue;
+		}
+
+		uint8_t length = 0;
+		unsigned int repeat;
+
+		if (symbol == 16) {
+			if (index == 0) {
+				return false;
+			}
+
+			length = lengths[index - 1];
+			repeat = 3 + bits(2);
+		} else if (symbol == 17) {
+			repeat = 3 + bits(3);
+		} else {
+			repeat = 11 + bits(7);
+		}
+
+		if (index + repeat > nr_lengths + nr_distances) {
+			return false;
+		}
+
+		while (repeat--) {
+			lengths[index++] = length;
+		}
+	}
+
+	// a block must be able to end
+	if (lengths[256] == 0) {
+		return false;
+	}
+
+	return build(_lencode, lengths, nr_lengths) && build(_distcode, lengths + nr_lengths, nr_distances);
+}
+
+/**
+ * Reads the header of a gzip member, skipping over the optional fields.
+ * @return Returns false if there is no member header here.
+ */
+bool GzipBlockDevice::member_header()
+{
+	if (read_byte() != 0x1f || read_byte() != 0x8b || read_byte() != 8) {
+		return false;
+	}
+
+	int flags = read_byte();
+
+	// modification time, extra flags and operating system
+	for (unsigned int i = 0; i < 6; i++) {
+		read_byte();
+	}
+
+	if (flags & 4) {
+		int length = read_byte();
+		length |= read_byte() << 8;
+
+		while (length-- > 0) {
+			read_byte();
+		}
+	}
+
+	// the file name and the comment are NUL terminated
+	for (unsigned int field = 8; field <= 16; field <<= 1) {
+		if (flags & field) {
+			int ch;
+			do {
+				ch = read_byte();
+			} while (ch > 0);
+		}
+	}
+
+	if (flags & 2) {
+		read_byte();
+		read_byte();
+	}
+
+	return _state.in_pos <= _compressed_length;
+}
+
+/**
+ * Records the state of the inflater, if it has got far enough past the last checkpoint.
+ * Only called at a block boundary, where the state is small.
+ */
+void GzipBlockDevice::add_checkpoint()
+{
+	if (_nr_checkpoints && _state.out_pos - _checkpoints[_nr_checkpoints - 1].state.out_pos < GZIP_CHECKPOINT_SPACING) {
+		return;
+	}
+
+	if (_nr_checkpoints == _checkpoint_capacity) {
+		_checkpoint_capacity = _checkpoint_capacity ? _checkpoint_capacity * 2 : 16;
+
+		Checkpoint *checkpoints = new Checkpoint[_checkpoint_capacity];
+		for (unsigned int i = 0; i < _nr_checkpoints; i++) {
+			checkpoints[i] = _checkpoints[i];
+		}
+
+		delete[] _checkpoints;
+		_checkpoints = checkpoints;
+	}
+
+	Checkpoint& checkpoint = _checkpoints[_nr_checkpoints++];
+	checkpoint.state = _state;
+	checkpoint.window = new uint8_t[GZIP_WINDOW_SIZE];
+	memcpy(checkpoint.window, _window, GZIP_WINDOW_SIZE);
+}
+
+/**
+ * Inflates up to the given amount of output.
+ * @param dest The buffer to write the output to, or NULL to throw it away.
+ * @param length The most output to produce.
+ * @return Returns the amount of output produced, which is zero at the end of the stream or
+ * if it is corrupt.
+ */
+size_t GzipBlockDevice::inflate(uint8_t *dest, size_t length)
+{
+	size_t produced = 0;
+
+	while (produced < length && !_failed) {
+		switch (_state.mode) {
+		case GzipMode::MEMBER_HEADER:
+			if (_scanning) {
+				add_checkpoint();
+			}
+
+			// Anything other than another member after the first one, such as the padding
+			// at the end of the device, ends the stream.
+			if (member_header()) {
+				_state.nr_members++;
+				_state.last = false;
+				_state.mode = GzipMode::BLOCK_HEADER;
+
+				_crc = 0xffffffff;
+				_member_start = _state.out_pos;
+			} else if (_state.nr_members) {
+				_state.mode = GzipMode::END;
+			} else {
+				_failed = true;
+			}
+
+			break;
+
+		case GzipMode::BLOCK_HEADER:
+			if (_scanning) {
+				add_checkpoint();
+			}
+
+			if (_state.last) {
+				_state.mode = GzipMode::MEMBER_TRAILER;
+				break;
+			}
+
+			_state.last = bits(1);
+
+			switch (bits(2)) {
+			case 0: {
+				align();
+
+				unsigned int stored_length = read_byte();
+				stored_length |= read_byte() << 8;
+
+				unsigned int check = read_byte();
+				check |= read_byte() << 8;
+
+				if (stored_length != (~check & 0xffff)) {
+					_failed = true;
+					break;
+				}
+
+				_stored_remaining = stored_length;
+				_state.mode = GzipMode::STORED;
+				break;
+			}
+
+			case 1:
+				fixed_codes();
+				_match_length = 0;
+				_state.mode = GzipMode::CODES;
+				break;
+
+			case 2:
+				if (!dynamic_codes()) {
+					_failed = true;
+					break;
+				}
+
+				_match_length = 0;
+				_state.mode = GzipMode::CODES;
+				break;
+
+			default:
+				_failed = true;
+				break;
+			}
+
+			break;
+
+		case GzipMode::STORED:
+			while (_stored_remaining && produced < length) {
+				int byte = read_byte();
+				if (byte < 0) {
+					_failed = true;
+					break;
+				}
+
+				emit(dest, produced, byte);
+				_stored_remaining--;
+			}
+
+			if (!_stored_remaining) {
+				_state.mode = GzipMode::BLOCK_HEADER;
+			}
+
+			break;
+
+		case GzipMode::CODES:
+			while (produced < length && !_failed) {
+				if (_match_length) {
+					emit(dest, produced, _window[(_state.out_pos - _match_distance) & (GZIP_WINDOW_SIZE - 1)]);
+					_match_length--;
+					continue;
+				}
+
+				int symbol = decode(_lencode);
+				if (symbol < 0) {
+					_failed = true;
+				} else if (symbol < 256) {
+					emit(dest, produced, symbol);
+				} else if (symbol == 256) {
+					_state.mode = GzipMode::BLOCK_HEADER;
+					break;
+				} else {
+					symbol -= 257;
+					if (symbol >= 29) {
+						_failed = true;
+						break;
+					}
+
+					unsigned int match_length = length_base[symbol] + bits(length_extra[symbol]);
+
+					symbol = decode(_distcode);
+					if (symbol < 0 || symbol >= 30) {
+						_failed = true;
+						break;
+					}
+
+					unsigned int distance = distance_base[symbol] + bits(distance_extra[symbol]);
+					if (distance > _state.out_pos) {
+						_failed = true;
+						break;
+					}
+
+					_match_length = match_length;
+					_match_distance = distance;
+				}
+			}
+
+			break;
+
+		case GzipMode::MEMBER_TRAILER: {
+			// The CRC-32 and length (mod 2^32) of the member's output.  The scan at creation
+			// checks them, so a read that inflates the member again just steps over them.
+			align();
+
+			uint32_t trailer[2] = { 0, 0 };
+			bool truncated = false;
+
+			for (unsigned int i = 0; i < 8; i++) {
+				int byte = read_byte();
+				if (byte < 0) {
+					truncated = true;
+				}
+
+				trailer[i / 4] |= (uint32_t) (byte & 0xff) << ((i % 4) * 8);
+			}
+
+			if (_scanning && (truncated || trailer[0] != ~_crc || trailer[1] != (uint32_t) (_state.out_pos - _member_start))) {
+				syslog.messagef(LogLevel::WARNING, "gzip: member %u fails its CRC or length check", _state.nr_members);
+
+				_failed = true;
+				break;
+			}
+
+			_state.mode = GzipMode::MEMBER_HEADER;
+			break;
+		}
+
+		case GzipMode::END:
+		case GzipMode::ERROR:
+			return produced;
+		}
+	}
+
+	if (_failed) {
+		_state.mode = GzipMode::ERROR;
+	}
+
+	return produced;
+}
+
+/**
+ * Moves the inflater to the given output position.  It carries on from where it is if that
+ * is not too far behind, and otherwise restarts from the nearest checkpoint.
+ * @param position The output position to move to.
+ */
+void GzipBlockDevice::seek(uint64_t position)
+{
+	bool usable = _state.mode != GzipMode::ERROR && _state.mode != GzipMode::END;
+
+	if (!usable || _state.out_pos > position || position - _state.out_pos >= GZIP_CHECKPOINT_SPACING) {
+		// find the last checkpoint at or before the position
+		unsigned int low = 0, high = _nr_checkpoints;
+		while (high - low > 1) {
+			unsigned int mid = (low + high) / 2;
+
+			if (_checkpoints[mid].state.out_pos <= position) {
+				low = mid;
+			} else {
+				high = mid;
+			}
+		}
+
+		_state = _checkpoints[low].state;
+		memcpy(_window, _checkpoints[low].window, GZIP_WINDOW_SIZE);
+
+		_failed = false;
+		_match_length = 0;
+		_stored_remaining = 0;
+	}
+
+	while (_state.out_pos < position) {
+		if (!inflate(NULL, position - _state.out_pos)) {
+			break;
+		}
+	}
+}
+
+/**
+ * Reads decompressed blocks.  The part of the last block beyond the end of the stream reads
+ * as zeroes.
+ * @param buffer The buffer to read into.
+ * @param offset The first block to read.
+ * @param count The number of blocks to read.
+ * @return Returns true if the blocks were read.
+ */
+bool GzipBlockDevice::read_blocks(void *buffer, size_t offset, size_t count)
+{
+	if (!_valid || offset + count > block_count()) {
+		return false;
+	}
+
+	uint64_t start = (uint64_t) offset * 512;
+	size_t length = count * 512;
+	size_t available = _length - start < length ? _length - start : length;
+
+	// The inflater is shared by every reader.
+	UniqueLock<Mutex> l(_lock);
+
+	seek(start);
+	if (_state.out_pos != start) {
+		return false;
+	}
+
+	size_t done = 0;
+	while (done < available) {
+		size_t produced = inflate((uint8_t *) buffer + done, available - done);
+		if (!produced) {
+			return false;
+		}
+
+		done += produced;
+	}
+
+	memset((uint8_t *) buffer + available, 0, length - available);
+	return true;
+}
+
+/**
+ * The device is read-only.
+ */
+bool GzipBlockDevice::write_blocks(const void *, size_t, size_t)
+{
+	return false;
+}
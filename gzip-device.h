@@ -0,0 +1,157 @@
+/*
+ * Gzip Block Device
+ */
+#pragma once
+
+#include <infos/drivers/block/block-device.h>
+#include <infos/locking/mutex.h>
+
+// How much output there is between checkpoints.  Each checkpoint keeps a copy of the
+// inflater's window, so this trades memory for the cost of a random read.
+#define GZIP_CHECKPOINT_SPACING		((uint64_t)1 << 20)
+#define GZIP_WINDOW_SIZE		32768
+
+// How many blocks of the compressed device are buffered for the inflater.
+#define GZIP_INPUT_BLOCKS		16
+
+namespace infos
+{
+	namespace drivers
+	{
+		namespace block
+		{
+			namespace GzipMode
+			{
+				enum GzipMode
+				{
+					MEMBER_HEADER,		// expecting the header of a gzip member, or the end
+					BLOCK_HEADER,		// expecting the header of a deflate block
+					STORED,			// copying an uncompressed block
+					CODES,			// decoding a Huffman coded block
+					MEMBER_TRAILER,		// expecting the CRC and length after the last block
+					END,
+					ERROR
+				};
+			}
+
+			/**
+			 * A read-only block device that presents the decompressed contents of a gzip stream
+			 * held on another block device.  The whole stream is inflated once when the device is
+			 * created, to find its length and to record checkpoints along the way.  A read then
+			 * resumes inflating from the nearest checkpoint before it, or carries on from where
+			 * the last read stopped if that is closer.
+			 */
+			class GzipBlockDevice : public BlockDevice
+			{
+			public:
+				GzipBlockDevice(BlockDevice& compressed);
+				virtual ~GzipBlockDevice();
+
+				static bool is_gzip(BlockDevice& device);
+
+				bool valid() const { return _valid; }
+
+				size_t block_size() const override { return 512; }
+				size_t block_count() const override { return (_length + 511) / 512; }
+
+				bool read_blocks(void *buffer, size_t offset, size_t count) override;
+				bool write_blocks(const void *buffer, size_t offset, size_t count) override;
+
+			private:
+				/**
+				 * A canonical Huffman code, as a count of the codes of each length and the
+				 * symbols in code order.
+				 */
+				struct Huffman
+				{
+					uint16_t count[16];
+					uint16_t symbol[288];
+				};
+
+				/**
+				 * The state of the inflater at a deflate block boundary, which with the window is
+				 * all that is needed to carry on inflating from there.
+				 */
+				struct InflateState
+				{
+					GzipMode::GzipMode mode;
+					bool last;			// the current block is the last of its member
+					uint64_t in_pos;		// the next byte of compressed input
+					uint64_t bit_buffer;
+					unsigned int bit_count;
+					uint64_t out_pos;		// the amount of output produced so far
+					unsigned int nr_members;	// the gzip members started so far
+				};
+
+				struct Checkpoint
+				{
+					InflateState state;
+					uint8_t *window;
+				};
+
+				BlockDevice& _compressed;
+				uint64_t _compressed_length;
+				bool _valid;
+				uint64_t _length;		// the length of the decompressed stream
+
+				InflateState _state;
+				uint8_t *_window;		// the last 32K of output, for matches to copy from
+				uint32_t _stored_remaining;
+				unsigned int _match_length, _match_distance;
+				Huffman _lencode, _distcode;
+				bool _failed;			// the stream is corrupt or truncated
+
+				uint8_t *_input;
+				uint64_t _input_block;		// the first compressed block held in _input
+				size_t _input_blocks;		// the number of blocks held in _input
+
+				Checkpoint *_checkpoints;
+				unsigned int _nr_checkpoints, _checkpoint_capacity;
+				bool _scanning;			// checkpoints are being recorded
+
+				// the running CRC-32 of the current member, and where its output started,
+				// which are only kept up to date by the scan
+				uint32_t _crc;
+				uint64_t _member_start;
+
+				// Held while a read moves the inflater.  Inflating can take a long time, so
+				// this is a mutex rather than a lock that disables interrupts.
+				locking::Mutex _lock;
+
+				static uint32_t crc_table[256];
+				static void build_crc_table();
+
+				int next_byte();
+				int read_byte();
+				int bits(unsigned int count);
+				void align();
+
+				static bool build(Huffman& h, const uint8_t *lengths, unsigned int count);
+				int decode(const Huffman& h);
+				bool fixed_codes();
+				bool dynamic_codes();
+				bool member_header();
+
+				size_t inflate(uint8_t *dest, size_t length);
+
+				void emit(uint8_t *dest, size_t& produced, uint8_t byte)
+				{
+					_window[_state.out_pos++ & (GZIP_WINDOW_SIZE - 1)] = byte;
+
+					if (dest) {
+						dest[produced] = byte;
+					}
+
+					if (_scanning) {
+						_crc = crc_table[(_crc ^ byte) & 0xff] ^ (_crc >> 8);
+					}
+
+					produced++;
+				}
+
+				void add_checkpoint();
+				void seek(uint64_t position);
+			};
+		}
+	}
+}
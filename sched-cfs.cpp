@@ -0,0 +1,544 @@
+/*
+ * Completely Fair Scheduling Algorithm
+ */
+#include <infos/kernel/sched.h>
+#include <infos/kernel/thread.h>
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+#include "sched-rq.h"
+
+using namespace infos::kernel;
+using namespace infos::util;
+
+// The period, in the units of cpu_runtime(), over which every runnable entity should get a
+// turn, and the shortest slice an entity is given however many there are.
+#define CFS_TARGET_LATENCY	6000000
+#define CFS_MIN_GRANULARITY	750000
+
+// The weight of a nice 0 entity.  Virtual runtime advances at real speed for it.
+#define CFS_NICE_0_WEIGHT	1024
+
+// The weight of each nice level from -20 to 19.  Each level gets about 10% less CPU than the
+// one before it.
+static const unsigned int nice_to_weight[40] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15,
+};
+
+// The nice level each scheduling entity priority class runs at, indexed by priority.
+static const int priority_to_nice[] = { -15, -5, 0, 5, 19 };
+
+/**
+ * A fair-share scheduling algorithm.  Each entity accumulates virtual runtime, which is
+ * the CPU time it has used scaled down by its weight, and the entity that has had the least
+ * runs next.  Runnable entities are kept in a red-black tree ordered by virtual runtime,
+ * with the leftmost node cached so a pick does not have to search for it.
+ */
+class CFSScheduler : public SchedulingAlgorithm
+{
+public:
+	CFSScheduler()
+		: _root(NULL),
+		_leftmost(NULL),
+		_current(NULL),
+		_total_weight(0),
+		_min_vruntime(0),
+		_target_latency(CFS_TARGET_LATENCY),
+		_min_granularity(CFS_MIN_GRANULARITY)
+	{
+	}
+
+	/**
+	 * Returns the friendly name of the algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "cfs"; }
+
+	/**
+	 * Changes how the CPU is divided up between runnable entities.
+	 * @param target_latency The period over which every runnable entity should run.
+	 * @param min_granularity The shortest slice an entity is given.
+	 */
+	void configure(uint64_t target_latency, uint64_t min_granularity)
+	{
+		UniqueIRQLock l;
+
+		_target_latency = target_latency;
+		_min_granularity = min_granularity;
+	}
+
+	/**
+	 * Called when a scheduling entity becomes eligible for running.  A new entity starts
+	 * from the smallest virtual runtime in the tree.  One waking up keeps the virtual runtime
+	 * it blocked with, but is credited with up to half the target latency for the time it
+	 * spent blocked, so it runs soon without making up for all of that time.
+	 * @param entity
+	 */
+	void add_to_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		uint64_t vruntime = _min_vruntime;
+
+		Sleeper *sleeper = _sleepers.find(&entity);
+		if (sleeper) {
+			uint64_t credit = _target_latency / 2;
+			uint64_t floor = _min_vruntime > credit ? _min_vruntime - credit : 0;
+
+			vruntime = sleeper->vruntime > floor ? sleeper->vruntime : floor;
+			_sleepers.erase(sleeper);
+		}
+
+		Node *node = _nodes.insert(&entity);
+		node->weight = weight_of(entity);
+		node->vruntime = vruntime;
+
+		_total_weight += node->weight;
+		tree_insert(node);
+	}
+
+	/**
+	 * Called when a scheduling entity is no longer eligible for running.  A blocking entity's
+	 * virtual runtime is saved for when it wakes up, but an exiting one's is dropped.
+	 * @param entity
+	 */
+	void remove_from_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		bool exiting = entity.state() == SchedulingEntityState::STOPPED;
+
+		// an entity can exit while blocked, with its virtual runtime saved
+		if (exiting) {
+			Sleeper *sleeper = _sleepers.find(&entity);
+			if (sleeper) {
+				_sleepers.erase(sleeper);
+			}
+		}
+
+		Node *node = _nodes.find(&entity);
+		if (!node) {
+			return;
+		}
+
+		// the running entity is kept out of the tree, and is charged for its last run
+		if (node == _current) {
+			update_current();
+			_current = NULL;
+		} else {
+			tree_erase(node);
+		}
+
+		if (!exiting) {
+			Sleeper *sleeper = _sleepers.insert(&entity);
+			sleeper->vruntime = node->vruntime;
+		}
+
+		_total_weight -= node->weight;
+		_nodes.erase(node);
+	}
+
+	/**
+	 * Called every time a scheduling event occurs, to cause the next eligible entity
+	 * to be chosen.  The running entity is charged for the time it has used, and carries on
+	 * until it has had its slice, unless another entity has fallen behind it by more
+	 * than the minimum granularity.
+	 */
+	SchedulingEntity *pick_next_entity() override
+	{
+		UniqueIRQLock l;
+
+		if (_current) {
+			update_current();
+
+			uint64_t ran = _current->entity->cpu_runtime() - _current->slice_start;
+			bool slice_left = ran < slice(_current);
+			bool overtaken = _leftmost && _current->vruntime > _leftmost->vruntime + _min_granularity;
+
+			if ((slice_left && !overtaken) || !_leftmost) {
+				return _current->entity;
+			}
+
+			tree_insert(_current);
+			_current = NULL;
+		}
+
+		if (!_leftmost) {
+			return NULL;
+		}
+
+		_current = _leftmost;
+		tree_erase(_current);
+
+		_current->exec_start = _current->entity->cpu_runtime();
+		_current->slice_start = _current->exec_start;
+
+		update_min_vruntime();
+
+		return _current->entity;
+	}
+
+private:
+	// the host harness checks the tree directly
+	friend class SchedulerTestHook;
+
+	struct Node
+	{
+		SchedulingEntity *entity;
+		Node *parent, *left, *right;
+		bool red;
+
+		uint64_t vruntime;
+		unsigned int weight;
+
+		SchedulingEntityRuntime exec_start;	// cpu_runtime() when vruntime was last brought up to date
+		SchedulingEntityRuntime slice_start;	// cpu_runtime() when it was last picked
+	};
+
+	/**
+	 * The virtual runtime a blocked entity had, so it can carry on from there when it wakes up.
+	 */
+	struct Sleeper
+	{
+		SchedulingEntity *entity;
+		uint64_t vruntime;
+	};
+
+	EntityTable<Node> _nodes;
+	EntityTable<Sleeper> _sleepers;
+	Node *_root, *_leftmost;
+	Node *_current;				// the running entity, which is not in the tree
+
+	uint64_t _total_weight;			// of every runnable entity, including the running one
+	uint64_t _min_vruntime;			// never goes backwards
+
+	uint64_t _target_latency;
+	uint64_t _min_granularity;
+
+	static unsigned int weight_of(SchedulingEntity& entity)
+	{
+		unsigned int priority = (unsigned int) entity.priority();
+		int nice = priority < ARRAY_SIZE(priority_to_nice) ? priority_to_nice[priority] : 0;
+
+		return nice_to_weight[nice + 20];
+	}
+
+	/**
+	 * Returns the slice of the target latency an entity should get, in proportion to its
+	 * weight.  When there are too many entities for every one of them to get the minimum
+	 * granularity, the period is stretched to fit.
+	 */
+	uint64_t slice(Node *node) const
+	{
+		uint64_t nr_running = _nodes.count();
+		uint64_t period = _target_latency;
+
+		if (nr_running * _min_granularity > period) {
+			period = nr_running * _min_granularity;
+		}
+
+		uint64_t slice = (period * node->weight) / _total_weight;
+		return slice < _min_granularity ? _min_granularity : slice;
+	}
+
+	/**
+	 * Charges the running entity for the CPU time it has used since it was last charged.
+	 */
+	void update_current()
+	{
+		SchedulingEntityRuntime now = _current->entity->cpu_runtime();
+		uint64_t delta = now - _current->exec_start;
+
+		_current->exec_start = now;
+		_current->vruntime += (delta * CFS_NICE_0_WEIGHT) / _current->weight;
+
+		update_min_vruntime();
+	}
+
+	/**
+	 * Moves the minimum virtual runtime up to the smallest of the running and leftmost
+	 * entities, so that entities that wake up start level with those already running.
+	 */
+	void update_min_vruntime()
+	{
+		uint64_t vruntime = _min_vruntime;
+
+		if (_current) {
+			vruntime = _current->vruntime;
+		}
+
+		if (_leftmost && (!_current || _leftmost->vruntime < vruntime)) {
+			vruntime = _leftmost->vruntime;
+		}
+
+		if (vruntime > _min_vruntime) {
+			_min_vruntime = vruntime;
+		}
+	}
+
+	void rotate_left(Node *x)
+	{
+		Node *y = x->right;
+
+		x->right = y->left;
+		if (y->left) y->left->parent = x;
+
+		y->parent = x->parent;
+		if (!x->parent) {
+			_root = y;
+		} else if (x == x->parent->left) {
+			x->parent->left = y;
+		} else {
+			x->parent->right = y;
+		}
+
+		y->left = x;
+		x->parent = y;
+	}
+
+	void rotate_right(Node *x)
+	{
+		Node *y = x->left;
+
+		x->left = y->right;
+		if (y->right) y->right->parent = x;
+
+		y->parent = x->parent;
+		if (!x->parent) {
+			_root = y;
+		} else if (x == x->parent->right) {
+			x->parent->right = y;
+		} else {
+			x->parent->left = y;
+		}
+
+		y->right = x;
+		x->parent = y;
+	}
+
+	/**
+	 * Inserts a node into the tree by virtual runtime.  Equal runtimes go to the right, so
+	 * entities that tie run in the order they were inserted.
+	 */
+	void tree_insert(Node *node)
+	{
+		Node *parent = NULL;
+		Node **link = &_root;
+		bool leftmost = true;
+
+		while (*link) {
+			parent = *link;
+
+			if (node->vruntime < parent->vruntime) {
+				link = &parent->left;
+			} else {
+				link = &parent->right;
+				leftmost = false;
+			}
+		}
+
+		node->parent = parent;
+		node->left = node->right = NULL;
+		node->red = true;
+		*link = node;
+
+		if (leftmost) {
+			_leftmost = node;
+		}
+
+		// restore the red-black properties
+		while (node->parent && node->parent->red) {
+			Node *p = node->parent;
+			Node *g = p->parent;
+
+			if (p == g->left) {
+				Node *uncle = g->right;
+
+				if (uncle && uncle->red) {
+					p->red = uncle->red = false;
+					g->red = true;
+					node = g;
+					continue;
+				}
+
+				if (node == p->right) {
+					rotate_left(p);
+					node = p;
+					p = node->parent;
+				}
+
+				p->red = false;
+				g->red = true;
+				rotate_right(g);
+			} else {
+				Node *uncle = g->left;
+
+				if (uncle && uncle->red) {
+					p->red = uncle->red = false;
+					g->red = true;
+					node = g;
+					continue;
+				}
+
+				if (node == p->left) {
+					rotate_right(p);
+					node = p;
+					p = node->parent;
+				}
+
+				p->red = false;
+				g->red = true;
+				rotate_left(g);
+			}
+		}
+
+		_root->red = false;
+	}
+
+	/**
+	 * Puts one subtree in the place of another, under the other's parent.
+	 */
+	void transplant(Node *old, Node *node)
+	{
+		if (!old->parent) {
+			_root = node;
+		} else if (old == old->parent->left) {
+			old->parent->left = node;
+		} else {
+			old->parent->right = node;
+		}
+
+		if (node) {
+			node->parent = old->parent;
+		}
+	}
+
+	void tree_erase(Node *node)
+	{
+		if (node == _leftmost) {
+			// the next node in order is the leftmost of the right subtree, or the parent
+			if (node->right) {
+				Node *next = node->right;
+				while (next->left) next = next->left;
+				_leftmost = next;
+			} else {
+				_leftmost = node->parent;
+			}
+		}
+
+		// Unlink the node, or its successor if it has two children, remembering the
+		// child that moves up and where it is, since that child may be NULL.
+		Node *child, *parent;
+		bool removed_red = node->red;
+
+		if (!node->left) {
+			child = node->right;
+			parent = node->parent;
+			transplant(node, child);
+		} else if (!node->right) {
+			child = node->left;
+			parent = node->parent;
+			transplant(node, child);
+		} else {
+			Node *next = node->right;
+			while (next->left) next = next->left;
+
+			removed_red = next->red;
+			child = next->right;
+
+			if (next->parent == node) {
+				parent = next;
+			} else {
+				parent = next->parent;
+				transplant(next, child);
+				next->right = node->right;
+				next->right->parent = next;
+			}
+
+			transplant(node, next);
+			next->left = node->left;
+			next->left->parent = next;
+			next->red = node->red;
+		}
+
+		if (removed_red) {
+			return;
+		}
+
+		// restore the red-black properties
+		while (child != _root && (!child || !child->red)) {
+			if (child == parent->left) {
+				Node *sibling = parent->right;
+
+				if (sibling->red) {
+					sibling->red = false;
+					parent->red = true;
+					rotate_left(parent);
+					sibling = parent->right;
+				}
+
+				if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red)) {
+					sibling->red = true;
+					child = parent;
+					parent = child->parent;
+					continue;
+				}
+
+				if (!sibling->right || !sibling->right->red) {
+					sibling->left->red = false;
+					sibling->red = true;
+					rotate_right(sibling);
+					sibling = parent->right;
+				}
+
+				sibling->red = parent->red;
+				parent->red = false;
+				sibling->right->red = false;
+				rotate_left(parent);
+				child = _root;
+			} else {
+				Node *sibling = parent->left;
+
+				if (sibling->red) {
+					sibling->red = false;
+					parent->red = true;
+					rotate_right(parent);
+					sibling = parent->left;
+				}
+
+				if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red)) {
+					sibling->red = true;
+					child = parent;
+					parent = child->parent;
+					continue;
+				}
+
+				if (!sibling->left || !sibling->left->red) {
+					sibling->right->red = false;
+					sibling->red = true;
+					rotate_left(sibling);
+					sibling = parent->left;
+				}
+
+				sibling->red = parent->red;
+				parent->red = false;
+				sibling->left->red = false;
+				rotate_right(parent);
+				child = _root;
+			}
+		}
+
+		if (child) {
+			child->red = false;
+		}
+	}
+};
+
+/* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
+
+RegisterScheduler(CFSScheduler);
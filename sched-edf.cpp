@@ -0,0 +1,426 @@
+/*
+ * Earliest-deadline-first Scheduling Algorithm
+ */
+#include <infos/kernel/sched.h>
+#include <infos/kernel/thread.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+#include "sched-rq.h"
+
+using namespace infos::kernel;
+using namespace infos::util;
+
+// The share of the CPU that reservations may take between them, in parts per 1024.  The rest
+// is left for entities without one.
+#define EDF_UTILIZATION_LIMIT	972
+
+// Bandwidths are kept as fixed point fractions of the CPU, with this many fractional bits.
+#define EDF_BW_SHIFT		20
+
+/**
+ * An earliest-deadline-first scheduling algorithm, for entities with periodic deadlines.
+ * An entity reserves a runtime budget in every period, and must have it by a deadline
+ * relative to the start of the period.  Reservations are only admitted while their total
+ * utilisation stays under the limit, the runnable entity with the earliest deadline always
+ * runs, and an entity that overruns its budget is throttled until its next period.
+ * Entities without a reservation run round-robin whenever no reserved entity is runnable.
+ *
+ * Times are in the units of cpu_runtime() and the kernel's runtime clock (nanoseconds).
+ */
+class EDFScheduler : public SchedulingAlgorithm
+{
+public:
+	EDFScheduler()
+		: _ready(&Reservation::deadline_at),
+		_throttled(&Reservation::replenish_at),
+		_current(NULL),
+		_total_bw(0)
+	{
+	}
+
+	/**
+	 * Returns the friendly name of the algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "edf"; }
+
+	/**
+	 * Gives an entity a reservation, or changes the one it has.
+	 * @param entity The entity.
+	 * @param runtime The CPU time the entity may use in each period.
+	 * @param period The time between the starts of successive periods.
+	 * @param deadline The time from the start of a period by which the runtime must be
+	 * delivered, which must be no longer than the period.
+	 * @return Returns false if the parameters are not valid, or admitting them would take the
+	 * total utilisation over the limit, in which case any existing reservation is left as it is.
+	 */
+	bool set_parameters(SchedulingEntity& entity, uint64_t runtime, uint64_t period, uint64_t deadline)
+	{
+		UniqueIRQLock l;
+
+		if (runtime == 0 || runtime > deadline || deadline > period) {
+			return false;
+		}
+
+		uint64_t bw = ((unsigned __int128) runtime << EDF_BW_SHIFT) / period;
+
+		Reservation *res = _reservations.find(&entity);
+		uint64_t old_bw = res ? res->bw : 0;
+
+		if (_total_bw - old_bw + bw > ((uint64_t) EDF_UTILIZATION_LIMIT << EDF_BW_SHIFT) / 1024) {
+			return false;
+		}
+
+		_total_bw = _total_bw - old_bw + bw;
+
+		bool runnable;
+		if (res) {
+			runnable = res->runnable;
+			unqueue(res);
+		} else {
+			runnable = _background.remove(&entity);
+
+			res = _reservations.insert(&entity);
+			res->heap_index = NOT_QUEUED;
+		}
+
+		res->runtime = runtime;
+		res->period = period;
+		res->deadline = deadline;
+		res->bw = bw;
+		res->runnable = runnable;
+
+		start_period(res, now());
+
+		if (runnable) {
+			_ready.push(res);
+		}
+
+		return true;
+	}
+
+	/**
+	 * Takes an entity's reservation away, so it runs with the entities that do not have one.
+	 * @param entity The entity.
+	 */
+	void clear_parameters(SchedulingEntity& entity)
+	{
+		UniqueIRQLock l;
+
+		Reservation *res = _reservations.find(&entity);
+		if (!res) {
+			return;
+		}
+
+		unqueue(res);
+
+		if (res->runnable) {
+			_background.enqueue(&entity);
+		}
+
+		_total_bw -= res->bw;
+		_reservations.erase(res);
+	}
+
+	/**
+	 * Called when a scheduling entity becomes eligible for running.  A reserved entity
+	 * that cannot finish its remaining budget by its current deadline, at its reserved rate,
+	 * starts a new period now.
+	 * @param entity
+	 */
+	void add_to_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		Reservation *res = _reservations.find(&entity);
+		if (!res) {
+			_background.enqueue(&entity);
+			return;
+		}
+
+		res->runnable = true;
+
+		// a throttled entity waits for its replenishment
+		if (res->heap_index != NOT_QUEUED) {
+			return;
+		}
+
+		// the products can take more than 64 bits for reservations of a few seconds
+		uint64_t t = now();
+		if (t >= res->deadline_at || (unsigned __int128) res->remaining * res->period > (unsigned __int128) (res->deadline_at - t) * res->runtime) {
+			start_period(res, t);
+		}
+
+		_ready.push(res);
+	}
+
+	/**
+	 * Called when a scheduling entity is no longer eligible for running.
+	 * @param entity
+	 */
+	void remove_from_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		Reservation *res = _reservations.find(&entity);
+		if (!res) {
+			_background.remove(&entity);
+			return;
+		}
+
+		if (res == _current) {
+			charge(res);
+			_current = NULL;
+		}
+
+		res->runnable = false;
+
+		// a throttled entity keeps its place, so it is still replenished on time
+		if (_ready.contains(res)) {
+			_ready.remove(res);
+		}
+	}
+
+	/**
+	 * Called every time a scheduling event occurs, to cause the next eligible entity
+	 * to be chosen.  The running entity is charged for the time it has used, and throttled
+	 * if that exhausts its budget.
+	 */
+	SchedulingEntity *pick_next_entity() override
+	{
+		UniqueIRQLock l;
+
+		uint64_t t = now();
+
+		if (_current) {
+			charge(_current);
+			_current = NULL;
+		}
+
+		// replenish the entities whose next period has begun
+		while (_throttled.count() && _throttled.top()->replenish_at <= t) {
+			Reservation *res = _throttled.pop();
+			start_period(res, res->replenish_at);
+
+			if (res->runnable) {
+				_ready.push(res);
+			}
+		}
+
+		if (_ready.count()) {
+			_current = _ready.top();
+			_current->exec_start = _current->entity->cpu_runtime();
+
+			return _current->entity;
+		}
+
+		if (_background.count() > 1) {
+			return _background.rotate();
+		}
+
+		return _background.first();
+	}
+
+private:
+	// the host harness checks the reservations and heaps directly
+	friend class SchedulerTestHook;
+
+	// The heap index of a reservation that is in neither heap.
+	static const unsigned int NOT_QUEUED = ~0u;
+
+	struct Reservation
+	{
+		SchedulingEntity *entity;
+
+		uint64_t runtime, period, deadline;
+		uint64_t bw;				// runtime / period, in fixed point
+
+		uint64_t period_start;
+		uint64_t deadline_at;			// the absolute deadline of the current period
+		uint64_t replenish_at;			// when a throttled entity gets its budget back
+		uint64_t remaining;			// of the budget for the current period
+
+		SchedulingEntityRuntime exec_start;	// cpu_runtime() when it was last charged
+		bool runnable;
+		unsigned int heap_index;		// in whichever heap it is in
+	};
+
+	/**
+	 * A binary min-heap of reservations, ordered by one of their times.  Each reservation
+	 * records where it is in the heap, so it can be removed from the middle.
+	 */
+	class ReservationHeap
+	{
+	public:
+		ReservationHeap(uint64_t Reservation::*key) : _key(key), _items(NULL), _count(0), _capacity(0) { }
+		~ReservationHeap() { delete[] _items; }
+
+		unsigned int count() const { return _count; }
+		Reservation *top() const { return _items[0]; }
+
+		bool contains(Reservation *res) const
+		{
+			return res->heap_index < _count && _items[res->heap_index] == res;
+		}
+
+		void push(Reservation *res)
+		{
+			if (_count == _capacity) {
+				grow();
+			}
+
+			_items[_count] = res;
+			res->heap_index = _count;
+			sift_up(_count++);
+		}
+
+		Reservation *pop()
+		{
+			Reservation *res = _items[0];
+			remove(res);
+
+			return res;
+		}
+
+		void remove(Reservation *res)
+		{
+			unsigned int i = res->heap_index;
+			res->heap_index = NOT_QUEUED;
+
+			if (i == --_count) {
+				return;
+			}
+
+			_items[i] = _items[_count];
+			_items[i]->heap_index = i;
+
+			sift_up(i);
+			sift_down(_items[i]->heap_index);
+		}
+
+	private:
+		friend class SchedulerTestHook;
+
+		uint64_t Reservation::*_key;
+		Reservation **_items;
+		unsigned int _count, _capacity;
+
+		bool before(unsigned int a, unsigned int b) const
+		{
+			return _items[a]->*_key < _items[b]->*_key;
+		}
+
+		void swap(unsigned int a, unsigned int b)
+		{
+			Reservation *tmp = _items[a];
+			_items[a] = _items[b];
+			_items[b] = tmp;
+
+			_items[a]->heap_index = a;
+			_items[b]->heap_index = b;
+		}
+
+		void sift_up(unsigned int i)
+		{
+			while (i > 0 && before(i, (i - 1) / 2)) {
+				swap(i, (i - 1) / 2);
+				i = (i - 1) / 2;
+			}
+		}
+
+		void sift_down(unsigned int i)
+		{
+			for (;;) {
+				unsigned int smallest = i;
+				unsigned int left = (i * 2) + 1, right = left + 1;
+
+				if (left < _count && before(left, smallest)) smallest = left;
+				if (right < _count && before(right, smallest)) smallest = right;
+
+				if (smallest == i) {
+					return;
+				}
+
+				swap(i, smallest);
+				i = smallest;
+			}
+		}
+
+		void grow()
+		{
+			unsigned int capacity = _capacity ? _capacity * 2 : 16;
+			Reservation **items = new Reservation *[capacity];
+
+			for (unsigned int i = 0; i < _count; i++) {
+				items[i] = _items[i];
+			}
+
+			delete[] _items;
+			_items = items;
+			_capacity = capacity;
+		}
+	};
+
+	EntityTable<Reservation> _reservations;
+	ReservationHeap _ready;			// runnable reservations, by deadline
+	ReservationHeap _throttled;		// reservations that overran, by replenishment time
+	Reservation *_current;			// the reservation picked last, while it stays runnable
+
+	RunQueue _background;			// entities without a reservation
+	uint64_t _total_bw;
+
+	/**
+	 * Returns the current time on the kernel's runtime clock.
+	 */
+	static uint64_t now()
+	{
+		return sys.runtime();
+	}
+
+	static void start_period(Reservation *res, uint64_t t)
+	{
+		res->period_start = t;
+		res->deadline_at = t + res->deadline;
+		res->remaining = res->runtime;
+	}
+
+	/**
+	 * Takes the CPU time a reservation has used since it was last charged out of its budget,
+	 * and throttles it until its next period if that exhausts the budget.
+	 */
+	void charge(Reservation *res)
+	{
+		SchedulingEntityRuntime runtime = res->entity->cpu_runtime();
+		uint64_t used = runtime - res->exec_start;
+
+		res->exec_start = runtime;
+		res->remaining = used < res->remaining ? res->remaining - used : 0;
+
+		if (res->remaining == 0) {
+			_ready.remove(res);
+
+			res->replenish_at = res->period_start + res->period;
+			_throttled.push(res);
+		}
+	}
+
+	/**
+	 * Takes a reservation out of whichever heap it is in.
+	 */
+	void unqueue(Reservation *res)
+	{
+		if (_ready.contains(res)) {
+			_ready.remove(res);
+		} else if (_throttled.contains(res)) {
+			_throttled.remove(res);
+		}
+
+		if (res == _current) {
+			_current = NULL;
+		}
+	}
+};
+
+/* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
+
+RegisterScheduler(EDFScheduler);
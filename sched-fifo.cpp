@@ -11,6 +11,7 @@
 #include <infos/kernel/log.h>
 #include <infos/util/list.h>
 #include <infos/util/lock.h>
+#include "sched-rq.h"
 
 using namespace infos::kernel;
 using namespace infos::util;
@@ -67,8 +68,8 @@ public:
 
 
 private:
-	// A list containing the current runqueue.
-	List<SchedulingEntity *> runqueue;
+	// The current runqueue.
+	RunQueue runqueue;
 };
 
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
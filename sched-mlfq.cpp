@@ -0,0 +1,258 @@
+/*
+ * Multi-level Feedback Queue Scheduling Algorithm
+ */
+#include <infos/kernel/sched.h>
+#include <infos/kernel/thread.h>
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+#include "sched-rq.h"
+
+using namespace infos::kernel;
+using namespace infos::util;
+
+// The number of priority levels.  Level zero is the highest, and each level below it has
+// twice the timeslice of the one above.
+#define MLFQ_NR_LEVELS		6
+
+// The CPU time, in nanoseconds, that an entity may use at the top level before it is demoted.
+#define MLFQ_TIMESLICE		1000000
+
+// How much CPU time, in nanoseconds, is used between boosting every entity back to the top level.
+#define MLFQ_BOOST_INTERVAL	1000000000
+
+// The number of entries in the table that remembers the level of a blocked entity.
+#define MLFQ_SLEEPER_SLOTS	256
+
+/**
+ * A multi-level feedback queue scheduling algorithm.  Entities start at the top level, and
+ * move down a level every time they run for the whole of their timeslice, so entities that
+ * block early keep running ahead of those that use the CPU for long stretches.  Every so
+ * often, everything is boosted back to the top, so that nothing starves.
+ */
+class MLFQScheduler : public SchedulingAlgorithm
+{
+public:
+	MLFQScheduler()
+		: _nonempty(0),
+		_current(NULL),
+		_current_level(0),
+		_current_used(0),
+		_current_charged(0),
+		_since_boost(0)
+	{
+		clear_sleepers();
+	}
+
+	/**
+	 * Returns the friendly name of the algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "mlfq"; }
+
+	/**
+	 * Called when a scheduling entity becomes eligible for running.  It goes back to the
+	 * level it was at when it blocked, or to the top level if that has been forgotten.
+	 * @param entity
+	 */
+	void add_to_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		Sleeper& sleeper = _sleepers[sleeper_slot(&entity)];
+
+		unsigned int level = 0;
+		if (sleeper.entity == &entity) {
+			level = sleeper.level;
+			sleeper.entity = NULL;
+		}
+
+		enqueue(&entity, level);
+	}
+
+	/**
+	 * Called when a scheduling entity is no longer eligible for running.  A blocking entity's
+	 * level is remembered, but an exiting one's is forgotten, so that nothing else created at
+	 * the same address inherits it.
+	 * @param entity
+	 */
+	void remove_from_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		Sleeper& sleeper = _sleepers[sleeper_slot(&entity)];
+		bool exiting = entity.state() == SchedulingEntityState::STOPPED;
+
+		if (exiting && sleeper.entity == &entity) {
+			sleeper.entity = NULL;
+		}
+
+		for (unsigned int level = 0; level < MLFQ_NR_LEVELS; level++) {
+			if (!_levels[level].remove(&entity)) continue;
+
+			if (_levels[level].count() == 0) {
+				_nonempty &= ~(1u << level);
+			}
+
+			if (!exiting) {
+				sleeper.entity = &entity;
+				sleeper.level = level;
+			}
+
+			if (_current == &entity) {
+				charge_current();
+				_current = NULL;
+			}
+
+			return;
+		}
+	}
+
+	/**
+	 * Called every time a scheduling event occurs, to cause the next eligible entity
+	 * to be chosen.  The running entity is charged the CPU time it has used since it was
+	 * last charged, and is demoted once it has used its whole timeslice.
+	 */
+	SchedulingEntity *pick_next_entity() override
+	{
+		UniqueIRQLock l;
+
+		if (_current) {
+			charge_current();
+		}
+
+		if (_since_boost >= MLFQ_BOOST_INTERVAL) {
+			boost();
+		}
+
+		if (_current && _current_used >= timeslice(_current_level)) {
+			expire_current();
+		}
+
+		if (!_nonempty) {
+			return NULL;
+		}
+
+		// The lowest set bit is the highest priority level with something on it.
+		unsigned int level = __builtin_ctz(_nonempty);
+		SchedulingEntity *selected_entity = _levels[level].first();
+
+		// An entity pre-empted by a higher level starts a fresh timeslice when it next runs.
+		if (selected_entity != _current) {
+			_current = selected_entity;
+			_current_level = level;
+			_current_used = 0;
+			_current_charged = selected_entity->cpu_runtime();
+		}
+
+		return selected_entity;
+	}
+
+private:
+	// the host harness checks the levels directly
+	friend class SchedulerTestHook;
+
+	/**
+	 * The level a blocked entity was at, so it can go back there when it wakes up.
+	 */
+	struct Sleeper
+	{
+		SchedulingEntity *entity;
+		unsigned int level;
+	};
+
+	RunQueue _levels[MLFQ_NR_LEVELS];
+	uint32_t _nonempty;			// a bit for each level with entities on it
+
+	SchedulingEntity *_current;		// the entity picked last, while it stays runnable
+	unsigned int _current_level;
+	SchedulingEntityRuntime _current_used;		// CPU time it has used of its timeslice
+	SchedulingEntityRuntime _current_charged;	// its CPU time when it was last charged
+
+	SchedulingEntityRuntime _since_boost;		// CPU time charged since the last boost
+
+	// A direct-mapped table, so an entity that collides with another sleeper just
+	// wakes up at the top level.
+	Sleeper _sleepers[MLFQ_SLEEPER_SLOTS];
+
+	static SchedulingEntityRuntime timeslice(unsigned int level)
+	{
+		return (SchedulingEntityRuntime) MLFQ_TIMESLICE << level;
+	}
+
+	static unsigned int sleeper_slot(SchedulingEntity *entity)
+	{
+		return ((((uintptr_t) entity >> 4) * 0x9e3779b97f4a7c15ull) >> 32) & (MLFQ_SLEEPER_SLOTS - 1);
+	}
+
+	void clear_sleepers()
+	{
+		for (unsigned int i = 0; i < MLFQ_SLEEPER_SLOTS; i++) {
+			_sleepers[i].entity = NULL;
+		}
+	}
+
+	/**
+	 * Charges the running entity for the CPU time it has used since it was last charged.
+	 */
+	void charge_current()
+	{
+		SchedulingEntityRuntime runtime = _current->cpu_runtime();
+		SchedulingEntityRuntime used = runtime - _current_charged;
+
+		_current_used += used;
+		_since_boost += used;
+		_current_charged = runtime;
+	}
+
+	void enqueue(SchedulingEntity *entity, unsigned int level)
+	{
+		_levels[level].enqueue(entity);
+		_nonempty |= 1u << level;
+	}
+
+	/**
+	 * Moves the running entity, which has used its whole timeslice, to the tail of the
+	 * level below.  On the bottom level, it just goes to the tail.
+	 */
+	void expire_current()
+	{
+		RunQueue& rq = _levels[_current_level];
+
+		if (_current_level == MLFQ_NR_LEVELS - 1) {
+			rq.rotate();
+		} else {
+			rq.remove(_current);
+			if (rq.count() == 0) {
+				_nonempty &= ~(1u << _current_level);
+			}
+
+			enqueue(_current, _current_level + 1);
+		}
+
+		_current = NULL;
+	}
+
+	/**
+	 * Moves every entity back to the top level, keeping the order of the levels, and
+	 * forgets the levels of blocked entities.
+	 */
+	void boost()
+	{
+		for (unsigned int level = 1; level < MLFQ_NR_LEVELS; level++) {
+			while (_levels[level].count()) {
+				_levels[0].enqueue(_levels[level].pop());
+			}
+		}
+
+		_nonempty = _levels[0].count() ? 1 : 0;
+
+		// the running entity has moved, so the next pick starts afresh
+		_current = NULL;
+		_since_boost = 0;
+
+		clear_sleepers();
+	}
+};
+
+/* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
+
+RegisterScheduler(MLFQScheduler);
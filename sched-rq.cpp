@@ -0,0 +1,98 @@
+/*
+ * Scheduler Runqueue
+ */
+#include "sched-rq.h"
+
+using namespace infos::kernel;
+
+/**
+ * Takes a node out of the queue, leaving it in the table.
+ */
+void RunQueue::unlink(Node *node)
+{
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		_head = node->next;
+	}
+
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		_tail = node->prev;
+	}
+
+	node->prev = node->next = NULL;
+}
+
+/**
+ * Adds an entity to the tail of the queue.
+ * @param entity The entity to add, which must not already be in the queue.
+ */
+void RunQueue::enqueue(SchedulingEntity *entity)
+{
+	Node *node = _nodes.insert(entity);
+	node->next = NULL;
+	node->prev = _tail;
+
+	if (_tail) {
+		_tail->next = node;
+	} else {
+		_head = node;
+	}
+
+	_tail = node;
+}
+
+/**
+ * Removes an entity from the queue.
+ * @param entity The entity to remove.
+ * @return Returns true if the entity was in the queue.
+ */
+bool RunQueue::remove(SchedulingEntity *entity)
+{
+	Node *node = _nodes.find(entity);
+	if (!node) {
+		return false;
+	}
+
+	unlink(node);
+	_nodes.erase(node);
+
+	return true;
+}
+
+/**
+ * Removes the entity at the head of the queue.
+ * @return Returns the entity, or NULL if the queue is empty.
+ */
+SchedulingEntity *RunQueue::pop()
+{
+	SchedulingEntity *entity = first();
+
+	if (entity) {
+		remove(entity);
+	}
+
+	return entity;
+}
+
+/**
+ * Moves the entity at the head of the queue to the tail.
+ * @return Returns the entity that was moved, or NULL if the queue is empty.
+ */
+SchedulingEntity *RunQueue::rotate()
+{
+	Node *node = _head;
+	if (!node || node == _tail) {
+		return first();
+	}
+
+	unlink(node);
+
+	node->prev = _tail;
+	_tail->next = node;
+	_tail = node;
+
+	return node->entity;
+}
@@ -0,0 +1,235 @@
+/*
+ * Scheduler Runqueue
+ */
+#pragma once
+
+#include <infos/kernel/sched-entity.h>
+
+// The number of nodes an entity table allocates at a time.
+#define ENTITY_TABLE_CHUNK	64
+
+// The number of hash slots an entity table starts with.
+#define ENTITY_TABLE_MIN_SLOTS	64
+
+namespace infos
+{
+	namespace kernel
+	{
+		/**
+		 * A table of per-entity scheduler nodes, found from the entity through a hash table
+		 * keyed by its address.  This lets a scheduling algorithm keep its own state for each
+		 * runnable entity without anything being added to SchedulingEntity itself.  Nodes come
+		 * from chunks that are recycled through a free list, so once the table has grown to
+		 * its working size, inserting and erasing never allocate.
+		 *
+		 * Nothing is allocated until the first insert.  Scheduling algorithms are constructed
+		 * statically, before the kernel heap is up, so an empty table must not need it.
+		 *
+		 * Node must be a plain struct whose first member is "SchedulingEntity *entity".
+		 */
+		template<typename Node>
+		class EntityTable
+		{
+		public:
+			EntityTable()
+				: _count(0),
+				_free_nodes(NULL),
+				_chunks(NULL),
+				_slots(NULL),
+				_capacity(0),
+				_used(0)
+			{
+			}
+
+			~EntityTable()
+			{
+				while (_chunks) {
+					Node *next = link(_chunks);
+					delete[] _chunks;
+					_chunks = next;
+				}
+
+				delete[] _slots;
+			}
+
+			/**
+			 * Adds a node for an entity.
+			 * @param entity The entity, which must not already be in the table.
+			 * @return Returns the new node, with only its entity filled in.
+			 */
+			Node *insert(SchedulingEntity *entity)
+			{
+				// keep the table at most three quarters full, counting tombstones
+				if ((_used + 1) * 4 > _capacity * 3) {
+					unsigned int capacity = _capacity ? _capacity : ENTITY_TABLE_MIN_SLOTS;
+					rehash((_count + 1) * 4 > capacity ? capacity * 2 : capacity);
+				}
+
+				Node *node = alloc_node();
+				node->entity = entity;
+
+				unsigned int i = hash(entity);
+				while (_slots[i] && _slots[i] != tombstone()) {
+					i = (i + 1) & (_capacity - 1);
+				}
+
+				if (!_slots[i]) {
+					_used++;
+				}
+
+				_slots[i] = node;
+				_count++;
+
+				return node;
+			}
+
+			/**
+			 * Finds the node of an entity.
+			 * @return Returns the node, or NULL if the entity is not in the table.
+			 */
+			Node *find(SchedulingEntity *entity) const
+			{
+				Node **slot = find_slot(entity);
+				return slot ? *slot : NULL;
+			}
+
+			/**
+			 * Removes a node from the table, and frees it.
+			 * @param node The node, which must be in the table.
+			 */
+			void erase(Node *node)
+			{
+				*find_slot(node->entity) = tombstone();
+				_count--;
+
+				link(node) = _free_nodes;
+				_free_nodes = node;
+			}
+
+			unsigned int count() const { return _count; }
+
+		private:
+			unsigned int _count;
+
+			Node *_free_nodes;
+			Node *_chunks;			// every block of nodes, chained through their first node
+
+			Node **_slots;
+			unsigned int _capacity;		// a power of two
+			unsigned int _used;		// slots holding a node or a tombstone
+
+			// A slot whose node has been erased.  Lookups carry on past it.
+			static Node *tombstone() { return (Node *) 1; }
+
+			// A free node is linked to the next one through its first bytes.
+			static Node *& link(Node *node) { return *(Node **) node; }
+
+			unsigned int hash(SchedulingEntity *entity) const
+			{
+				// Fibonacci hashing, on the address without the bits that alignment leaves clear.
+				uint64_t key = ((uintptr_t) entity >> 4) * 0x9e3779b97f4a7c15ull;
+				return (key >> 32) & (_capacity - 1);
+			}
+
+			Node **find_slot(SchedulingEntity *entity) const
+			{
+				if (!_capacity) {
+					return NULL;
+				}
+
+				for (unsigned int i = hash(entity); _slots[i]; i = (i + 1) & (_capacity - 1)) {
+					if (_slots[i] != tombstone() && _slots[i]->entity == entity) {
+						return &_slots[i];
+					}
+				}
+
+				return NULL;
+			}
+
+			/**
+			 * Rebuilds the hash table at the given size, dropping any tombstones.
+			 */
+			void rehash(unsigned int capacity)
+			{
+				Node **old_slots = _slots;
+				unsigned int old_capacity = _capacity;
+
+				_slots = new Node *[capacity];
+				_capacity = capacity;
+				_used = 0;
+
+				for (unsigned int i = 0; i < capacity; i++) {
+					_slots[i] = NULL;
+				}
+
+				for (unsigned int i = 0; i < old_capacity; i++) {
+					Node *node = old_slots[i];
+					if (!node || node == tombstone()) continue;
+
+					unsigned int j = hash(node->entity);
+					while (_slots[j]) {
+						j = (j + 1) & (_capacity - 1);
+					}
+
+					_slots[j] = node;
+					_used++;
+				}
+
+				delete[] old_slots;
+			}
+
+			Node *alloc_node()
+			{
+				if (!_free_nodes) {
+					// The first node of a chunk links the chunks together, and the rest are free.
+					Node *chunk = new Node[ENTITY_TABLE_CHUNK];
+					link(chunk) = _chunks;
+					_chunks = chunk;
+
+					for (unsigned int i = 1; i < ENTITY_TABLE_CHUNK; i++) {
+						link(&chunk[i]) = _free_nodes;
+						_free_nodes = &chunk[i];
+					}
+				}
+
+				Node *node = _free_nodes;
+				_free_nodes = link(node);
+
+				return node;
+			}
+		};
+
+		/**
+		 * A FIFO queue of scheduling entities, in which adding, removing and rotating an entity
+		 * all take constant time and, once the queue has grown to its working size, never
+		 * allocate.
+		 */
+		class RunQueue
+		{
+		public:
+			RunQueue() : _head(NULL), _tail(NULL) { }
+
+			void enqueue(SchedulingEntity *entity);
+			bool remove(SchedulingEntity *entity);
+
+			SchedulingEntity *first() const { return _head ? _head->entity : NULL; }
+			SchedulingEntity *pop();
+			SchedulingEntity *rotate();
+
+			bool contains(SchedulingEntity *entity) const { return _nodes.find(entity) != NULL; }
+			unsigned int count() const { return _nodes.count(); }
+
+		private:
+			struct Node
+			{
+				SchedulingEntity *entity;
+				Node *prev, *next;
+			};
+
+			EntityTable<Node> _nodes;
+			Node *_head, *_tail;
+
+			void unlink(Node *node);
+		};
+	}
+}
@@ -11,6 +11,7 @@
 #include <infos/kernel/log.h>
 #include <infos/util/list.h>
 #include <infos/util/lock.h>
+#include "sched-rq.h"
 
 #include <infos/kernel/sched-entity.h>
 
@@ -64,18 +65,274 @@ public:
 		if (runqueue.count() == 1) return runqueue.first();
 		SchedulingEntity *selected_entity = NULL;
 
-		selected_entity = runqueue.pop(); //remove adn returns first item in the list
-		runqueue.enqueue(selected_entity); //then append it to the end of the list
+		selected_entity = runqueue.rotate(); //moves the first item in the list to the end, and returns it
 
 		return selected_entity;
 
 	}
 
 private:
-	// A list containing the current runqueue.
-	List<SchedulingEntity *> runqueue;
+	// The current runqueue.
+	RunQueue runqueue;
+};
+
+// The number of CPUs the SMP scheduler keeps a runqueue for.  InfOS only brings up the boot
+// processor, so there is just the one unless the build asks for more.
+#ifndef NR_SCHED_CPUS
+#define NR_SCHED_CPUS		1
+#endif
+
+// Returns the index of the CPU that is executing.  This is always the boot processor, unless
+// the build supplies a way of telling the CPUs apart.
+#ifndef SCHED_CURRENT_CPU
+#define SCHED_CURRENT_CPU()	0
+#endif
+
+// How many picks the boot processor makes between rebalancing the runqueues.
+#define REBALANCE_INTERVAL	64
+
+/**
+ * A spinlock protecting one runqueue.  It is always taken with interrupts disabled, so the
+ * holder cannot be interrupted by a scheduling event on its own CPU.
+ */
+class RunQueueLock
+{
+public:
+	RunQueueLock() : _locked(false) { }
+
+	void lock()
+	{
+		while (__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE)) {
+			asm volatile("pause");
+		}
+	}
+
+	void unlock()
+	{
+		__atomic_clear(&_locked, __ATOMIC_RELEASE);
+	}
+
+private:
+	bool _locked;
+};
+
+/**
+ * A round-robin scheduling algorithm with a runqueue per CPU, so that CPUs only contend with
+ * each other when they move work around.  A CPU whose runqueue is empty steals from the
+ * busiest one, and the queue lengths are evened out every so often.
+ */
+class SMPRoundRobinScheduler : public SchedulingAlgorithm
+{
+	// the host harness checks the runqueues directly
+	friend class SchedulerTestHook;
+
+public:
+	SMPRoundRobinScheduler() : _nr_picks(0) { }
+
+	/**
+	 * Returns the friendly name of the algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "smp-rr"; }
+
+	/**
+	 * Called when a scheduling entity becomes eligible for running.  It goes on the
+	 * shortest runqueue.
+	 * @param entity
+	 */
+	void add_to_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		CPURunQueue& rq = _runqueues[shortest_queue()];
+
+		rq.lock.lock();
+		rq.entities.enqueue(&entity);
+		rq.lock.unlock();
+	}
+
+	/**
+	 * Called when a scheduling entity is no longer eligible for running.
+	 * @param entity
+	 */
+	void remove_from_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+
+		for (unsigned int cpu = 0; cpu < NR_SCHED_CPUS; cpu++) {
+			CPURunQueue& rq = _runqueues[cpu];
+
+			rq.lock.lock();
+
+			bool found = rq.entities.remove(&entity);
+			if (found && rq.running == &entity) {
+				rq.running = NULL;
+			}
+
+			rq.lock.unlock();
+
+			if (found) {
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Called every time a scheduling event occurs, to cause the next eligible entity
+	 * to be chosen from this CPU's runqueue.
+	 */
+	SchedulingEntity *pick_next_entity() override
+	{
+		UniqueIRQLock l;
+
+		unsigned int cpu = current_cpu();
+
+		if (cpu == 0 && ++_nr_picks % REBALANCE_INTERVAL == 0) {
+			rebalance();
+		}
+
+		CPURunQueue& rq = _runqueues[cpu];
+		if (rq.entities.count() == 0) {
+			steal(cpu);
+		}
+
+		rq.lock.lock();
+
+		SchedulingEntity *selected_entity = NULL;
+		if (rq.entities.count() == 1) {
+			selected_entity = rq.entities.first();
+		} else if (rq.entities.count() > 1) {
+			selected_entity = rq.entities.rotate();
+		}
+
+		rq.running = selected_entity;
+		rq.lock.unlock();
+
+		return selected_entity;
+	}
+
+private:
+	struct CPURunQueue
+	{
+		CPURunQueue() : running(NULL) { }
+
+		RunQueueLock lock;
+		RunQueue entities;
+		SchedulingEntity *running;	// picked last on this CPU, and still on its runqueue
+	};
+
+	CPURunQueue _runqueues[NR_SCHED_CPUS];
+	unsigned int _nr_picks;
+
+	/**
+	 * Returns the index of the CPU that is currently executing, for selecting its runqueue.
+	 */
+	static unsigned int current_cpu()
+	{
+		return SCHED_CURRENT_CPU();
+	}
+
+	/**
+	 * Returns the CPU with the shortest runqueue.  The lengths are read without the locks,
+	 * since this is only a placement hint.
+	 */
+	unsigned int shortest_queue() const
+	{
+		unsigned int shortest = current_cpu();
+
+		for (unsigned int cpu = 0; cpu < NR_SCHED_CPUS; cpu++) {
+			if (_runqueues[cpu].entities.count() < _runqueues[shortest].entities.count()) {
+				shortest = cpu;
+			}
+		}
+
+		return shortest;
+	}
+
+	/**
+	 * Returns the CPU with the longest runqueue, read without the locks.
+	 */
+	unsigned int longest_queue() const
+	{
+		unsigned int longest = 0;
+
+		for (unsigned int cpu = 1; cpu < NR_SCHED_CPUS; cpu++) {
+			if (_runqueues[cpu].entities.count() > _runqueues[longest].entities.count()) {
+				longest = cpu;
+			}
+		}
+
+		return longest;
+	}
+
+	/**
+	 * Moves the entity that has waited longest on one runqueue to the tail of another.  The
+	 * entity the source CPU is running is never moved.  It is usually at the tail already, but
+	 * an entity picked while it was alone stays at the head, so it is rotated out of the way.
+	 * The locks are taken in address order, so two CPUs moving work between the same pair of
+	 * queues cannot deadlock.
+	 * @return Returns true if an entity was moved.
+	 */
+	bool migrate_one(unsigned int from, unsigned int to)
+	{
+		CPURunQueue& src = _runqueues[from];
+		CPURunQueue& dst = _runqueues[to];
+
+		CPURunQueue& first = &src < &dst ? src : dst;
+		CPURunQueue& second = &src < &dst ? dst : src;
+
+		first.lock.lock();
+		second.lock.lock();
+
+		bool moved = src.entities.count() > (src.running ? 1u : 0u);
+		if (moved) {
+			if (src.entities.first() == src.running) {
+				src.entities.rotate();
+			}
+
+			dst.entities.enqueue(src.entities.pop());
+		}
+
+		second.lock.unlock();
+		first.lock.unlock();
+
+		return moved;
+	}
+
+	/**
+	 * Gives an idle CPU work from the busiest runqueue.
+	 * @param cpu The idle CPU.
+	 */
+	void steal(unsigned int cpu)
+	{
+		unsigned int busiest = longest_queue();
+
+		if (busiest != cpu) {
+			migrate_one(busiest, cpu);
+		}
+	}
+
+	/**
+	 * Evens out the runqueue lengths, by moving entities from the longest to the shortest
+	 * until they differ by at most one.
+	 */
+	void rebalance()
+	{
+		for (unsigned int i = 0; i < NR_SCHED_CPUS * 4; i++) {
+			unsigned int longest = longest_queue();
+			unsigned int shortest = shortest_queue();
+
+			if (_runqueues[longest].entities.count() <= _runqueues[shortest].entities.count() + 1) {
+				break;
+			}
+
+			if (!migrate_one(longest, shortest)) {
+				break;
+			}
+		}
+	}
 };
 
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
 RegisterScheduler(RoundRobinScheduler);
+RegisterScheduler(SMPRoundRobinScheduler);
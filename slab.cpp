@@ -0,0 +1,429 @@
+/*
+ * Slab Object Allocator
+ */
+#include "slab.h"
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+using namespace infos::util;
+
+// Every slab is a block of this order, so the slab an object lives in can be found by
+// rounding its address down.  This relies on the kernel's mapping of physical memory keeping
+// naturally aligned blocks aligned.
+#define SLAB_ORDER		2
+#define SLAB_BYTES		((size_t)0x1000 << SLAB_ORDER)
+
+// Slabs offset their first object by a multiple of this, so the same object in different
+// slabs does not always land on the same cache lines.
+#define SLAB_COLOUR_ALIGN	64
+
+/**
+ * The header at the start of every slab.
+ */
+struct infos::mm::Slab
+{
+	Slab *next, *prev;	// the cache list (partial, full or empty) this slab is on
+	ObjectCache *cache;
+	PageDescriptor *pgd;
+	void *free_list;	// free objects, linked through each object's free link
+	unsigned int in_use;	// objects taken from this slab
+};
+
+ObjectCache *ObjectCache::_caches;
+
+/**
+ * Rounds a value up to a multiple of the given (power of two) alignment.
+ */
+static inline size_t align_up(size_t value, size_t align)
+{
+	return (value + align - 1) & ~(align - 1);
+}
+
+/**
+ * Returns the slab that contains the given object.
+ */
+static inline Slab *slab_of(void *obj)
+{
+	return (Slab *) ((uintptr_t) obj & ~(SLAB_BYTES - 1));
+}
+
+/**
+ * Returns the index of the CPU that is currently executing, for selecting its magazine.
+ * InfOS only brings up the boot processor, so this is always zero.
+ */
+static inline unsigned int current_cpu()
+{
+	return 0;
+}
+
+/**
+ * Removes a slab from a cache list.
+ */
+static void slab_unlink(Slab *& head, Slab *slab)
+{
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		head = slab->next;
+	}
+
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+
+	slab->next = slab->prev = NULL;
+}
+
+/**
+ * Adds a slab to the front of a cache list.
+ */
+static void slab_push(Slab *& head, Slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = head;
+
+	if (head) {
+		head->prev = slab;
+	}
+
+	head = slab;
+}
+
+/**
+ * Constructs a new object cache.  No memory is taken until the first allocation.
+ * @param name The name of the cache, for statistics.
+ * @param object_size The size of each object.
+ * @param align The alignment of each object, which must be a power of two.
+ * @param ctor A function that constructs each object when its slab is created, or NULL.
+ */
+ObjectCache::ObjectCache(const char *name, size_t object_size, size_t align, Constructor ctor)
+	: _name(name),
+	_object_size(object_size),
+	_ctor(ctor),
+	_colour_next(0),
+	_partial(NULL),
+	_full(NULL),
+	_empty(NULL),
+	_stats()
+{
+	if (align < sizeof(void *)) {
+		align = sizeof(void *);
+	}
+
+	_align = align;
+
+	// A constructed object must be left alone while it is free, so the free link goes
+	// after the object rather than over the top of it.
+	if (ctor) {
+		_free_link = align_up(object_size, sizeof(void *));
+		_stride = align_up(_free_link + sizeof(void *), align);
+	} else {
+		_free_link = 0;
+		_stride = align_up(object_size < sizeof(void *) ? sizeof(void *) : object_size, align);
+	}
+
+	size_t usable = SLAB_BYTES - align_up(sizeof(Slab), align);
+	_objects_per_slab = usable / _stride;
+	_colour_range = (usable - (_objects_per_slab * _stride)) / SLAB_COLOUR_ALIGN + 1;
+
+	for (unsigned int cpu = 0; cpu < SLAB_NR_CPUS; cpu++) {
+		_magazines[cpu].count = 0;
+	}
+
+	_next_cache = _caches;
+	_caches = this;
+}
+
+void *ObjectCache::get_link(void *obj) const
+{
+	return *(void **) ((uintptr_t) obj + _free_link);
+}
+
+void ObjectCache::set_link(void *obj, void *next) const
+{
+	*(void **) ((uintptr_t) obj + _free_link) = next;
+}
+
+/**
+ * Creates a new slab, constructs all of its objects, and puts it on the empty list.
+ * @return Returns the new slab, or NULL if there were no pages for it.
+ */
+Slab *ObjectCache::grow()
+{
+	PageDescriptor *pgd = sys.mm().pgalloc().alloc_pages(SLAB_ORDER);
+	if (!pgd) {
+		return NULL;
+	}
+
+	Slab *slab = (Slab *) sys.mm().pgalloc().pgd_to_kva(pgd);
+	slab->cache = this;
+	slab->pgd = pgd;
+	slab->in_use = 0;
+	slab->free_list = NULL;
+
+	// Pick this slab's colour, and lay the objects out after it.
+	uintptr_t first = (uintptr_t) slab + align_up(sizeof(Slab), _align) + (_colour_next * SLAB_COLOUR_ALIGN);
+	_colour_next = (_colour_next + 1) % _colour_range;
+
+	// Thread the free list backwards, so objects are handed out in address order.
+	for (unsigned int i = _objects_per_slab; i > 0; i--) {
+		void *obj = (void *) (first + ((i - 1) * _stride));
+
+		if (_ctor) {
+			_ctor(obj);
+		}
+
+		set_link(obj, slab->free_list);
+		slab->free_list = obj;
+	}
+
+	slab_push(_empty, slab);
+
+	_stats.slabs++;
+	_stats.objects += _objects_per_slab;
+
+	return slab;
+}
+
+/**
+ * Gives empty slabs back to the page allocator.
+ * @param keep_one True to keep one empty slab around for the next allocation.
+ */
+void ObjectCache::shrink(bool keep_one)
+{
+	Slab *slab = (keep_one && _empty) ? _empty->next : _empty;
+
+	while (slab) {
+		Slab *next = slab->next;
+		slab_unlink(_empty, slab);
+
+		sys.mm().pgalloc().free_pages(slab->pgd, SLAB_ORDER);
+
+		_stats.slabs--;
+		_stats.objects -= _objects_per_slab;
+
+		slab = next;
+	}
+}
+
+/**
+ * Takes an object from a slab, preferring partially used slabs so that empty ones can be
+ * given back.
+ * @return Returns the object, or NULL if no slab could be created.
+ */
+void *ObjectCache::alloc_from_slab()
+{
+	Slab *slab = _partial;
+
+	if (!slab) {
+		slab = _empty ? _empty : grow();
+		if (!slab) {
+			return NULL;
+		}
+
+		slab_unlink(_empty, slab);
+		slab_push(_partial, slab);
+	}
+
+	void *obj = slab->free_list;
+	slab->free_list = get_link(obj);
+	slab->in_use++;
+
+	if (slab->in_use == _objects_per_slab) {
+		slab_unlink(_partial, slab);
+		slab_push(_full, slab);
+	}
+
+	return obj;
+}
+
+/**
+ * Returns an object to the slab it came from.
+ * @param obj The object to return.
+ */
+void ObjectCache::free_to_slab(void *obj)
+{
+	Slab *slab = slab_of(obj);
+	assert(slab->cache == this);
+
+	if (slab->in_use == _objects_per_slab) {
+		slab_unlink(_full, slab);
+		slab_push(_partial, slab);
+	}
+
+	set_link(obj, slab->free_list);
+	slab->free_list = obj;
+	slab->in_use--;
+
+	if (slab->in_use == 0) {
+		slab_unlink(_partial, slab);
+		slab_push(_empty, slab);
+		shrink(true);
+	}
+}
+
+/**
+ * Allocates an object from this cache.
+ * @return Returns the object, or NULL if memory is exhausted.
+ */
+void *ObjectCache::alloc()
+{
+	UniqueIRQLock l;
+
+	Magazine& mag = _magazines[current_cpu()];
+
+	if (mag.count) {
+		_stats.magazine_hits++;
+	} else {
+		// Refill half the magazine, so that a following free has room too.
+		_stats.magazine_misses++;
+
+		while (mag.count < SLAB_MAGAZINE_SIZE / 2) {
+			void *obj = alloc_from_slab();
+			if (!obj) {
+				break;
+			}
+
+			mag.objects[mag.count++] = obj;
+		}
+
+		if (!mag.count) {
+			return NULL;
+		}
+	}
+
+	_stats.allocs++;
+	_stats.in_use++;
+
+	return mag.objects[--mag.count];
+}
+
+/**
+ * Frees an object back to this cache.
+ * @param obj The object to free, which must have come from this cache.
+ */
+void ObjectCache::free(void *obj)
+{
+	UniqueIRQLock l;
+
+	Magazine& mag = _magazines[current_cpu()];
+
+	// Flush the older half of a full magazine back to the slabs.
+	if (mag.count == SLAB_MAGAZINE_SIZE) {
+		for (unsigned int i = 0; i < SLAB_MAGAZINE_SIZE / 2; i++) {
+			free_to_slab(mag.objects[i]);
+		}
+
+		for (unsigned int i = SLAB_MAGAZINE_SIZE / 2; i < SLAB_MAGAZINE_SIZE; i++) {
+			mag.objects[i - SLAB_MAGAZINE_SIZE / 2] = mag.objects[i];
+		}
+
+		mag.count -= SLAB_MAGAZINE_SIZE / 2;
+	}
+
+	mag.objects[mag.count++] = obj;
+
+	_stats.frees++;
+	_stats.in_use--;
+}
+
+/**
+ * Empties every magazine back into the slabs, and gives all of the empty slabs back to the
+ * page allocator.  Objects parked in a magazine otherwise pin their slabs indefinitely.
+ */
+void ObjectCache::reap()
+{
+	UniqueIRQLock l;
+
+	for (unsigned int cpu = 0; cpu < SLAB_NR_CPUS; cpu++) {
+		Magazine& mag = _magazines[cpu];
+
+		while (mag.count) {
+			free_to_slab(mag.objects[--mag.count]);
+		}
+	}
+
+	shrink(false);
+}
+
+/**
+ * Retrieves the counters for this cache.
+ * @param st Populated with the counters.
+ */
+void ObjectCache::stats(ObjectCacheStats& st) const
+{
+	UniqueIRQLock l;
+
+	st = _stats;
+	st.wasted_bytes = (_stats.slabs * SLAB_BYTES) - (_stats.in_use * _object_size);
+}
+
+// The general purpose caches, for objects that do not have a cache of their own.
+static ObjectCache size_caches[] = {
+	ObjectCache("size-16", 16),
+	ObjectCache("size-32", 32),
+	ObjectCache("size-64", 64),
+	ObjectCache("size-128", 128),
+	ObjectCache("size-256", 256),
+	ObjectCache("size-512", 512),
+	ObjectCache("size-1024", 1024),
+	ObjectCache("size-2048", 2048),
+};
+
+/**
+ * Allocates an object of at least the given size from the general purpose caches.
+ * @param size The size of the object.
+ * @return Returns the object, or NULL if the size is too large or memory is exhausted.
+ */
+void *ObjectCache::alloc_sized(size_t size)
+{
+	for (unsigned int i = 0; i < ARRAY_SIZE(size_caches); i++) {
+		if (size <= size_caches[i].object_size()) {
+			return size_caches[i].alloc();
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Frees an object back to whichever cache it came from.
+ * @param obj The object to free.
+ */
+void ObjectCache::free_object(void *obj)
+{
+	slab_of(obj)->cache->free(obj);
+}
+
+/**
+ * Reaps every cache, for when the page allocator is short of memory.
+ */
+void ObjectCache::reap_all()
+{
+	for (ObjectCache *cache = _caches; cache; cache = cache->_next_cache) {
+		cache->reap();
+	}
+}
+
+/**
+ * Logs the counters of every cache.
+ */
+void ObjectCache::dump_all()
+{
+	mm_log.messagef(LogLevel::DEBUG, "SLAB STATE:");
+
+	for (ObjectCache *cache = _caches; cache; cache = cache->_next_cache) {
+		ObjectCacheStats st;
+		cache->stats(st);
+
+		// Utilisation is the share of object slots holding in-use objects, in percent.
+		mm_log.messagef(LogLevel::DEBUG, "%s: size=%lu slabs=%lu objects=%lu in-use=%lu util=%lu%% wasted=%lu hits=%lu misses=%lu",
+			cache->name(), cache->object_size(), st.slabs, st.objects, st.in_use,
+			st.objects ? (st.in_use * 100) / st.objects : 0, st.wasted_bytes,
+			st.magazine_hits, st.magazine_misses);
+	}
+}
@@ -0,0 +1,99 @@
+/*
+ * Slab Object Allocator
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+
+// The number of per-CPU magazines each cache has, and how many objects each one holds.
+#define SLAB_NR_CPUS		1
+#define SLAB_MAGAZINE_SIZE	32
+
+namespace infos
+{
+	namespace mm
+	{
+		struct Slab;
+
+		/**
+		 * The counters an object cache keeps, for judging how well it is sized.
+		 */
+		struct ObjectCacheStats
+		{
+			uint64_t slabs;			// slabs currently owned by the cache
+			uint64_t objects;		// object slots across all of those slabs
+			uint64_t in_use;		// objects handed out, and not sitting in a magazine
+			uint64_t allocs;		// successful allocations
+			uint64_t frees;			// objects freed
+			uint64_t magazine_hits;		// allocations served from a per-CPU magazine
+			uint64_t magazine_misses;	// allocations that had to refill a magazine
+			uint64_t wasted_bytes;		// slab memory not holding the contents of an in-use object
+		};
+
+		/**
+		 * A cache of equally sized objects, carved out of slabs of pages taken from the page
+		 * allocator.  Freed objects are kept in a per-CPU magazine and handed straight back out,
+		 * and only go back to their slab when the magazine overflows or the cache is reaped.
+		 */
+		class ObjectCache
+		{
+		public:
+			/**
+			 * A function that puts a freshly carved object into its constructed state.  It is
+			 * called once per object, when its slab is created, and objects must be freed
+			 * back to the cache in that state.
+			 */
+			typedef void (*Constructor)(void *obj);
+
+			ObjectCache(const char *name, size_t object_size, size_t align = 8, Constructor ctor = NULL);
+
+			void *alloc();
+			void free(void *obj);
+
+			void reap();
+			void stats(ObjectCacheStats& st) const;
+
+			const char *name() const { return _name; }
+			size_t object_size() const { return _object_size; }
+
+			static void *alloc_sized(size_t size);
+			static void free_object(void *obj);
+			static void reap_all();
+			static void dump_all();
+
+		private:
+			struct Magazine
+			{
+				unsigned int count;
+				void *objects[SLAB_MAGAZINE_SIZE];
+			};
+
+			const char *_name;
+			size_t _object_size;		// the size asked for
+			size_t _align;
+			size_t _stride;			// the distance between objects in a slab
+			size_t _free_link;		// where, in a free object, the link to the next one lives
+			Constructor _ctor;
+
+			unsigned int _objects_per_slab;
+			unsigned int _colour_range;	// the number of distinct colour offsets that fit
+			unsigned int _colour_next;	// the colour offset the next slab will use
+
+			Slab *_partial, *_full, *_empty;
+			ObjectCacheStats _stats;
+
+			Magazine _magazines[SLAB_NR_CPUS];
+
+			ObjectCache *_next_cache;
+			static ObjectCache *_caches;
+
+			Slab *grow();
+			void shrink(bool keep_one);
+			void *alloc_from_slab();
+			void free_to_slab(void *obj);
+
+			void *get_link(void *obj) const;
+			void set_link(void *obj, void *next) const;
+		};
+	}
+}
@@ -7,52 +7,99 @@
  * STUDENT NUMBER: s1770036
  */
 #include "tarfs.h"
+#include "slab.h"
+#include "gzip-device.h"
+#include <infos/kernel/kernel.h>
 #include <infos/kernel/log.h>
+#include <infos/mm/mm.h>
+#include <infos/util/lock.h>
 
 using namespace infos::fs;
 using namespace infos::drivers;
 using namespace infos::drivers::block;
 using namespace infos::kernel;
 using namespace infos::util;
+using namespace infos::mm;
+using namespace infos::locking;
 using namespace tarfs;
 
+// Nodes are created in bulk when the tree is built, so they come from their own object cache
+// rather than the general purpose heap.
+static ObjectCache tarfs_node_cache("tarfs-node", sizeof(TarFSNode));
+
+// The number of blocks each file-system caches, and the largest run of whole blocks a read
+// takes through the cache.  Longer runs go straight from the device to the caller, so that
+// streaming a large member does not flush the cache, apart from any blocks that are cached
+// already.
+#define TARFS_CACHE_BLOCKS		256
+#define TARFS_CACHED_READ_BLOCKS	8
+
+// The bounds of the read-ahead window, in blocks.  The window starts small when a file is
+// opened or seeked, and doubles each time a sequential reader catches up with it.
+#define TARFS_READAHEAD_MIN		4
+#define TARFS_READAHEAD_MAX		BLOCK_CACHE_MAX_PREFETCH
+
+// The largest gap between the data of two requests in a batch that is read through, rather
+// than splitting the device request.  The data of consecutive members is always separated by
+// at least the header of the second.
+#define TARFS_BATCH_MAX_GAP		4
+
+// The most data of a pax extended header that is read, looking for the path and size of the
+// member after it.  Anything beyond this is ignored.
+#define TARFS_MAX_EXTENDED_HEADER	4096
+
 
 /**
  * TAR files contain header data encoded as octal values in ASCII.  This function
- * converts this terrible representation into a real unsigned integer.
- *
- * You DO NOT need to modify this function.
+ * converts this terrible representation into a real unsigned integer.  The field is parsed
+ * over its fixed width, skipping leading spaces and stopping at the first space or NUL.  GNU
+ * tar stores numbers too large for the field in base-256 instead, which is marked by the top
+ * bit of the first byte.
  *
- * @param data The (null-terminated) ASCII data containing an octal number.
- * @return Returns an unsigned integer number, corresponding to the input data.
+ * @param field The header field containing the number.
+ * @param width The width of the field.
+ * @param value Populated with the number.
+ * @return Returns true if the field holds a valid number, or false otherwise.
  */
-static inline unsigned int octal2ui(const char *data)
+static bool header_number(const char *field, unsigned int width, uint64_t& value)
 {
-	// Current working value.
-	unsigned int value = 0;
+	const uint8_t *data = (const uint8_t *) field;
+	value = 0;
 
-	// Length of the input data.
-	int len = strlen(data);
+	// Base-256: the remaining bits of the first byte, and then every following byte, make up
+	// a big-endian number.  Negative numbers have no meaning for the fields read here.
+	if (data[0] & 0x80) {
+		if (data[0] & 0x40) {
+			return false;
+		}
 
-	// Starting at i = 1, with a factor of one.
-	int i = 1, factor = 1;
-	while (i < len) {
-		// Extract the current character we're working on (backwards from the end).
-		char ch = data[len - i];
+		value = data[0] & 0x3f;
+		for (unsigned int i = 1; i < width; i++) {
+			if (value >> 56) {
+				return false;
+			}
 
-		// Add the value of the character, multipled by the factor, to
-		// the working value.
-		value += factor * (ch - '0');
+			value = (value << 8) | data[i];
+		}
 
-		// Increment the factor by multiplying it by eight.
-		factor *= 8;
+		return true;
+	}
 
-		// Increment the current character position.
+	unsigned int i = 0;
+	while (i < width && data[i] == ' ') {
 		i++;
 	}
 
-	// Return the current working value.
-	return value;
+	for (; i < width && data[i] && data[i] != ' '; i++) {
+		unsigned int digit = data[i] - '0';
+		if (digit > 7) {
+			return false;
+		}
+
+		value = (value << 3) | digit;
+	}
+
+	return true;
 }
 
 // The structure that represents the header block present in
@@ -79,6 +126,375 @@ namespace tarfs {
 		char prefix[155];
 
 	} __packed;
+
+	// An archive may carry an index of its members, generated by tools/tarfs-mkindex, so
+	// that mounting it does not need to read every header.  The index entries follow the
+	// end of the archive, and the last block of the device is a trailer that locates them.
+	#define TARFS_INDEX_MAGIC	"TARFSIDX"
+	#define TARFS_INDEX_VERSION	1
+
+	struct index_trailer {
+		char magic[8];
+		uint32_t version;
+		uint32_t index_block;	// the first block of the index entries
+		uint32_t index_bytes;	// the length of the index entries
+		uint32_t nr_entries;
+		uint32_t checksum;	// FNV-1a hash of the index entries
+	} __packed;
+
+	// Each entry is immediately followed by its path, which is not NUL terminated.
+	struct index_entry {
+		uint32_t header_block;
+		uint32_t data_block;
+		uint32_t size;		// in bytes
+		char typeflag;
+		uint8_t reserved;
+		uint16_t path_length;
+	} __packed;
+
+	/**
+	 * An index of every node in the archive, keyed by full path.  The paths themselves are
+	 * interned into large chunks of storage owned by the index, and each node points at its
+	 * own, so a child can be found from its parent's path and its name without building any
+	 * strings.  Lookups always compare the full path, so hash collisions are harmless.
+	 */
+	class PathIndex
+	{
+	public:
+		PathIndex() : _table(NULL), _capacity(0), _count(0), _chunks(NULL)
+		{
+			grow();
+		}
+
+		~PathIndex()
+		{
+			delete[] _table;
+
+			while (_chunks) {
+				Chunk *next = _chunks->next;
+				delete[] (char *) _chunks;
+				_chunks = next;
+			}
+		}
+
+		/**
+		 * Finds the node at the path formed by joining a directory path and a name with '/'.
+		 * @param dir The path of the directory, which may be empty for the root.
+		 * @param dir_length The length of the directory path.
+		 * @param name The name of the entry within the directory.
+		 * @param name_length The length of the name.
+		 * @return Returns the node, or NULL if there is no node at that path.
+		 */
+		TarFSNode *lookup(const char *dir, unsigned int dir_length, const char *name, unsigned int name_length) const
+		{
+			uint32_t hash = hash_path(dir, dir_length, name, name_length);
+			unsigned int length = dir_length + (dir_length ? 1 : 0) + name_length;
+
+			for (unsigned int i = hash & (_capacity - 1); _table[i].node; i = (i + 1) & (_capacity - 1)) {
+				if (_table[i].hash != hash || _table[i].node->path_length() != length) {
+					continue;
+				}
+
+				const char *path = _table[i].node->path();
+
+				if (dir_length && (strncmp(path, dir, dir_length) || path[dir_length] != '/')) {
+					continue;
+				}
+
+				if (!strncmp(path + length - name_length, name, name_length)) {
+					return _table[i].node;
+				}
+			}
+
+			return NULL;
+		}
+
+		/**
+		 * Finds the node at the given full path.
+		 */
+		TarFSNode *lookup(const char *path, unsigned int length) const
+		{
+			return lookup("", 0, path, length);
+		}
+
+		/**
+		 * Adds a node to the index, giving it an interned copy of its full path.
+		 * @param node The node to add, which must not already be in the index.
+		 * @param path The full path of the node.
+		 * @param length The length of the path.
+		 */
+		void insert(TarFSNode *node, const char *path, unsigned int length)
+		{
+			node->_path = intern(path, length);
+			node->_path_length = length;
+
+			if ((_count + 1) * 4 > _capacity * 3) {
+				grow();
+			}
+
+			uint32_t hash = hash_path("", 0, path, length);
+			unsigned int i = hash & (_capacity - 1);
+			while (_table[i].node) {
+				i = (i + 1) & (_capacity - 1);
+			}
+
+			_table[i].hash = hash;
+			_table[i].node = node;
+			_count++;
+		}
+
+	private:
+		struct Entry
+		{
+			uint32_t hash;
+			TarFSNode *node;
+		};
+
+		struct Chunk
+		{
+			Chunk *next;
+			unsigned int used;
+		};
+
+		static const unsigned int chunk_size = 0x10000;
+
+		Entry *_table;
+		unsigned int _capacity, _count;
+		Chunk *_chunks;
+
+		/**
+		 * Computes the FNV-1a hash of a directory path and a name, as if they were joined with '/'.
+		 */
+		static uint32_t hash_path(const char *dir, unsigned int dir_length, const char *name, unsigned int name_length)
+		{
+			uint32_t hash = 2166136261u;
+
+			for (unsigned int i = 0; i < dir_length; i++) {
+				hash = (hash ^ (uint8_t) dir[i]) * 16777619u;
+			}
+
+			if (dir_length) {
+				hash = (hash ^ (uint8_t) '/') * 16777619u;
+			}
+
+			for (unsigned int i = 0; i < name_length; i++) {
+				hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+			}
+
+			return hash;
+		}
+
+		/**
+		 * Doubles the size of the hash table, and re-inserts every entry.
+		 */
+		void grow()
+		{
+			Entry *old_table = _table;
+			unsigned int old_capacity = _capacity;
+
+			_capacity = old_capacity ? old_capacity * 2 : 1024;
+			_table = new Entry[_capacity];
+
+			for (unsigned int i = 0; i < _capacity; i++) {
+				_table[i].node = NULL;
+			}
+
+			for (unsigned int i = 0; i < old_capacity; i++) {
+				if (!old_table[i].node) continue;
+
+				unsigned int j = old_table[i].hash & (_capacity - 1);
+				while (_table[j].node) {
+					j = (j + 1) & (_capacity - 1);
+				}
+
+				_table[j] = old_table[i];
+			}
+
+			delete[] old_table;
+		}
+
+		/**
+		 * Copies a string into the index's storage.
+		 * @return Returns the stored copy, which is not NUL terminated.
+		 */
+		const char *intern(const char *str, unsigned int length)
+		{
+			if (!_chunks || _chunks->used + length > chunk_size) {
+				unsigned int size = length > chunk_size ? length : chunk_size;
+
+				Chunk *chunk = (Chunk *) new char[sizeof(Chunk) + size];
+				chunk->next = _chunks;
+				chunk->used = 0;
+				_chunks = chunk;
+			}
+
+			char *copy = (char *) (_chunks + 1) + _chunks->used;
+			memcpy(copy, str, length);
+			_chunks->used += length;
+
+			return copy;
+		}
+	};
+}
+
+/**
+ * Checks a header block against its checksum, which is the sum of every byte in the block
+ * with the checksum field itself taken as spaces.  Some old versions of tar summed signed
+ * bytes, so that sum is accepted too.
+ * @param header The header to check.
+ * @return Returns true if the checksum matches.
+ */
+static bool header_checksum_ok(const posix_header *header)
+{
+	uint64_t stored;
+	if (!header_number(header->chksum, sizeof(header->chksum), stored)) {
+		return false;
+	}
+
+	// Sum the block a word at a time: each word is split into its even and odd bytes, which
+	// are added across four 16-bit lanes.  A lane gathers at most 128 bytes, so it cannot
+	// overflow.  The header is packed, so each word is copied out rather than loaded through
+	// a pointer that may not be aligned.
+	const uint8_t *block = (const uint8_t *) header;
+	uint64_t lanes = 0;
+	unsigned int high_bytes = 0;
+
+	for (unsigned int i = 0; i < 512; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, block + i, sizeof(word));
+
+		lanes += (word & 0x00ff00ff00ff00ffull) + ((word >> 8) & 0x00ff00ff00ff00ffull);
+		high_bytes += __builtin_popcountll(word & 0x8080808080808080ull);
+	}
+
+	int64_t unsigned_sum = (lanes & 0xffff) + ((lanes >> 16) & 0xffff) + ((lanes >> 32) & 0xffff) + (lanes >> 48);
+
+	// count the checksum field as spaces
+	for (unsigned int i = 0; i < sizeof(header->chksum); i++) {
+		uint8_t ch = header->chksum[i];
+
+		unsigned_sum += ' ' - ch;
+		high_bytes -= ch >> 7;
+	}
+
+	int64_t signed_sum = unsigned_sum - (256 * (int64_t) high_bytes);
+
+	return (int64_t) stored == unsigned_sum || (int64_t) stored == signed_sum;
+}
+
+/**
+ * Returns the length of a header field, which is NUL terminated unless it fills the field.
+ */
+static inline unsigned int field_length(const char *field, unsigned int size)
+{
+	unsigned int length = 0;
+	while (length < size && field[length]) {
+		length++;
+	}
+
+	return length;
+}
+
+/**
+ * Drops any leading "./" or '/' and any trailing '/' from a path, in place.
+ * @param path The path.
+ * @param length The length of the path.
+ * @return Returns the new length of the path.
+ */
+static unsigned int trim_path(char *path, unsigned int length)
+{
+	unsigned int start = 0;
+	while (start < length) {
+		if (path[start] == '/') {
+			start++;
+		} else if (path[start] == '.' && start + 1 < length && path[start + 1] == '/') {
+			start += 2;
+		} else {
+			break;
+		}
+	}
+
+	while (length > start && path[length - 1] == '/') {
+		length--;
+	}
+
+	length -= start;
+	if (start) {
+		memmove(path, path + start, length);
+	}
+
+	return length;
+}
+
+/**
+ * Builds the full path of an archive member from its header, joining the ustar prefix
+ * and name fields, and trimming it.
+ * @param header The header of the member.
+ * @param path Populated with the path, which is not NUL terminated.  Must hold 256 characters.
+ * @return Returns the length of the path.
+ */
+static unsigned int header_path(const posix_header *header, char *path)
+{
+	unsigned int length = 0;
+
+	// Only POSIX ustar archives use the prefix field for the path.  GNU archives put
+	// other things there.
+	if (!memcmp(header->magic, "ustar", 6)) {
+		unsigned int prefix_length = field_length(header->prefix, sizeof(header->prefix));
+
+		if (prefix_length) {
+			memcpy(path, header->prefix, prefix_length);
+			path[prefix_length] = '/';
+			length = prefix_length + 1;
+		}
+	}
+
+	unsigned int name_length = field_length(header->name, sizeof(header->name));
+	memcpy(path + length, header->name, name_length);
+	length += name_length;
+
+	return trim_path(path, length);
+}
+
+/**
+ * Finds a record in the data of a pax extended header.  The data is a series of records of
+ * the form "<length> <keyword>=<value>\n", where the decimal length counts the whole record.
+ * @param data The data of the extended header.
+ * @param size The length of the data.
+ * @param keyword The keyword to look for.
+ * @param value_length Populated with the length of the value.
+ * @return Returns the value of the last record with the keyword, which is not NUL terminated,
+ * or NULL if there is no such record.
+ */
+static const char *pax_value(const char *data, size_t size, const char *keyword, unsigned int& value_length)
+{
+	size_t keyword_length = strlen(keyword);
+	const char *value = NULL;
+
+	size_t pos = 0;
+	while (pos < size) {
+		size_t record_length = 0, i = pos;
+		while (i < size && data[i] >= '0' && data[i] <= '9') {
+			record_length = (record_length * 10) + (data[i++] - '0');
+		}
+
+		// a malformed record leaves no way to find the next one
+		if (i >= size || data[i] != ' ' || record_length <= i - pos || record_length > size - pos || data[pos + record_length - 1] != '\n') {
+			break;
+		}
+
+		const char *key = data + i + 1;
+		size_t rest = (pos + record_length - 1) - (i + 1);
+
+		if (rest > keyword_length && !memcmp(key, keyword, keyword_length) && key[keyword_length] == '=') {
+			value = key + keyword_length + 1;
+			value_length = rest - keyword_length - 1;
+		}
+
+		pos += record_length;
+	}
+
+	return value;
 }
 
 
@@ -92,134 +508,885 @@ namespace tarfs {
 int TarFSFile::pread(void* buffer, size_t size, off_t off)
 {
 	// if offset is more than file size
-	if (off >= this->size()) {
+	if (off < 0 || off >= this->size()) {
+		return 0;
+	}
+
+	// never read past the end of the file
+	if (size > (size_t) (this->size() - off)) {
+		size = this->size() - off;
+	}
+
+	if (size == 0) {
 		return 0;
 	}
-	// if there's no buffer size or if size file is 0
-	if (size == 0 || this->size() == 0) {
+
+	uint8_t *out = (uint8_t *) buffer;
+	size_t block = _file_start_block + (off / 512);
+	size_t remaining = size;
+
+	// A short read goes entirely through the cache, so whatever of it is missing is fetched
+	// with one device request up front, rather than with one for each block.
+	size_t nr_blocks = _file_start_block + ((off + size + 511) / 512) - block;
+	if (nr_blocks > 1 && nr_blocks <= TARFS_CACHED_READ_BLOCKS + 2) {
+		_owner.cache().prefetch(block, nr_blocks);
+	}
+
+	// an unaligned head goes through the cache
+	unsigned int head_offset = off % 512;
+	if (head_offset || remaining < 512) {
+		size_t count = 512 - head_offset;
+		if (count > remaining) {
+			count = remaining;
+		}
+
+		_owner.cache().read(out, block, head_offset, count);
+
+		out += count;
+		remaining -= count;
+		block++;
+	}
+
+	// A short run of whole blocks is served from the cache.  A long one is read straight
+	// into the caller's buffer, except for the blocks that are cached already, such as those
+	// a batch or read-ahead has prefetched.
+	size_t whole_blocks = remaining / 512;
+	if (whole_blocks > TARFS_CACHED_READ_BLOCKS) {
+		size_t done = 0;
+
+		while (done < whole_blocks) {
+			done += _owner.cache().read_cached(out + (done * 512), block + done, whole_blocks - done);
+			if (done == whole_blocks) {
+				break;
+			}
+
+			// the block may have been cached since it was found missing, which is harmless
+			size_t run = _owner.cache().count_uncached(block + done, whole_blocks - done);
+			if (!run) {
+				run = 1;
+			}
+
+			_owner.block_device().read_blocks(out + (done * 512), block + done, run);
+			done += run;
+		}
+	} else {
+		for (size_t i = 0; i < whole_blocks; i++) {
+			_owner.cache().read(out + (i * 512), block + i, 0, 512);
+		}
+	}
+
+	out += whole_blocks * 512;
+	remaining -= whole_blocks * 512;
+	block += whole_blocks;
+
+	// and a partial tail goes through the cache too
+	if (remaining) {
+		_owner.cache().read(out, block, 0, remaining);
+	}
+
+	return size;
+}
+
+/**
+ * Reads the contents of the file into a list of buffers, from the specified file offset.
+ * Each buffer is filled in turn, as if they were one contiguous buffer.
+ * @param iov The buffers to read the data into.
+ * @param count The number of buffers.
+ * @param off The offset within the file.
+ * @return Returns the total number of bytes read into the buffers.
+ */
+int TarFSFile::preadv(const IOVector *iov, unsigned int count, off_t off)
+{
+	if (off < 0 || off >= this->size()) {
 		return 0;
 	}
 
+	size_t total = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		total += iov[i].length;
+	}
+
+	if (total > (size_t) (this->size() - off)) {
+		total = this->size() - off;
+	}
+
+	// Fetch the whole span with one device request up front, if it fits, so that each
+	// segment is then copied out of the cache.
+	size_t first_block = _file_start_block + (off / 512);
+	size_t nr_blocks = _file_start_block + ((off + total + 511) / 512) - first_block;
+	if (count > 1 && nr_blocks <= BLOCK_CACHE_MAX_PREFETCH) {
+		_owner.cache().prefetch(first_block, nr_blocks);
+	}
+
+	int done = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		int rc = pread(iov[i].base, iov[i].length, off + done);
+		done += rc;
+
+		if ((size_t) rc < iov[i].length) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * Maps the file, read-only, into a range of virtual memory.  Nothing is read until the
+ * pages are touched.
+ * @param vma The address space to map the file into.
+ * @param base The page aligned address to map the file at.
+ * @param length The length of the mapping.
+ * @param off The page aligned offset within the file to start the mapping at.
+ * @return Returns the mapping, or NULL if the arguments are not page aligned.
+ */
+TarFSMapping *TarFSFile::mmap(VMA& vma, virt_addr_t base, size_t length, off_t off)
+{
+	if ((base & 0xfff) || (off & 0xfff) || off < 0 || !length) {
+		return NULL;
+	}
+
+	return new TarFSMapping(_node, vma, base, length, off);
+}
+
+/**
+ * Returns the page cache page holding the given page of this file, reading it in if this is
+ * the first time it has been asked for.  The page is shared by every mapping of the file.
+ * @param index The index of the page within the file.
+ * @return Returns the page, or NULL if there was no memory for it.
+ */
+PageDescriptor *TarFSNode::get_page(unsigned int index)
+{
+	assert(index < ((_size + 0xfff) >> 12));
+
+	{
+		UniqueIRQLock l;
+
+		if (_pages[index]) {
+			return _pages[index];
+		}
+	}
+
+	PageDescriptor *pgd = sys.mm().pgalloc().alloc_pages(0);
+	if (!pgd) {
+		return NULL;
+	}
+
+	// A file's data is contiguous on the device, so the whole page is one request.  The part
+	// of the last page beyond the end of the file is zeroed.
+	uint8_t *data = (uint8_t *) sys.mm().pgalloc().pgd_to_kva(pgd);
+	size_t offset = (size_t) index << 12;
+	size_t valid = _size - offset < 0x1000 ? _size - offset : 0x1000;
+
+	((TarFS&) owner()).block_device().read_blocks(data, _data_block + (offset / 512), (valid + 511) / 512);
+	memset(data + valid, 0, 0x1000 - valid);
+
+	UniqueIRQLock l;
+
+	// Another fault may have read the same page in the meantime, in which case theirs is used.
+	if (_pages[index]) {
+		sys.mm().pgalloc().free_pages(pgd, 0);
+		return _pages[index];
+	}
+
+	_pages[index] = pgd;
+
+	return pgd;
+}
+
+/**
+ * Gives every page in this file's page cache back to the page allocator.
+ */
+void TarFSNode::release_pages()
+{
+	if (!_pages) {
+		return;
+	}
+
+	unsigned int nr_pages = (_size + 0xfff) >> 12;
+	for (unsigned int i = 0; i < nr_pages; i++) {
+		if (_pages[i]) {
+			sys.mm().pgalloc().free_pages(_pages[i], 0);
+		}
+	}
+
+	delete[] _pages;
+	_pages = NULL;
+}
+
+/**
+ * Constructs a mapping of a file, and sets up the file's page cache if this is its first.
+ */
+TarFSMapping::TarFSMapping(TarFSNode& node, VMA& vma, virt_addr_t base, size_t length, off_t offset)
+	: _node(node), _vma(vma), _base(base), _length(length), _offset(offset)
+{
+	UniqueIRQLock l;
+
+	if (!node._pages) {
+		unsigned int nr_pages = (node._size + 0xfff) >> 12;
+		node._pages = new PageDescriptor *[nr_pages];
+
+		for (unsigned int i = 0; i < nr_pages; i++) {
+			node._pages[i] = NULL;
+		}
+	}
+
+	node._nr_mappings++;
+}
 
-	// no. of bytes to be read including the offset
-	int offset_size = off % 512;
-	// the offset but in blocks
-	int offset_block = off / 512;
-	// bytes to be read
-	int read_bytes = size + offset_size;
-	int read_blocks;
-	// the starting point of the file to read from
-	int starting_block = _file_start_block + offset_block;
+/**
+ * Destroys a mapping.  Once the last mapping of a file has gone, its page cache is released.
+ * The caller must already have removed the mapping's pages from the address space.
+ */
+TarFSMapping::~TarFSMapping()
+{
+	bool last;
+
+	{
+		UniqueIRQLock l;
+		last = --_node._nr_mappings == 0;
+	}
+
+	if (last) {
+		_node.release_pages();
+	}
+}
+
+/**
+ * Handles a page fault within the mapping, by mapping in the page cache page that holds the
+ * faulting address.
+ * @param address The faulting virtual address.
+ * @return Returns true if the page was mapped, or false if the address is outside the file
+ * or there was no memory for the page.
+ */
+bool TarFSMapping::fault(virt_addr_t address)
+{
+	if (address < _base || address >= _base + _length) {
+		return false;
+	}
+
+	size_t offset = _offset + ((address - _base) & ~(virt_addr_t) 0xfff);
+	if (offset >= _node._size) {
+		return false;
+	}
+
+	PageDescriptor *pgd = _node.get_page(offset >> 12);
+	if (!pgd) {
+		return false;
+	}
 
-	if(this->size() < (size+off)) {
-		read_bytes = this->size() - offset_block;
+	phys_addr_t pa = sys.mm().pgalloc().pgd_to_pfn(pgd) << 12;
+	_vma.insert_mapping(_base + (offset - _offset), pa, (MappingFlags::MappingFlags) (MappingFlags::Present | MappingFlags::User));
+
+	return true;
+}
+
+/**
+ * Creates a node for the given path, and adds it to its parent and the path index.
+ * @param owner The file-system the node belongs to.
+ * @param index The path index of the file-system.
+ * @param parent The directory the node lives in.
+ * @param path The full path of the node.
+ * @param length The length of the path.
+ * @return Returns the new node, or NULL if there was no memory for it.
+ */
+static TarFSNode *create_node(TarFS& owner, PathIndex& index, TarFSNode *parent, const char *path, unsigned int length)
+{
+	// The name of the node is the last component of its path.
+	unsigned int start = length;
+	while (start > 0 && path[start - 1] != '/') {
+		start--;
 	}
 
-	// calculate the blocks to be read
-	if(read_bytes % 512 == 0) {
-		read_blocks = read_bytes/512;
-	} else { // round it up if there's extra space
-		read_blocks = (read_bytes/512) + 1;
+	char name[101];
+	unsigned int name_length = length - start;
+	if (name_length >= sizeof(name)) {
+		name_length = sizeof(name) - 1;
 	}
 
-	// put into temp buffer
-	uint8_t *temp_buffer = new uint8_t[512 * read_blocks];
-	_owner.block_device().read_blocks(temp_buffer, starting_block, read_blocks);
+	memcpy(name, path + start, name_length);
+	name[name_length] = 0;
 
-	// then transfer into the given buffer
-	for (int byte = 0; byte < (read_bytes-offset_size); byte++ ) {
-		*((char *) buffer + byte) = temp_buffer[byte + offset_size];
+	void *storage = tarfs_node_cache.alloc();
+	if (!storage) {
+		return NULL;
 	}
 
-	delete temp_buffer;
-	return (read_bytes - offset_size);
+	TarFSNode *node = new (storage) TarFSNode(parent, name, owner);
+	index.insert(node, path, length);
+	parent->add_child(node->name(), node);
 
+	return node;
 }
 
 /**
- * Reads all the file headers in the TAR file, and builds an in-memory
- * representation.
- * @return Returns the root TarFSNode that corresponds to the TAR file structure.
+ * Destroys a node and everything below it, giving the nodes back to the node cache.
+ */
+static void destroy_tree(TarFSNode *node)
+{
+	TarFSNode *child = node->first_child();
+	while (child) {
+		TarFSNode *next = child->next_sibling();
+		destroy_tree(child);
+		child = next;
+	}
+
+	node->~TarFSNode();
+	tarfs_node_cache.free(node);
+}
+
+/**
+ * Creates the root node and the path index.  Unless the file-system is lazy, every header
+ * in the TAR file is then read, and an in-memory representation of the whole archive is
+ * built.  A lazy file-system instead reads headers on demand, as lookups need them.
+ * @return Returns the root TarFSNode that corresponds to the TAR file structure, or NULL if
+ * there was not enough memory to build it.
  */
 TarFSNode* TarFS::build_tree()
 {
+	_index = new PathIndex();
+	_out_of_memory = false;
+
 	// Create the root node.
-	TarFSNode *root = new TarFSNode(NULL, "", *this); //declared in line 103 of tarfs.h. Says: no parent node, empty name string, *this is the owner??
-	TarFSNode *node = root; // this node
-	size_t nr_blocks = block_device().block_count();
-	unsigned int block_size = 512;
+	void *storage = tarfs_node_cache.alloc();
+	if (!storage) {
+		syslog.messagef(LogLevel::ERROR, "tarfs: out of memory creating the root node");
+		return abandon_tree();
+	}
+
+	_root_node = new (storage) TarFSNode(NULL, "", *this);
+	_index->insert(_root_node, "", 0);
+
+	// An index, if the archive has a good one, replaces the scan altogether.
+	if (load_index()) {
+		_scan_complete = true;
+		return _out_of_memory ? abandon_tree() : _root_node;
+	}
+
 	// Create header object
-	struct posix_header *header;
-	header = (struct posix_header *) new char[block_device().block_size()];
-	List <String> path_list;
-	String hdr_name;
-	unsigned int file_size;
-	String file_name;
-	String file_path;
+	_scan_header = (struct posix_header *) new char[block_device().block_size()];
+	_scan_block = 0;
+	_scan_complete = false;
+
+	if (!_lazy) {
+		scan_all();
+
+		if (_out_of_memory) {
+			return abandon_tree();
+		}
+	}
+
+	return _root_node;
+}
+
+/**
+ * Throws away a partly built tree, after running out of memory while building it.
+ * @return Returns NULL, for build_tree() to pass on.
+ */
+TarFSNode *TarFS::abandon_tree()
+{
+	if (_root_node) {
+		destroy_tree(_root_node);
+		_root_node = NULL;
+	}
 
-	// iterate through the block_device
-	for (size_t idx = 0; idx < nr_blocks; idx += file_size+1) {
+	delete _index;
+	_index = NULL;
 
+	delete[] (char *) _scan_header;
+	_scan_header = NULL;
+
+	return NULL;
+}
+
+/**
+ * Reads the next header in the TAR file, and adds the node it describes to the tree.  Every
+ * node is entered into a path index as it is created, so the parent directory of each header
+ * is found with one lookup, and directories that the archive never names explicitly are
+ * created on the way.  The caller must hold the scan lock.
+ * @return Returns false if the end of the archive has been reached, or true otherwise.
+ */
+bool TarFS::scan_next()
+{
+	if (_scan_complete) {
+		return false;
+	}
+
+	size_t nr_blocks = block_device().block_count();
+	posix_header *header = _scan_header;
+
+	// two zero blocks in a row mark the end of the archive
+	while (_scan_block < nr_blocks) {
 		// Read the a block into the header structure.
-		block_device().read_blocks(header, idx, 1);
+		_cache.read(header, _scan_block, 0, 512);
+
+		if (!is_zero_block((uint8_t *) header)) {
+			break;
+		}
 
-		// if zero block exists, it's the end of the archive
+		if (_scan_block + 1 >= nr_blocks) {
+			_scan_block = nr_blocks;
+			break;
+		}
+
+		_cache.read(header, _scan_block + 1, 0, 512);
 		if (is_zero_block((uint8_t *) header)) {
-            uint8_t *block_zero = new uint8_t[block_device().block_size()];
-            block_device().read_blocks(block_zero, idx + 1, 1);
-
-						// if this block is zero, delete and breka the loop
-            if (is_zero_block(block_zero)) {
-                delete(block_zero);
-                break;
-            }
-            delete(block_zero);
-        }
-
-				// split full path into list of components, and update current file_name
-				file_path = String(header->name);
-				List <String> split_path_parts = file_path.split('/', true);
-
-				// if it isn't empty, the current file name would be its last item of the list
-				if (!split_path_parts.empty()) {
-					file_name = split_path_parts.last();
-				}
-				else {
-					file_name = file_path;
+			_scan_block = nr_blocks;
+			break;
+		}
+
+		_scan_block++;
+	}
+
+	if (_scan_block >= nr_blocks) {
+		_scan_complete = true;
+
+		delete[] (char *) _scan_header;
+		_scan_header = NULL;
+
+		return false;
+	}
+
+	// A header that fails its checksum cannot be trusted to say where the next one is, so
+	// the archive ends there.
+	uint64_t file_size;
+	if (!header_checksum_ok(header) || !header_number(header->size, sizeof(header->size), file_size)) {
+		syslog.messagef(LogLevel::WARNING, "tarfs: corrupt header at block %lu, ignoring the rest of the archive", (unsigned long) _scan_block);
+
+		_scan_block = nr_blocks;
+		return scan_next();
+	}
+
+	// Metadata headers describe the header that follows them, rather than being members.
+	switch (header->typeflag) {
+	case 'x':	// pax extended header
+	case 'L':	// GNU long name
+		read_extended_header(header->typeflag, file_size);
+
+		_scan_block += 1 + (file_size + 511) / 512;
+		return true;
+
+	case 'g':	// pax global header
+	case 'K':	// GNU long link name
+		_scan_block += 1 + (file_size + 511) / 512;
+		return true;
+	}
+
+	char path[256];
+	unsigned int length;
+
+	if (_next_path_length >= 0) {
+		memcpy(path, _next_path, _next_path_length);
+		length = _next_path_length;
+	} else {
+		length = header_path(header, path);
+	}
+
+	if (_has_next_size) {
+		file_size = _next_size;
+	}
+
+	_next_path_length = -1;
+	_has_next_size = false;
+
+	// node sizes are 32-bit, so larger members are skipped
+	if (length && file_size <= 0xffffffffull && !add_member(path, length, _scan_block, file_size)) {
+		syslog.messagef(LogLevel::ERROR, "tarfs: out of memory adding the member at block %lu", (unsigned long) _scan_block);
+
+		_out_of_memory = true;
+		_scan_block = nr_blocks;
+		return scan_next();
+	}
+
+	// skip over the header, and the data blocks that follow it
+	_scan_block += 1 + (file_size + 511) / 512;
+	return true;
+}
+
+/**
+ * Reads a pax extended header or a GNU long name, and keeps what it says about the path and
+ * size of the next member until that member's header is read.  A path too long for a node
+ * is kept as an empty one, so that the member is skipped.
+ * @param typeflag The type of the header.
+ * @param size The size of the header's data, which starts in the block after the header.
+ */
+void TarFS::read_extended_header(char typeflag, uint64_t size)
+{
+	size_t nr_blocks = block_device().block_count();
+	size_t first_block = _scan_block + 1;
+
+	// anything past the end of the device, or past the largest header, is not read
+	if (size > TARFS_MAX_EXTENDED_HEADER) {
+		size = TARFS_MAX_EXTENDED_HEADER;
+	}
+
+	if (first_block >= nr_blocks) {
+		return;
+	}
+
+	if (size > (nr_blocks - first_block) * 512) {
+		size = (nr_blocks - first_block) * 512;
+	}
+
+	char *data = new char[size];
+	for (size_t offset = 0; offset < size; offset += 512) {
+		_cache.read(data + offset, first_block + (offset / 512), 0, size - offset < 512 ? size - offset : 512);
+	}
+
+	const char *path = NULL;
+	unsigned int path_length = 0;
+
+	if (typeflag == 'L') {
+		// the long name is NUL terminated
+		path = data;
+		path_length = field_length(data, size);
+	} else {
+		path = pax_value(data, size, "path", path_length);
+
+		unsigned int size_length;
+		const char *size_value = pax_value(data, size, "size", size_length);
+
+		if (size_value) {
+			_next_size = 0;
+			_has_next_size = size_length > 0 && size_length <= 19;
+
+			for (unsigned int i = 0; i < size_length; i++) {
+				if (size_value[i] < '0' || size_value[i] > '9') {
+					_has_next_size = false;
+					break;
 				}
 
+				_next_size = (_next_size * 10) + (size_value[i] - '0');
+			}
+		}
+	}
+
+	if (path) {
+		if (path_length < sizeof(_next_path)) {
+			memcpy(_next_path, path, path_length);
+			_next_path_length = trim_path(_next_path, path_length);
+		} else {
+			syslog.messagef(LogLevel::WARNING, "tarfs: the path of the member after block %lu is too long, skipping it", (unsigned long) _scan_block);
+			_next_path_length = 0;
+		}
+	}
+
+	delete[] data;
+}
+
+/**
+ * Adds an archive member to the tree, creating any of its parent directories that do not
+ * exist yet.  Every node is entered into the path index as it is created, so the parent
+ * directory is found with one lookup.
+ *
+ * An archive may hold more than one member with the same path, when a file has been
+ * appended again, and the last one wins, as it does when tar extracts the archive.  The node
+ * takes on the later member's data, and keeps any children it already has.  A lazy
+ * file-system may hand out the earlier member before it has read the later one, and a file
+ * that is mapped by then keeps the earlier data, which its page cache already holds.
+ * @param path The full path of the member.
+ * @param length The length of the path.
+ * @param header_block The block holding the header of the member.
+ * @param size The size of the member, in bytes.
+ * @return Returns the node for the member, or NULL if there was no memory for it.
+ */
+TarFSNode *TarFS::add_member(const char *path, unsigned int length, unsigned int header_block, unsigned int size)
+{
+	// find the parent directory, creating any that are missing from the archive
+	unsigned int dir_length = length;
+	while (dir_length > 0 && path[dir_length - 1] != '/') {
+		dir_length--;
+	}
+
+	TarFSNode *parent = _root_node;
+	if (dir_length) {
+		parent = ensure_directory(_root_node, path, dir_length - 1);
+		if (!parent) {
+			return NULL;
+		}
+	}
+
+	// an explicit directory header may come after its contents have made it already
+	TarFSNode *node = _index->lookup(path, length);
+	if (!node) {
+		node = create_node(*this, *_index, parent, path, length);
+		if (!node) {
+			return NULL;
+		}
+	} else if (node->_has_block_offset) {
+		syslog.messagef(LogLevel::DEBUG, "tarfs: the member at block %u replaces an earlier one with the same path", header_block);
+	}
+
+	UniqueIRQLock l;
+
+	if (node->_pages) {
+		syslog.messagef(LogLevel::WARNING, "tarfs: not replacing a mapped file with the later member at block %u", header_block);
+		return node;
+	}
+
+	node->set_block_offset(header_block);
+	node->size(size);
+
+	return node;
+}
+
+/**
+ * Computes the FNV-1a hash of the index entries, for checking them against the trailer.
+ */
+static uint32_t index_checksum(const uint8_t *data, size_t length)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/**
+ * Builds the tree from the index at the end of the archive, if it has one, without reading
+ * any headers.  Nothing is added to the tree unless the whole index is valid.
+ * @return Returns true if the tree was built from the index, or false if the archive has no
+ * usable index and must be scanned.
+ */
+bool TarFS::load_index()
+{
+	size_t nr_blocks = block_device().block_count();
+	if (nr_blocks < 2) {
+		return false;
+	}
+
+	uint8_t *block = new uint8_t[block_device().block_size()];
+	block_device().read_blocks(block, nr_blocks - 1, 1);
+
+	index_trailer trailer;
+	memcpy(&trailer, block, sizeof(trailer));
+	delete[] block;
+
+	if (memcmp(trailer.magic, TARFS_INDEX_MAGIC, sizeof(trailer.magic)) || trailer.version != TARFS_INDEX_VERSION) {
+		return false;
+	}
+
+	// the index must sit between the end of the archive and the trailer
+	size_t index_blocks = (trailer.index_bytes + 511) / 512;
+	if (trailer.index_block >= nr_blocks - 1 || index_blocks > nr_blocks - 1 - trailer.index_block) {
+		syslog.messagef(LogLevel::WARNING, "tarfs: index trailer is out of range, scanning headers");
+		return false;
+	}
+
+	uint8_t *entries = new uint8_t[index_blocks * 512];
+	block_device().read_blocks(entries, trailer.index_block, index_blocks);
+
+	if (index_checksum(entries, trailer.index_bytes) != trailer.checksum) {
+		syslog.messagef(LogLevel::WARNING, "tarfs: index checksum does not match, scanning headers");
+		delete[] entries;
+		return false;
+	}
+
+	// check every entry before trusting any of them
+	bool valid = true;
+	size_t offset = 0;
+	for (unsigned int i = 0; valid && i < trailer.nr_entries; i++) {
+		index_entry entry;
+		if (offset + sizeof(entry) > trailer.index_bytes) {
+			valid = false;
+			break;
+		}
+
+		memcpy(&entry, entries + offset, sizeof(entry));
+		offset += sizeof(entry) + entry.path_length;
+
+		valid = entry.path_length && entry.path_length < 256 && offset <= trailer.index_bytes &&
+			entry.header_block < trailer.index_block &&
+			(size_t) entry.data_block + ((entry.size + 511) / 512) <= trailer.index_block;
+	}
+
+	if (!valid || offset != trailer.index_bytes) {
+		syslog.messagef(LogLevel::WARNING, "tarfs: index entries are malformed, scanning headers");
+		delete[] entries;
+		return false;
+	}
+
+	offset = 0;
+	for (unsigned int i = 0; i < trailer.nr_entries; i++) {
+		index_entry entry;
+		memcpy(&entry, entries + offset, sizeof(entry));
+		offset += sizeof(entry);
+
+		TarFSNode *node = add_member((const char *) entries + offset, entry.path_length, entry.header_block, entry.size);
+		if (!node) {
+			syslog.messagef(LogLevel::ERROR, "tarfs: out of memory building the tree from the index");
+
+			_out_of_memory = true;
+			break;
+		}
+
+		node->_data_block = entry.data_block;
+
+		offset += entry.path_length;
+	}
+
+	delete[] entries;
+	return true;
+}
+
+/**
+ * Reads every header that has not been read yet, completing the tree.
+ */
+void TarFS::scan_all()
+{
+	UniqueLock<Mutex> l(_scan_lock);
+	while (scan_next());
+}
+
+/**
+ * Sorts a batch of read requests into the order their data sits on the device.
+ * @param count The number of requests.
+ * @param keys The first block each request reads.
+ * @param order The indices of the requests, which are sorted by their keys.
+ */
+static void sort_requests(unsigned int count, const size_t *keys, unsigned int *order)
+{
+	// An insertion sort, on the request order rather than the requests themselves, is
+	// plenty: requests for the files of one directory usually arrive nearly sorted already.
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int current = order[i];
+		unsigned int j = i;
+
+		while (j > 0 && keys[order[j - 1]] > keys[current]) {
+			order[j] = order[j - 1];
+			j--;
+		}
+
+		order[j] = current;
+	}
+}
 
-				// check if the file is on lower level than the current file
-				if (split_path_parts.count() > 1) {
-					String dir = split_path_parts.at(split_path_parts.count() - 2);
-					String node_name = (String) node->name();
+/**
+ * Performs a batch of reads, from any number of files in this file-system.  The requests are
+ * served in the order their data sits on the device, and the blocks of requests that sit
+ * next to each other are fetched into the cache together, so that reading many small files
+ * takes a few large device requests rather than one per file.
+ * @param requests The reads to perform, each of which is given its result.
+ * @param count The number of requests.
+ */
+void TarFS::read_batch(TarFSReadRequest *requests, unsigned int count)
+{
+	size_t *first = new size_t[count];
+	size_t *end = new size_t[count];
+	unsigned int *order = new unsigned int[count];
+
+	// work out the range of blocks each request needs
+	for (unsigned int i = 0; i < count; i++) {
+		TarFSNode *node = (TarFSNode *) requests[i].node;
+		order[i] = i;
+
+		if (!node || !node->_has_block_offset || requests[i].offset < 0 || (size_t) requests[i].offset >= node->_size) {
+			first[i] = end[i] = 0;
+			continue;
+		}
+
+		size_t size = requests[i].size;
+		if (size > (size_t) (node->_size - requests[i].offset)) {
+			size = node->_size - requests[i].offset;
+		}
+
+		first[i] = node->_data_block + (requests[i].offset / 512);
+		end[i] = node->_data_block + ((requests[i].offset + size + 511) / 512);
+	}
+
+	sort_requests(count, first, order);
+
+	size_t fetched_end = 0;
+	for (unsigned int k = 0; k < count; k++) {
+		TarFSReadRequest& request = requests[order[k]];
+		TarFSNode *node = (TarFSNode *) request.node;
 
-					while (infos::util::strncmp(node_name.c_str(), dir.c_str(), node_name.length()) && (node_name.length() != dir.length())) {
-							node = (TarFSNode *) node->parent(); //convert to TarFSNode!
-							node_name = (String) node->name();
-					}
-				}// if the file is on the same level as current file
-				else  if (split_path_parts.count() == 1) {
-					node = root;
+		if (!node || !node->_has_block_offset) {
+			request.result = -1;
+			continue;
+		}
+
+		// When a request reaches past what has been fetched, fetch the run of nearby
+		// requests that starts with it, as far as one prefetch can go.
+		if (end[order[k]] > fetched_end) {
+			size_t start = first[order[k]] > fetched_end ? first[order[k]] : fetched_end;
+			size_t run_end = end[order[k]];
+
+			for (unsigned int j = k + 1; j < count && first[order[j]] <= run_end + TARFS_BATCH_MAX_GAP && run_end - start < BLOCK_CACHE_MAX_PREFETCH; j++) {
+				if (end[order[j]] > run_end) {
+					run_end = end[order[j]];
 				}
+			}
+
+			if (run_end - start > BLOCK_CACHE_MAX_PREFETCH) {
+				run_end = start + BLOCK_CACHE_MAX_PREFETCH;
+			}
 
-				// update the size of the file if there's extra space
-				file_size = octal2ui(header->size);
-				file_size = (file_size % block_size) ? (file_size/ block_size + 1) : file_size / block_size;
+			_cache.prefetch(start, run_end - start);
+			fetched_end = run_end;
+		}
 
-				// Add child
-			 TarFSNode *current_node = new TarFSNode(node, file_name, *this);
-			 current_node->set_block_offset(idx);
-			 current_node->size(file_size);
-			 node->add_child(file_name, current_node);
+		TarFSFile file(*this, *node);
+		request.result = file.pread(request.buffer, request.size, request.offset);
+	}
+
+	delete[] order;
+	delete[] end;
+	delete[] first;
+}
+
+/**
+ * Finds the node at the path formed by joining a directory path and a name.  On a lazy
+ * file-system, headers are read until that node appears, or the archive runs out.
+ * @param dir The path of the directory, which may be empty for the root.
+ * @param dir_length The length of the directory path.
+ * @param name The name of the entry within the directory.
+ * @param name_length The length of the name.
+ * @return Returns the node, or NULL if the archive has no such path.
+ */
+TarFSNode *TarFS::find_node(const char *dir, unsigned int dir_length, const char *name, unsigned int name_length)
+{
+	// A scan on another thread may be growing the index, so even the lookup is locked.
+	UniqueLock<Mutex> l(_scan_lock);
+
+	do {
+		TarFSNode *node = _index->lookup(dir, dir_length, name, name_length);
+		if (node) {
+			return node;
+		}
+	} while (scan_next());
+
+	return NULL;
+}
+
+/**
+ * Finds the directory at the given path, creating it (and any of its missing ancestors) if
+ * it does not exist.
+ * @param root The root node of the file-system.
+ * @param path The full path of the directory.
+ * @param length The length of the path.
+ * @return Returns the directory node, or NULL if there was no memory for it.
+ */
+TarFSNode *TarFS::ensure_directory(TarFSNode *root, const char *path, unsigned int length)
+{
+	TarFSNode *node = _index->lookup(path, length);
+	if (node) {
+		return node;
+	}
 
-			 if (file_path.c_str()[file_path.length() - 1] == '/') {
-					 // increment the node if the last item in the path is '/'
-					 node = current_node;
-			 }
+	unsigned int dir_length = length;
+	while (dir_length > 0 && path[dir_length - 1] != '/') {
+		dir_length--;
+	}
 
+	TarFSNode *parent = dir_length ? ensure_directory(root, path, dir_length - 1) : root;
+	if (!parent) {
+		return NULL;
 	}
-	return root;
+
+	return create_node(*this, *_index, parent, path, length);
 }
 
 /**
@@ -227,14 +1394,46 @@ TarFSNode* TarFS::build_tree()
  */
 unsigned int TarFSFile::size() const
 {
-	return octal2ui(_hdr->size);
+	return _size;
 }
 
 /* --- YOU DO NOT NEED TO CHANGE ANYTHING BELOW THIS LINE --- */
 
+TarFS::TarFS(BlockDevice& block_device, bool lazy, BlockDevice *owned_device)
+: BlockBasedFilesystem(block_device),
+_cache(block_device, TARFS_CACHE_BLOCKS),
+_owned_device(owned_device),
+_root_node(NULL),
+_index(NULL),
+_lazy(lazy),
+_scan_header(NULL),
+_scan_block(0),
+_scan_complete(false),
+_out_of_memory(false),
+_next_path_length(-1),
+_next_size(0),
+_has_next_size(false)
+{
+}
+
+TarFS::~TarFS()
+{
+	if (_root_node) {
+		destroy_tree(_root_node);
+	}
+
+	// give the slabs that held the nodes back, now that they are likely to be empty
+	tarfs_node_cache.reap();
+
+	delete _index;
+	delete[] (char *) _scan_header;
+	delete _owned_device;
+}
+
 /**
- * Mounts a TARFS filesystem, by pre-building the file system tree in memory.
- * @return Returns the root node of the TARFS filesystem.
+ * Mounts a TARFS filesystem, by pre-building the file system tree in memory.  A lazy
+ * file-system returns straight away, and builds the tree as it is used.
+ * @return Returns the root node of the TARFS filesystem, or NULL if the tree could not be built.
  */
 PFSNode *TarFS::mount()
 {
@@ -248,28 +1447,24 @@ PFSNode *TarFS::mount()
 }
 
 /**
- * Constructs a TarFS File object, given the owning file system and the block
+ * Constructs a TarFS File object, given the owning file system and the node of the file.
+ * The node already knows where the data starts and how big it is, so the header is not
+ * read again.
  */
-TarFSFile::TarFSFile(TarFS& owner, unsigned int file_header_block)
-: _hdr(NULL),
-_owner(owner),
-_file_start_block(file_header_block),
-_cur_pos(0)
+TarFSFile::TarFSFile(TarFS& owner, TarFSNode& node)
+: _owner(owner),
+_node(node),
+_file_start_block(node._data_block),
+_size(node._size),
+_cur_pos(0),
+_ra_next_pos(0),
+_ra_window(TARFS_READAHEAD_MIN),
+_ra_end_block(0)
 {
-	// Allocate storage for the header.
-	_hdr = (struct posix_header *) new char[_owner.block_device().block_size()]; //creates a header block of size 512bytes
-
-	// Read the header block into the header structure.
-	_owner.block_device().read_blocks(_hdr, _file_start_block, 1);
-
-	// Increment the starting block for file data.
-	_file_start_block++;
 }
 
 TarFSFile::~TarFSFile()
 {
-	// Delete the header structure that was allocated in the constructor.
-	delete _hdr;
 }
 
 /**
@@ -293,6 +1488,13 @@ int TarFSFile::read(void* buffer, size_t size)
 	// current position indicator, so just delegate actual processing to
 	// pread, and update internal state accordingly.
 
+	// A read that does not carry on from where the last one ended is a seek, which starts
+	// the read-ahead window again.
+	if (_cur_pos != _ra_next_pos) {
+		_ra_window = TARFS_READAHEAD_MIN;
+		_ra_end_block = 0;
+	}
+
 	// Perform the read from the current file position.
 	int rc = pread(buffer, size, _cur_pos);
 
@@ -300,11 +1502,49 @@ int TarFSFile::read(void* buffer, size_t size)
 	// The number of bytes actually read may be less than 'size', so it's important
 	// we only advance the current position by the actual number of bytes read.
 	_cur_pos += rc;
+	_ra_next_pos = _cur_pos;
+
+	// Large reads go straight to the device in one request anyway, and would not use the
+	// blocks read ahead into the cache.
+	if (rc > 0 && size <= TARFS_CACHED_READ_BLOCKS * 512) {
+		read_ahead();
+	}
 
 	// Return the number of bytes read.
 	return rc;
 }
 
+/**
+ * Keeps the blocks after the current file position in the cache, for a sequential reader.
+ * Once a reader gets within half a window of the end of what has been read ahead, the next
+ * window is fetched, and the window doubles.
+ */
+void TarFSFile::read_ahead()
+{
+	size_t next_block = _file_start_block + (_cur_pos / 512);
+	size_t last_block = _file_start_block + ((size() + 511) / 512);
+
+	if (next_block >= last_block || next_block + (_ra_window / 2) < _ra_end_block) {
+		return;
+	}
+
+	size_t start = _ra_end_block > next_block ? _ra_end_block : next_block;
+	size_t count = _ra_window;
+	if (count > last_block - start) {
+		count = last_block - start;
+	}
+
+	if (count) {
+		_owner.cache().prefetch(start, count);
+	}
+
+	_ra_end_block = start + count;
+
+	if (_ra_window < TARFS_READAHEAD_MAX) {
+		_ra_window *= 2;
+	}
+}
+
 /**
  * Moves the current file pointer, based on the input arguments.
  * @param offset The offset to move the file pointer either 'to' or 'by', depending
@@ -328,12 +1568,26 @@ void TarFSFile::seek(off_t offset, SeekType type)
 	}
 }
 
-TarFSNode::TarFSNode(TarFSNode *parent, const String& name, TarFS& owner) : PFSNode(parent, owner), _name(name), _size(0), _has_block_offset(false), _block_offset(0)
+TarFSNode::TarFSNode(TarFSNode *parent, const String& name, TarFS& owner)
+: PFSNode(parent, owner),
+_name(name),
+_size(0),
+_has_block_offset(false),
+_block_offset(0),
+_data_block(0),
+_path(NULL),
+_path_length(0),
+_first_child(NULL),
+_next_sibling(NULL),
+_nr_children(0),
+_pages(NULL),
+_nr_mappings(0)
 {
 }
 
 TarFSNode::~TarFSNode()
 {
+	release_pages();
 }
 
 /**
@@ -347,8 +1601,8 @@ File* TarFSNode::open()
 		return NULL;
 	}
 
-	// Create a new file object, with a header from this node's block offset.
-	return new TarFSFile((TarFS&) owner(), _block_offset);
+	// Create a new file object, for the data that follows this node's header.
+	return new TarFSFile((TarFS&) owner(), *this);
 }
 
 /**
@@ -357,6 +1611,10 @@ File* TarFSNode::open()
  */
 Directory* TarFSNode::opendir()
 {
+	// A directory's entries can be anywhere in the archive, so they are only all known once
+	// every header has been read.
+	((TarFS&) owner()).scan_all();
+
 	return new TarFSDirectory(*this);
 }
 
@@ -367,15 +1625,8 @@ Directory* TarFSNode::opendir()
  */
 PFSNode* TarFSNode::get_child(const String& name)
 {
-	TarFSNode *child;
-
-	// Try to find the given child node in the children map, and return
-	// NULL if it wasn't found.
-	if (!_children.try_get_value(name.get_hash(), child)) {
-		return NULL;
-	}
-
-	return child;
+	// Look the child up by its full path, which is this node's path and the name.
+	return ((TarFS&) owner()).find_node(_path, _path_length, name.c_str(), name.length());
 }
 
 /**
@@ -399,28 +1650,31 @@ void TarFSNode::set_block_offset(unsigned int offset)
 {
 	_has_block_offset = true;
 	_block_offset = offset;
+	_data_block = offset + 1;
 }
 
 /**
- * A helper routine that adds a child node to the internal children
- * map of this node.
- * @param name The name of the child node.
+ * A helper routine that adds a child node to the list of children of
+ * this node.  Children are found by path through the file-system's
+ * index, so the list does not need the name.
  * @param child The actual child node.
  */
-void TarFSNode::add_child(const String& name, TarFSNode *child)
+void TarFSNode::add_child(const String&, TarFSNode *child)
 {
-	_children.add(name.get_hash(), child);
+	child->_next_sibling = _first_child;
+	_first_child = child;
+	_nr_children++;
 }
 
 TarFSDirectory::TarFSDirectory(TarFSNode& node) : _entries(NULL), _nr_entries(0), _cur_entry(0)
 {
-	_nr_entries = node.children().count();
+	_nr_entries = node.nr_children();
 	_entries = new DirectoryEntry[_nr_entries];
 
 	int i = 0;
-	for (const auto& child : node.children()) {
-		_entries[i].name = child.value->name();
-		_entries[i++].size = child.value->size();
+	for (TarFSNode *child = node.first_child(); child; child = child->next_sibling()) {
+		_entries[i].name = child->name();
+		_entries[i++].size = child->size();
 	}
 }
 
@@ -444,10 +1698,41 @@ void TarFSDirectory::close()
 
 }
 
+/**
+ * Creates a file-system for the archive on a device.  A gzip compressed archive is read
+ * through a device that inflates it, which belongs to the file-system, and is deleted along
+ * with it, whether that is after an unmount or after a failed mount.  Making that device
+ * inflates the whole archive once, so a lazy mount of a compressed archive still pays for a
+ * pass over all of its data, if not for building the tree.
+ * @param device The device holding the archive.
+ * @param lazy Whether the file-system reads headers on demand.
+ * @return Returns the file-system.
+ */
+static TarFS *create_archive_fs(BlockDevice& device, bool lazy)
+{
+	if (GzipBlockDevice::is_gzip(device)) {
+		GzipBlockDevice *inflated = new GzipBlockDevice(device);
+		if (inflated->valid()) {
+			return new TarFS(*inflated, lazy, inflated);
+		}
+
+		delete inflated;
+	}
+
+	return new TarFS(device, lazy);
+}
+
 static Filesystem *tarfs_create(VirtualFilesystem& vfs, Device *dev)
 {
 	if (!dev->device_class().is(BlockDevice::BlockDeviceClass)) return NULL;
-	return new TarFS((BlockDevice &) * dev);
+	return create_archive_fs((BlockDevice &) * dev, false);
+}
+
+static Filesystem *lazytarfs_create(VirtualFilesystem& vfs, Device *dev)
+{
+	if (!dev->device_class().is(BlockDevice::BlockDeviceClass)) return NULL;
+	return create_archive_fs((BlockDevice &) * dev, true);
 }
 
 RegisterFilesystem(tarfs, tarfs_create);
+RegisterFilesystem(lazytarfs, lazytarfs_create);
@@ -0,0 +1,230 @@
+/*
+ * TAR File-system Driver
+ */
+#pragma once
+
+#include <infos/fs/filesystem.h>
+#include <infos/fs/file.h>
+#include <infos/fs/directory.h>
+#include <infos/drivers/block/block-device.h>
+#include <infos/util/string.h>
+#include <infos/mm/vma.h>
+#include <infos/mm/page-allocator.h>
+#include <infos/locking/mutex.h>
+#include "block-cache.h"
+
+namespace tarfs
+{
+	struct posix_header;
+	class PathIndex;
+}
+
+namespace infos
+{
+	namespace fs
+	{
+		class TarFS;
+		class TarFSFile;
+
+		/**
+		 * One segment of a vectored read.
+		 */
+		struct IOVector
+		{
+			void *base;
+			size_t length;
+		};
+
+		/**
+		 * One read in a batch submitted to TarFS::read_batch().
+		 */
+		struct TarFSReadRequest
+		{
+			PFSNode *node;		// the file to read from
+			void *buffer;
+			size_t size;
+			off_t offset;		// within the file
+			int result;		// filled in with the number of bytes read, or -1 if the node is not a file
+		};
+
+		class TarFSNode : public PFSNode
+		{
+			friend class TarFS;
+			friend class TarFSFile;
+			friend class TarFSMapping;
+			friend class tarfs::PathIndex;
+
+		public:
+			TarFSNode(TarFSNode *parent, const util::String& name, TarFS& owner);
+			virtual ~TarFSNode();
+
+			File* open() override;
+			Directory* opendir() override;
+
+			PFSNode* mkdir(const util::String& name) override;
+			PFSNode* get_child(const util::String& name) override;
+
+			void add_child(const util::String& name, TarFSNode *child);
+			void set_block_offset(unsigned int offset);
+
+			const util::String& name() const { return _name; }
+
+			unsigned int size() const { return _size; }
+			void size(unsigned int size) { _size = size; }
+
+			/**
+			 * The full path of this node within the archive, without a leading or trailing '/'.
+			 * This points into the file-system's path index, so it is not NUL terminated.
+			 */
+			const char *path() const { return _path; }
+			unsigned int path_length() const { return _path_length; }
+
+			TarFSNode *first_child() const { return _first_child; }
+			TarFSNode *next_sibling() const { return _next_sibling; }
+			unsigned int nr_children() const { return _nr_children; }
+
+		private:
+			util::String _name;
+			unsigned int _size;
+			bool _has_block_offset;
+			unsigned int _block_offset;
+			unsigned int _data_block;
+
+			const char *_path;
+			unsigned int _path_length;
+
+			TarFSNode *_first_child, *_next_sibling;
+			unsigned int _nr_children;
+
+			// the page cache of a mapped file, shared by every mapping of it
+			mm::PageDescriptor **_pages;
+			unsigned int _nr_mappings;
+
+			mm::PageDescriptor *get_page(unsigned int index);
+			void release_pages();
+		};
+
+		/**
+		 * A read-only mapping of a TarFS file into a virtual address range.  Pages are not
+		 * mapped until they are first touched, when the page fault handler calls fault().
+		 */
+		class TarFSMapping
+		{
+		public:
+			TarFSMapping(TarFSNode& node, mm::VMA& vma, virt_addr_t base, size_t length, off_t offset);
+			~TarFSMapping();
+
+			bool fault(virt_addr_t address);
+
+			virt_addr_t base() const { return _base; }
+			size_t length() const { return _length; }
+
+		private:
+			TarFSNode& _node;
+			mm::VMA& _vma;
+			virt_addr_t _base;
+			size_t _length;
+			off_t _offset;		// the file offset mapped at the base, which is page aligned
+		};
+
+		class TarFSFile : public File
+		{
+			friend class TarFS;
+
+		public:
+			TarFSFile(TarFS& owner, TarFSNode& node);
+			virtual ~TarFSFile();
+
+			void close() override;
+			int read(void *buffer, size_t size) override;
+			int pread(void *buffer, size_t size, off_t off) override;
+			int preadv(const IOVector *iov, unsigned int count, off_t off);
+			TarFSMapping *mmap(mm::VMA& vma, virt_addr_t base, size_t length, off_t off);
+			void seek(off_t offset, SeekType type) override;
+
+			unsigned int size() const;
+
+		private:
+			TarFS& _owner;
+			TarFSNode& _node;
+			unsigned int _file_start_block;
+			unsigned int _size;
+			off_t _cur_pos;
+
+			// sequential read-ahead state
+			off_t _ra_next_pos;		// where the next read starts, if it is sequential
+			unsigned int _ra_window;	// the number of blocks to read ahead next time
+			size_t _ra_end_block;		// the block after the last one read ahead
+
+			void read_ahead();
+		};
+
+		class TarFSDirectory : public Directory
+		{
+		public:
+			TarFSDirectory(TarFSNode& node);
+			virtual ~TarFSDirectory();
+
+			bool read_entry(DirectoryEntry& entry) override;
+			void close() override;
+
+		private:
+			DirectoryEntry *_entries;
+			unsigned int _nr_entries, _cur_entry;
+		};
+
+		class TarFS : public BlockBasedFilesystem
+		{
+			friend class TarFSNode;
+
+		public:
+			TarFS(drivers::block::BlockDevice& block_device, bool lazy = false, drivers::block::BlockDevice *owned_device = NULL);
+			virtual ~TarFS();
+
+			PFSNode *mount() override;
+
+			BlockCache& cache() { return _cache; }
+
+			void read_batch(TarFSReadRequest *requests, unsigned int count);
+
+		private:
+			BlockCache _cache;
+			drivers::block::BlockDevice *_owned_device;	// made for this file-system, and deleted with it
+			TarFSNode *_root_node;
+			tarfs::PathIndex *_index;
+
+			// A lazy file-system reads headers as lookups need them, rather than at mount.
+			bool _lazy;
+			tarfs::posix_header *_scan_header;
+			size_t _scan_block;		// the block holding the next header to read
+			bool _scan_complete;
+			locking::Mutex _scan_lock;	// held while reading headers, or looking up a path they may add
+			bool _out_of_memory;		// a node could not be allocated while building the tree
+
+			// What a pax extended header or a GNU long name says about the next member.
+			char _next_path[256];
+			int _next_path_length;		// -1 if the next member uses the path in its own header
+			uint64_t _next_size;
+			bool _has_next_size;
+
+			TarFSNode *build_tree();
+			TarFSNode *abandon_tree();
+			bool load_index();
+			TarFSNode *add_member(const char *path, unsigned int length, unsigned int header_block, unsigned int size);
+			bool scan_next();
+			void read_extended_header(char typeflag, uint64_t size);
+			void scan_all();
+			TarFSNode *find_node(const char *dir, unsigned int dir_length, const char *name, unsigned int name_length);
+			TarFSNode *ensure_directory(TarFSNode *root, const char *path, unsigned int length);
+
+			static bool is_zero_block(const uint8_t *buffer)
+			{
+				for (unsigned int i = 0; i < 512; i++) {
+					if (buffer[i] != 0) return false;
+				}
+
+				return true;
+			}
+		};
+	}
+}
@@ -0,0 +1,637 @@
+/*
+ * Buddy Allocator Test Harness
+ *
+ * A host-side program that runs the buddy page allocator in "buddy.cpp" outside the kernel,
+ * against simulated physical memory.  The kernel headers it needs are replaced by the
+ * stand-ins under "tools/host".
+ *
+ * "check" runs a random trace of single, bulk and migrate-typed allocations, frees and range
+ * reservations, checking that no two allocations overlap, that every block is aligned to its
+ * order, and that the allocator's own invariants hold throughout.  It also checks that init()
+ * keeps its bookkeeping out of memory it was not given, and fails cleanly when it cannot.
+ * "bench" times allocations of each order, a mixed workload over simulated memories of 1 to
+ * 64 GiB, bulk against single allocations, and eager against lazy merging, and measures the
+ * fragmentation left with and without grouping by migrate type.  Memory is reserved without
+ * being committed, so only the pages the allocator touches are backed.
+ *
+ * Build with: c++ -O2 -I tools/host -o buddy-harness tools/buddy-harness.cpp
+ * Run as: buddy-harness check [pages] [iterations] [seed]
+ *         buddy-harness bench
+ * Set LAZY in the environment to test the lazy allocator instead.
+ */
+#include "../buddy.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <random>
+#include <vector>
+
+namespace infos
+{
+	namespace kernel
+	{
+		Kernel sys;
+		Log syslog, mm_log;
+	}
+}
+
+// what the trace knows about each page
+namespace PageState {
+	enum PageState {
+		FREE = 0,
+		ALLOCATED = 1,
+		RESERVED = 2,
+	};
+}
+
+struct Allocation
+{
+	uint64_t pfn;
+	int order;
+};
+
+static BuddyPageAllocator *create_allocator(uint64_t nr_pages, bool lazy)
+{
+	BuddyPageAllocator *buddy = lazy ? new LazyBuddyPageAllocator() : new BuddyPageAllocator();
+
+	// the whole of simulated memory is usable RAM
+	buddy->set_bookkeeping_range(0, nr_pages);
+	return buddy;
+}
+
+static BuddyPageAllocator *create_allocator(uint64_t nr_pages)
+{
+	return create_allocator(nr_pages, getenv("LAZY") != NULL);
+}
+
+/**
+ * Returns the highest order with a free block, or -1 if nothing is free.
+ */
+static int largest_free_order(const BuddyPageAllocator& buddy)
+{
+	for (int order = MAX_ORDER - 1; order >= 0; order--) {
+		if (buddy.order_stats(order).free_blocks) {
+			return order;
+		}
+	}
+
+	return -1;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+/**
+ * Records that a block has been handed out, and fails if any page of it already was.
+ */
+static bool mark_allocated(std::vector<uint8_t>& state, std::vector<Allocation>& held, PageDescriptor *pgd, int order)
+{
+	uint64_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+
+	if (pfn & ((1ull << order) - 1)) {
+		fprintf(stderr, "error: order %d block at pfn 0x%lx is misaligned\n", order, pfn);
+		return false;
+	}
+
+	for (uint64_t i = pfn; i < pfn + (1ull << order); i++) {
+		if (state[i] != PageState::FREE) {
+			fprintf(stderr, "error: order %d block at pfn 0x%lx overlaps pfn 0x%lx\n", order, pfn, i);
+			return false;
+		}
+
+		state[i] = PageState::ALLOCATED;
+	}
+
+	// write to the block, so an allocation that overlaps the bookkeeping shows up as corruption
+	memset(sys.mm().pgalloc().pgd_to_kva(pgd), 0xa5, 4096);
+
+	held.push_back({ pfn, order });
+	return true;
+}
+
+/**
+ * Checks that init() fails cleanly, rather than writing its bookkeeping somewhere it may not,
+ * when it has no usable range for it, the range is too small, or there are too many pages.
+ */
+static int check_init()
+{
+	struct {
+		const char *what;
+		uint64_t nr_pages, meta_pfn, meta_pages;
+	} cases[] = {
+		{ "no bookkeeping range", 4096, 0, 0 },
+		{ "a one-page bookkeeping range", 1ull << 20, 0, 1 },
+		{ "a bookkeeping range past the end", 4096, 4000, 200 },
+		{ "more pages than back-links can name", 1ull << 32, 0, 1ull << 20 },
+	};
+
+	for (const auto& c : cases) {
+		BuddyPageAllocator buddy;
+		buddy.set_bookkeeping_range(c.meta_pfn, c.meta_pages);
+
+		bool ok = sys.mm().pgalloc().init(buddy, c.nr_pages);
+		sys.mm().pgalloc().release();
+
+		if (ok) {
+			fprintf(stderr, "error: initialised with %s\n", c.what);
+			return 1;
+		}
+	}
+
+	printf("init: failed cleanly in all %zu bad configurations\n", ARRAY_SIZE(cases));
+	return 0;
+}
+
+static int check(uint64_t nr_pages, unsigned long iterations, unsigned long seed)
+{
+	// firmware occupies the top of memory, and the bookkeeping goes in the middle
+	const uint64_t nr_firmware = 64;
+
+	BuddyPageAllocator *buddy = create_allocator(nr_pages);
+	buddy->set_bookkeeping_range(nr_pages / 2, nr_pages - nr_firmware - (nr_pages / 2));
+
+	if (!sys.mm().pgalloc().init(*buddy, nr_pages)) {
+		fprintf(stderr, "error: unable to initialise %lu pages\n", nr_pages);
+		return 1;
+	}
+
+	if (!buddy->check_invariants()) {
+		fprintf(stderr, "error: invariants do not hold after initialisation\n");
+		return 1;
+	}
+
+	if (!buddy->reserve_range(nr_pages - nr_firmware, nr_firmware)) {
+		fprintf(stderr, "error: the firmware range is not free after initialisation\n");
+		return 1;
+	}
+
+	uint64_t nr_initially_free = buddy->nr_free_pages();
+	printf("%s: %lu of %lu pages free after initialisation\n", buddy->name(), nr_initially_free, nr_pages);
+
+	std::mt19937_64 rng(seed);
+	std::vector<uint8_t> state(nr_pages, PageState::FREE);
+	std::vector<Allocation> held;
+
+	for (uint64_t pfn = nr_pages - nr_firmware; pfn < nr_pages; pfn++) {
+		state[pfn] = PageState::RESERVED;
+	}
+
+	for (unsigned long i = 0; i < iterations; i++) {
+		unsigned int op = rng() % 10;
+
+		if (op < 5) {
+			// mostly single pages, as in the kernel
+			int order = (rng() % 100) < 70 ? 0 : rng() % 6;
+			MigrateType::MigrateType type = (MigrateType::MigrateType) (rng() % NR_MIGRATE_TYPES);
+
+			PageDescriptor *pgd = buddy->alloc_pages(order, type);
+			if (pgd && !mark_allocated(state, held, pgd, order)) {
+				return 1;
+			}
+		} else if (op < 9) {
+			if (held.empty()) continue;
+
+			size_t victim = rng() % held.size();
+			Allocation a = held[victim];
+			held[victim] = held.back();
+			held.pop_back();
+
+			for (uint64_t pfn = a.pfn; pfn < a.pfn + (1ull << a.order); pfn++) {
+				state[pfn] = PageState::FREE;
+			}
+
+			buddy->free_pages(sys.mm().pgalloc().pfn_to_pgd(a.pfn), a.order);
+		} else if (rng() % 2) {
+			PageDescriptor *pages[64];
+
+			int order = rng() % 3;
+			unsigned int nr = buddy->alloc_pages_bulk(order, 1 + (rng() % 64), pages);
+
+			for (unsigned int j = 0; j < nr; j++) {
+				if (!mark_allocated(state, held, pages[j], order)) {
+					return 1;
+				}
+			}
+		} else {
+			uint64_t start = rng() % nr_pages;
+			uint64_t count = 1 + (rng() % 300);
+			if (start + count > nr_pages) {
+				count = nr_pages - start;
+			}
+
+			if (buddy->reserve_range(start, count)) {
+				for (uint64_t pfn = start; pfn < start + count; pfn++) {
+					if (state[pfn] != PageState::FREE) {
+						fprintf(stderr, "error: reserved range at pfn 0x%lx includes allocated pfn 0x%lx\n", start, pfn);
+						return 1;
+					}
+
+					state[pfn] = PageState::RESERVED;
+				}
+			}
+		}
+
+		if (i % 5000 == 0 && !buddy->check_invariants()) {
+			fprintf(stderr, "error: invariants do not hold after %lu operations\n", i);
+			return 1;
+		}
+	}
+
+	for (const Allocation& a : held) {
+		buddy->free_pages(sys.mm().pgalloc().pfn_to_pgd(a.pfn), a.order);
+	}
+
+	uint64_t nr_reserved = 0;
+	for (uint8_t s : state) {
+		if (s == PageState::RESERVED) nr_reserved++;
+	}
+
+	// the firmware range was taken out before counting the free pages
+	nr_reserved -= nr_firmware;
+
+	if (!buddy->check_invariants()) {
+		fprintf(stderr, "error: invariants do not hold after freeing everything\n");
+		return 1;
+	}
+
+	// every page that was free at the start is either free again, or reserved
+	if (buddy->nr_free_pages() + nr_reserved != nr_initially_free) {
+		fprintf(stderr, "error: %lu pages free and %lu reserved, from %lu\n", buddy->nr_free_pages(), nr_reserved, nr_initially_free);
+		return 1;
+	}
+
+	printf("%s: %lu operations, %lu pages reserved, %lu pages free at the end\n", buddy->name(), iterations, nr_reserved, buddy->nr_free_pages());
+
+	sys.mm().pgalloc().release();
+	delete buddy;
+
+	return 0;
+}
+
+/**
+ * Times allocating and then freeing a batch of blocks of each order, from a 1 GiB memory.
+ */
+static void bench_orders()
+{
+	const uint64_t nr_pages = 1ull << 18;
+	const unsigned int batch = 64, rounds = 2000;
+
+	BuddyPageAllocator *buddy = create_allocator(nr_pages);
+	sys.mm().pgalloc().init(*buddy, nr_pages);
+
+	printf("order   alloc ns/op   free ns/op\n");
+
+	PageDescriptor *pages[batch];
+	for (int order = 0; order <= 10; order++) {
+		uint64_t alloc_ns = 0, free_ns = 0;
+
+		for (unsigned int r = 0; r < rounds; r++) {
+			uint64_t start = now_ns();
+			for (unsigned int i = 0; i < batch; i++) {
+				pages[i] = buddy->alloc_pages(order);
+			}
+
+			uint64_t middle = now_ns();
+			for (unsigned int i = 0; i < batch; i++) {
+				buddy->free_pages(pages[i], order);
+			}
+
+			free_ns += now_ns() - middle;
+			alloc_ns += middle - start;
+		}
+
+		printf("%5d   %11.1f   %10.1f\n", order, (double) alloc_ns / (batch * rounds), (double) free_ns / (batch * rounds));
+	}
+
+	sys.mm().pgalloc().release();
+	delete buddy;
+}
+
+/**
+ * Times initialisation, and a mix of allocations and frees that keeps a few thousand blocks
+ * held, over simulated memories of increasing size.
+ */
+static void bench_sizes()
+{
+	const unsigned long nr_ops = 2000000;
+
+	printf("memory   init ms   mixed Mops/s\n");
+
+	for (unsigned int gib = 1; gib <= 64; gib *= 4) {
+		uint64_t nr_pages = (uint64_t) gib << 18;
+		BuddyPageAllocator *buddy = create_allocator(nr_pages);
+
+		uint64_t start = now_ns();
+		if (!sys.mm().pgalloc().init(*buddy, nr_pages)) {
+			fprintf(stderr, "error: unable to initialise %u GiB\n", gib);
+			delete buddy;
+			continue;
+		}
+
+		uint64_t init_ns = now_ns() - start;
+
+		std::mt19937_64 rng(1);
+		std::vector<Allocation> held;
+
+		start = now_ns();
+		for (unsigned long i = 0; i < nr_ops; i++) {
+			if (held.size() < 4096 && (held.empty() || rng() % 2)) {
+				int order = (rng() % 100) < 80 ? 0 : rng() % 4;
+
+				PageDescriptor *pgd = buddy->alloc_pages(order);
+				if (pgd) {
+					held.push_back({ sys.mm().pgalloc().pgd_to_pfn(pgd), order });
+				}
+			} else {
+				size_t victim = rng() % held.size();
+				Allocation a = held[victim];
+				held[victim] = held.back();
+				held.pop_back();
+
+				buddy->free_pages(sys.mm().pgalloc().pfn_to_pgd(a.pfn), a.order);
+			}
+		}
+
+		uint64_t mixed_ns = now_ns() - start;
+
+		printf("%3u GiB   %7.2f   %12.2f\n", gib, init_ns / 1e6, (nr_ops * 1e3) / mixed_ns);
+
+		sys.mm().pgalloc().release();
+		delete buddy;
+	}
+}
+
+/**
+ * Times allocating and then freeing a batch of blocks with alloc_pages_bulk() and
+ * free_pages_bulk(), against a loop of single calls, from a 1 GiB memory.
+ */
+static void bench_bulk()
+{
+	const uint64_t nr_pages = 1ull << 18;
+	const unsigned int batch = 64, rounds = 4000;
+
+	BuddyPageAllocator *buddy = create_allocator(nr_pages);
+	sys.mm().pgalloc().init(*buddy, nr_pages);
+
+	printf("order   single ns/block   bulk ns/block\n");
+
+	PageDescriptor *pages[batch];
+	for (int order = 0; order <= 6; order += 2) {
+		uint64_t single_ns = 0, bulk_ns = 0;
+
+		for (unsigned int r = 0; r < rounds; r++) {
+			uint64_t start = now_ns();
+			for (unsigned int i = 0; i < batch; i++) {
+				pages[i] = buddy->alloc_pages(order);
+			}
+
+			for (unsigned int i = 0; i < batch; i++) {
+				buddy->free_pages(pages[i], order);
+			}
+
+			uint64_t middle = now_ns();
+			unsigned int nr = buddy->alloc_pages_bulk(order, batch, pages);
+			buddy->free_pages_bulk(order, nr, pages);
+
+			bulk_ns += now_ns() - middle;
+			single_ns += middle - start;
+		}
+
+		printf("%5d   %15.1f   %13.1f\n", order, (double) single_ns / (batch * rounds), (double) bulk_ns / (batch * rounds));
+	}
+
+	sys.mm().pgalloc().release();
+	delete buddy;
+}
+
+struct ChurnResult
+{
+	uint64_t ns;		// for the whole churn
+	uint64_t work;		// splits and merges
+	uint64_t timed_ns;	// for the steps asked to be timed
+	BuddyCoalesceStats coalesce;
+};
+
+/**
+ * Fills a 64 MiB memory until an allocation fails, then frees a random block and allocates
+ * one of a random order, over and over.  The same seed gives the same steps, so a second run
+ * can time just the steps in which the first had to merge all its deferred blocks.
+ * @param lazy TRUE to merge freed blocks lazily.
+ * @param timed The steps to time on their own, in order.
+ * @param coalescing Populated with the steps in which deferred blocks were merged.
+ */
+static ChurnResult churn(bool lazy, const std::vector<unsigned long>& timed, std::vector<unsigned long>& coalescing)
+{
+	const uint64_t nr_pages = 1ull << 14;
+	const unsigned long nr_ops = 2000000;
+
+	BuddyPageAllocator *buddy = create_allocator(nr_pages, lazy);
+	sys.mm().pgalloc().init(*buddy, nr_pages);
+
+	std::mt19937_64 rng(1);
+	std::vector<Allocation> held;
+
+	for (;;) {
+		int order = rng() % 4;
+		PageDescriptor *pgd = buddy->alloc_pages(order);
+		if (!pgd) {
+			break;
+		}
+
+		held.push_back({ sys.mm().pgalloc().pgd_to_pfn(pgd), order });
+	}
+
+	ChurnResult result = ChurnResult();
+	for (int order = 0; order < MAX_ORDER; order++) {
+		result.work -= buddy->order_stats(order).splits + buddy->order_stats(order).merges;
+	}
+
+	size_t next_timed = 0;
+	uint64_t start = now_ns();
+
+	for (unsigned long i = 0; i < nr_ops; i++) {
+		size_t victim = rng() % held.size();
+		Allocation a = held[victim];
+		held[victim] = held.back();
+		held.pop_back();
+
+		buddy->free_pages(sys.mm().pgalloc().pfn_to_pgd(a.pfn), a.order);
+
+		int order = rng() % 4;
+		uint64_t runs = buddy->coalesce_stats().runs;
+		PageDescriptor *pgd;
+
+		if (next_timed < timed.size() && timed[next_timed] == i) {
+			uint64_t step_start = now_ns();
+			pgd = buddy->alloc_pages(order);
+			result.timed_ns += now_ns() - step_start;
+			next_timed++;
+		} else {
+			pgd = buddy->alloc_pages(order);
+		}
+
+		if (buddy->coalesce_stats().runs != runs) {
+			coalescing.push_back(i);
+		}
+
+		if (pgd) {
+			held.push_back({ sys.mm().pgalloc().pgd_to_pfn(pgd), order });
+		}
+	}
+
+	result.ns = now_ns() - start;
+	for (int order = 0; order < MAX_ORDER; order++) {
+		result.work += buddy->order_stats(order).splits + buddy->order_stats(order).merges;
+	}
+
+	result.coalesce = buddy->coalesce_stats();
+
+	sys.mm().pgalloc().release();
+	delete buddy;
+
+	return result;
+}
+
+/**
+ * Churns a full memory with eager and with lazy merging, side by side.  The cost of lazy mode
+ * merging all its deferred blocks, when no free block is big enough, is given separately.
+ */
+static void bench_churn()
+{
+	const unsigned long nr_ops = 2000000;
+	std::vector<unsigned long> none, coalescing, ignored;
+
+	ChurnResult eager = churn(false, none, ignored);
+	ChurnResult lazy = churn(true, none, coalescing);
+	uint64_t coalesce_ns = churn(true, coalescing, ignored).timed_ns;
+
+	printf("mode         ns/op   splits+merges/op   coalesces   blocks visited   us/coalesce\n");
+	printf("%-10s   %5.1f   %16.3f\n", "buddy", (double) eager.ns / nr_ops, (double) eager.work / nr_ops);
+	printf("%-10s   %5.1f   %16.3f   %9lu   %14lu   %11.2f\n", "lazy-buddy", (double) lazy.ns / nr_ops,
+		(double) lazy.work / nr_ops, lazy.coalesce.runs, lazy.coalesce.visited,
+		lazy.coalesce.runs ? coalesce_ns / (lazy.coalesce.runs * 1e3) : 0.0);
+}
+
+/**
+ * Fills a memory with mostly movable allocations and some unmovable ones spread among them,
+ * then frees the movable ones, as reclaim or migration would, with grouping by migrate type
+ * on and off.  The largest free order, and the pageblocks left wholly free, show how far the
+ * unmovable pages were scattered.  Last, single pages are allocated and freed in batches of
+ * 64, and the per-CPU cache misses are given per 1000 of them.
+ */
+static void bench_grouping()
+{
+	struct {
+		const char *workload;
+		unsigned int unmovable_order, unmovable_every;
+	} workloads[] = {
+		{ "sparse", 2, 2000 },
+		{ "mixed", 0, 20 },
+	};
+
+	printf("memory   workload   grouping   largest order   free pageblocks   pcp misses/1000\n");
+
+	for (unsigned int mib = 128; mib <= 1024; mib *= 8) {
+		uint64_t nr_pages = (uint64_t) mib << 8;
+
+		for (const auto& w : workloads) {
+			for (int grouping = 1; grouping >= 0; grouping--) {
+				BuddyPageAllocator *buddy = create_allocator(nr_pages, false);
+				buddy->set_migrate_grouping(grouping);
+				sys.mm().pgalloc().init(*buddy, nr_pages);
+
+				std::mt19937_64 rng(1);
+				std::vector<Allocation> movable;
+
+				// leave a tenth free, as a running system would
+				for (uint64_t i = 0; buddy->nr_free_pages() > nr_pages / 10; i++) {
+					MigrateType::MigrateType type = MigrateType::MOVABLE;
+					int order = rng() % 3;
+
+					if (i % w.unmovable_every == 0) {
+						type = MigrateType::UNMOVABLE;
+						order = w.unmovable_order;
+					}
+
+					PageDescriptor *pgd = buddy->alloc_pages(order, type);
+					if (!pgd) {
+						break;
+					}
+
+					if (type == MigrateType::MOVABLE) {
+						movable.push_back({ sys.mm().pgalloc().pgd_to_pfn(pgd), order });
+					}
+				}
+
+				for (const Allocation& a : movable) {
+					buddy->free_pages(sys.mm().pgalloc().pfn_to_pgd(a.pfn), a.order);
+				}
+
+				uint64_t nr_pageblocks = 0;
+				for (int order = PAGEBLOCK_ORDER; order < MAX_ORDER; order++) {
+					nr_pageblocks += buddy->order_stats(order).free_blocks << (order - PAGEBLOCK_ORDER);
+				}
+
+				int largest_order = largest_free_order(*buddy);
+
+				uint64_t hits_before, misses_before, hits, misses;
+				buddy->pcp_stats(0, hits_before, misses_before);
+
+				PageDescriptor *pages[64];
+				for (unsigned int r = 0; r < 100; r++) {
+					for (unsigned int i = 0; i < 64; i++) {
+						pages[i] = buddy->alloc_pages(0);
+					}
+
+					for (unsigned int i = 0; i < 64; i++) {
+						buddy->free_pages(pages[i], 0);
+					}
+				}
+
+				buddy->pcp_stats(0, hits, misses);
+
+				printf("%4u MiB   %-8s   %-8s   %13d   %9lu/%-5lu   %15.1f\n", mib, w.workload, grouping ? "on" : "off",
+					largest_order, nr_pageblocks, nr_pages >> PAGEBLOCK_ORDER,
+					((misses - misses_before) * 1000.0) / ((hits - hits_before) + (misses - misses_before)));
+
+				sys.mm().pgalloc().release();
+				delete buddy;
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && strcmp(argv[1], "check") == 0) {
+		uint64_t nr_pages = argc > 2 ? strtoull(argv[2], NULL, 0) : 300001;
+		unsigned long iterations = argc > 3 ? strtoul(argv[3], NULL, 0) : 200000;
+		unsigned long seed = argc > 4 ? strtoul(argv[4], NULL, 0) : 42;
+
+		if (check_init()) {
+			return 1;
+		}
+
+		return check(nr_pages, iterations, seed);
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+		bench_orders();
+		bench_sizes();
+		bench_bulk();
+		bench_churn();
+		bench_grouping();
+		return 0;
+	}
+
+	fprintf(stderr, "usage: %s check [pages] [iterations] [seed]\n", argv[0]);
+	fprintf(stderr, "       %s bench\n", argv[0]);
+	return 1;
+}
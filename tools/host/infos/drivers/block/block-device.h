@@ -0,0 +1,87 @@
+/*
+ * Host stand-in for InfOS block devices: a device backed by a file image held in memory,
+ * which counts the requests made of it.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+
+namespace infos
+{
+	namespace drivers
+	{
+		class DeviceClass
+		{
+		public:
+			bool is(const DeviceClass& other) const { return this == &other; }
+		};
+
+		class Device
+		{
+		public:
+			virtual ~Device() { }
+			virtual const DeviceClass& device_class() const = 0;
+		};
+
+		namespace block
+		{
+			class BlockDevice : public Device
+			{
+			public:
+				static DeviceClass BlockDeviceClass;
+
+				BlockDevice() : nr_requests(0), nr_blocks_read(0) { }
+
+				const DeviceClass& device_class() const override { return BlockDeviceClass; }
+
+				virtual size_t block_size() const { return 512; }
+				virtual size_t block_count() const { return image.size() / 512; }
+
+				virtual bool read_blocks(void *buffer, size_t offset, size_t count)
+				{
+					if ((offset + count) * 512 > image.size()) {
+						fprintf(stderr, "block device: read of %zu blocks at %zu is past the end\n", count, offset);
+						abort();
+					}
+
+					nr_requests++;
+					nr_blocks_read += count;
+
+					memcpy(buffer, &image[offset * 512], count * 512);
+					return true;
+				}
+
+				virtual bool write_blocks(const void *, size_t, size_t) { return false; }
+
+				/**
+				 * Loads a file as the contents of the device, padded to whole blocks.
+				 */
+				bool load(const char *filename)
+				{
+					FILE *f = fopen(filename, "rb");
+					if (!f) {
+						return false;
+					}
+
+					uint8_t buffer[65536];
+					size_t n;
+					while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+						image.insert(image.end(), buffer, buffer + n);
+					}
+
+					fclose(f);
+
+					image.resize((image.size() + 511) & ~(size_t) 511, 0);
+					return true;
+				}
+
+				std::vector<uint8_t> image;
+				unsigned long nr_requests, nr_blocks_read;
+			};
+		}
+	}
+}
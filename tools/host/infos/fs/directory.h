@@ -0,0 +1,27 @@
+/*
+ * Host stand-in for InfOS directories
+ */
+#pragma once
+
+#include <infos/fs/filesystem.h>
+
+namespace infos
+{
+	namespace fs
+	{
+		struct DirectoryEntry
+		{
+			util::String name;
+			unsigned int size;
+		};
+
+		class Directory
+		{
+		public:
+			virtual ~Directory() { }
+
+			virtual bool read_entry(DirectoryEntry& entry) = 0;
+			virtual void close() = 0;
+		};
+	}
+}
@@ -0,0 +1,25 @@
+/*
+ * Host stand-in for InfOS files
+ */
+#pragma once
+
+#include <infos/fs/filesystem.h>
+
+namespace infos
+{
+	namespace fs
+	{
+		class File
+		{
+		public:
+			enum SeekType { SeekAbsolute, SeekRelative };
+
+			virtual ~File() { }
+
+			virtual void close() = 0;
+			virtual int read(void *buffer, size_t size) = 0;
+			virtual int pread(void *buffer, size_t size, off_t off) = 0;
+			virtual void seek(off_t offset, SeekType type) = 0;
+		};
+	}
+}
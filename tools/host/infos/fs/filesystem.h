@@ -0,0 +1,58 @@
+/*
+ * Host stand-in for the InfOS file-system interfaces
+ */
+#pragma once
+
+#include <infos/drivers/block/block-device.h>
+#include <infos/util/string.h>
+
+namespace infos
+{
+	namespace fs
+	{
+		class File;
+		class Directory;
+		class Filesystem;
+		class VirtualFilesystem;
+
+		class PFSNode
+		{
+		public:
+			PFSNode(PFSNode *parent, Filesystem& owner) : _parent(parent), _owner(owner) { }
+			virtual ~PFSNode() { }
+
+			virtual File *open() = 0;
+			virtual Directory *opendir() = 0;
+			virtual PFSNode *mkdir(const util::String& name) = 0;
+			virtual PFSNode *get_child(const util::String& name) = 0;
+
+			PFSNode *parent() const { return _parent; }
+			Filesystem& owner() const { return _owner; }
+
+		private:
+			PFSNode *_parent;
+			Filesystem& _owner;
+		};
+
+		class Filesystem
+		{
+		public:
+			virtual ~Filesystem() { }
+			virtual PFSNode *mount() = 0;
+		};
+
+		class BlockBasedFilesystem : public Filesystem
+		{
+		public:
+			BlockBasedFilesystem(drivers::block::BlockDevice& device) : _device(device) { }
+
+			drivers::block::BlockDevice& block_device() const { return _device; }
+
+		private:
+			drivers::block::BlockDevice& _device;
+		};
+	}
+}
+
+// harnesses construct the file-systems they test themselves, but the factories are kept referenced
+#define RegisterFilesystem(name, factory) [[maybe_unused]] static auto name##_factory = factory
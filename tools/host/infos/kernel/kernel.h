@@ -0,0 +1,29 @@
+/*
+ * Host stand-in for the InfOS kernel object
+ */
+#pragma once
+
+#include <infos/mm/mm.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class Kernel
+		{
+		public:
+			Kernel() : now(0) { }
+
+			mm::MemoryManager& mm() { return _mm; }
+
+			// the runtime clock, in nanoseconds, which a harness moves forward itself
+			uint64_t runtime() const { return now; }
+			uint64_t now;
+
+		private:
+			mm::MemoryManager _mm;
+		};
+
+		extern Kernel sys;
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * Host stand-in for the InfOS kernel log
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace LogLevel
+		{
+			enum LogLevel { DEBUG, INFO, WARNING, ERROR, FATAL };
+		}
+
+		/**
+		 * Writes warnings and errors to stderr, and everything else as well if HOST_VERBOSE
+		 * is set in the environment.
+		 */
+		class Log
+		{
+		public:
+			void messagef(LogLevel::LogLevel level, const char *format, ...) const __attribute__((format(printf, 3, 4)))
+			{
+				if (level < LogLevel::WARNING && !getenv("HOST_VERBOSE")) {
+					return;
+				}
+
+				va_list args;
+				va_start(args, format);
+				vfprintf(stderr, format, args);
+				va_end(args);
+
+				fputc('\n', stderr);
+			}
+
+			void message(LogLevel::LogLevel level, const char *text) const
+			{
+				messagef(level, "%s", text);
+			}
+		};
+
+		extern Log syslog, mm_log;
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * Host stand-in for InfOS scheduling entities
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		typedef uint64_t SchedulingEntityRuntime;
+
+		namespace SchedulingEntityState
+		{
+			enum SchedulingEntityState
+			{
+				STOPPED,
+				RUNNABLE,
+				RUNNING,
+				SLEEPING
+			};
+		}
+
+		/**
+		 * An entity whose CPU time, priority and state a harness sets directly.
+		 */
+		class SchedulingEntity
+		{
+		public:
+			SchedulingEntity() : runtime(0), prio(2), entity_state(SchedulingEntityState::RUNNABLE) { }
+
+			SchedulingEntityRuntime cpu_runtime() const { return runtime; }
+			int priority() const { return prio; }
+			SchedulingEntityState::SchedulingEntityState state() const { return entity_state; }
+
+			SchedulingEntityRuntime runtime;
+			int prio;
+			SchedulingEntityState::SchedulingEntityState entity_state;
+		};
+	}
+}
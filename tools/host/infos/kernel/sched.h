@@ -0,0 +1,32 @@
+/*
+ * Host stand-in for the InfOS scheduler interface
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <infos/kernel/sched-entity.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+namespace infos
+{
+	namespace kernel
+	{
+		class SchedulingAlgorithm
+		{
+		public:
+			virtual ~SchedulingAlgorithm() { }
+
+			virtual const char *name() const = 0;
+			virtual void add_to_runqueue(SchedulingEntity& entity) = 0;
+			virtual void remove_from_runqueue(SchedulingEntity& entity) = 0;
+			virtual SchedulingEntity *pick_next_entity() = 0;
+		};
+	}
+}
+
+// harnesses construct the algorithms they test themselves
+#define RegisterScheduler(algorithm)
@@ -0,0 +1,4 @@
+/*
+ * Host stand-in for InfOS threads, which the harnesses do not need
+ */
+#pragma once
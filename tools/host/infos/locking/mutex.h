@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for the InfOS mutex
+ */
+#pragma once
+
+#include <assert.h>
+
+namespace infos
+{
+	namespace locking
+	{
+		class Mutex
+		{
+		public:
+			Mutex() : _held(false) { }
+
+			void lock() { assert(!_held); _held = true; }
+			void unlock() { _held = false; }
+
+		private:
+			bool _held;
+		};
+	}
+}
@@ -0,0 +1,21 @@
+/*
+ * Host stand-in for the InfOS memory manager
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		class MemoryManager
+		{
+		public:
+			PageAllocator& pgalloc() { return _pgalloc; }
+
+		private:
+			PageAllocator _pgalloc;
+		};
+	}
+}
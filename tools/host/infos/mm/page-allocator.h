@@ -0,0 +1,120 @@
+/*
+ * Host stand-in for the InfOS page allocator
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef uintptr_t virt_addr_t;
+typedef uintptr_t phys_addr_t;
+
+namespace infos
+{
+	namespace mm
+	{
+		struct PageDescriptor
+		{
+			PageDescriptor *next_free;
+			uint64_t flags;
+		};
+
+		class PageAllocatorAlgorithm
+		{
+		public:
+			virtual ~PageAllocatorAlgorithm() { }
+
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *alloc_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual void dump_state() const = 0;
+			virtual const char *name() const = 0;
+		};
+
+		/**
+		 * Simulated physical memory: an array of page descriptors, and an address range that
+		 * stands for the pages they describe.  The range is reserved without being committed,
+		 * so tens of gigabytes can be simulated, and only the pages that are touched use memory.
+		 */
+		class PageAllocator
+		{
+		public:
+			PageAllocator() : _algorithm(NULL), _descriptors(NULL), _memory(NULL), _nr_pages(0), fail_after(-1) { }
+
+			/**
+			 * Sets up the simulated memory, and hands it all to an allocation algorithm.
+			 * @return Returns false if the memory could not be reserved, or the algorithm
+			 * failed to initialise.
+			 */
+			bool init(PageAllocatorAlgorithm& algorithm, uint64_t nr_pages)
+			{
+				size_t descriptors_size = nr_pages * sizeof(PageDescriptor);
+
+				void *descriptors = mmap(NULL, descriptors_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				void *memory = mmap(NULL, nr_pages << 12, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				if (descriptors == MAP_FAILED || memory == MAP_FAILED) {
+					return false;
+				}
+
+				_algorithm = &algorithm;
+				_descriptors = (PageDescriptor *) descriptors;
+				_memory = (uint8_t *) memory;
+				_nr_pages = nr_pages;
+
+				return algorithm.init(_descriptors, nr_pages);
+			}
+
+			/**
+			 * Gives the simulated memory back to the host.
+			 */
+			void release()
+			{
+				munmap(_descriptors, _nr_pages * sizeof(PageDescriptor));
+				munmap(_memory, _nr_pages << 12);
+
+				_algorithm = NULL;
+				_nr_pages = 0;
+			}
+
+			PageDescriptor *alloc_pages(int order)
+			{
+				if (fail_after == 0) {
+					return NULL;
+				}
+
+				if (fail_after > 0) {
+					fail_after--;
+				}
+
+				return _algorithm->alloc_pages(order);
+			}
+
+			void free_pages(PageDescriptor *pgd, int order) { _algorithm->free_pages(pgd, order); }
+
+			void *pgd_to_kva(const PageDescriptor *pgd) const { return _memory + ((uint64_t) (pgd - _descriptors) << 12); }
+			uint64_t pgd_to_pfn(const PageDescriptor *pgd) const { return pgd - _descriptors; }
+			PageDescriptor *pfn_to_pgd(uint64_t pfn) const { return _descriptors + pfn; }
+
+			PageDescriptor *descriptors() const { return _descriptors; }
+			uint64_t nr_pages() const { return _nr_pages; }
+
+		private:
+			PageAllocatorAlgorithm *_algorithm;
+			PageDescriptor *_descriptors;
+			uint8_t *_memory;
+			uint64_t _nr_pages;
+
+		public:
+			// the number of allocations that succeed before every later one fails, or -1
+			long fail_after;
+		};
+	}
+}
+
+// harnesses construct the algorithms they test themselves
+#define RegisterPageAllocator(algorithm)
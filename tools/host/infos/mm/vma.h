@@ -0,0 +1,26 @@
+/*
+ * Host stand-in for InfOS virtual memory areas, which just record their mappings
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+#include <map>
+
+namespace infos
+{
+	namespace mm
+	{
+		namespace MappingFlags
+		{
+			enum MappingFlags { None = 0, Present = 1, Writable = 2, User = 4 };
+		}
+
+		class VMA
+		{
+		public:
+			void insert_mapping(virt_addr_t va, phys_addr_t pa, MappingFlags::MappingFlags) { mappings[va] = pa; }
+
+			std::map<virt_addr_t, phys_addr_t> mappings;
+		};
+	}
+}
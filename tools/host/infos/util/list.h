@@ -0,0 +1,93 @@
+/*
+ * Host stand-in for the InfOS linked list: a singly linked list whose nodes are allocated one
+ * at a time, and which is searched from the head to remove an element.
+ */
+#pragma once
+
+#include <stddef.h>
+
+namespace infos
+{
+	namespace util
+	{
+		template<typename T>
+		class List
+		{
+		public:
+			List() : _head(NULL), _tail(NULL), _count(0) { }
+			~List() { while (_head) pop(); }
+
+			void append(T value)
+			{
+				Node *node = new Node;
+				node->value = value;
+				node->next = NULL;
+
+				if (_tail) {
+					_tail->next = node;
+				} else {
+					_head = node;
+				}
+
+				_tail = node;
+				_count++;
+			}
+
+			void enqueue(T value) { append(value); }
+
+			T pop()
+			{
+				Node *node = _head;
+				T value = node->value;
+
+				_head = node->next;
+				if (!_head) {
+					_tail = NULL;
+				}
+
+				delete node;
+				_count--;
+
+				return value;
+			}
+
+			void remove(T value)
+			{
+				Node **link = &_head;
+				Node *prev = NULL;
+
+				while (*link && (*link)->value != value) {
+					prev = *link;
+					link = &(*link)->next;
+				}
+
+				if (!*link) {
+					return;
+				}
+
+				Node *node = *link;
+				*link = node->next;
+				if (_tail == node) {
+					_tail = prev;
+				}
+
+				delete node;
+				_count--;
+			}
+
+			T first() const { return _head->value; }
+			unsigned int count() const { return _count; }
+			bool empty() const { return _count == 0; }
+
+		private:
+			struct Node
+			{
+				T value;
+				Node *next;
+			};
+
+			Node *_head, *_tail;
+			unsigned int _count;
+		};
+	}
+}
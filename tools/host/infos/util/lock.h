@@ -0,0 +1,32 @@
+/*
+ * Host stand-in for InfOS locks.  The harnesses are single threaded, so the IRQ lock does
+ * nothing, and UniqueLock just takes and releases the lock it is given.  It is the mutex
+ * stand-in that checks a lock is not taken twice.
+ */
+#pragma once
+
+#include <assert.h>
+
+namespace infos
+{
+	namespace util
+	{
+		class UniqueIRQLock
+		{
+		public:
+			UniqueIRQLock() { }
+			~UniqueIRQLock() { }
+		};
+
+		template<typename L>
+		class UniqueLock
+		{
+		public:
+			UniqueLock(L& lock) : _lock(lock) { _lock.lock(); }
+			~UniqueLock() { _lock.unlock(); }
+
+		private:
+			L& _lock;
+		};
+	}
+}
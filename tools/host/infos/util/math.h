@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for the InfOS maths helpers, which the harnesses do not need
+ */
+#pragma once
+
+namespace infos
+{
+	namespace util
+	{
+	}
+}
@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the InfOS printf helpers
+ */
+#pragma once
+
+#include <stdio.h>
+
+namespace infos
+{
+	namespace util
+	{
+	}
+}
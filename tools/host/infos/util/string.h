@@ -0,0 +1,33 @@
+/*
+ * Host stand-in for InfOS strings
+ */
+#pragma once
+
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <new>
+#include <string>
+
+#define __packed __attribute__((packed))
+
+namespace infos
+{
+	namespace util
+	{
+		class String
+		{
+		public:
+			String() { }
+			String(const char *str) : _str(str) { }
+
+			const char *c_str() const { return _str.c_str(); }
+			unsigned int length() const { return _str.size(); }
+
+			bool operator==(const String& other) const { return _str == other._str; }
+
+		private:
+			std::string _str;
+		};
+	}
+}
@@ -0,0 +1,1146 @@
+/*
+ * Scheduler Test Harness
+ *
+ * A host-side program that runs the scheduling algorithms outside the kernel.  The kernel
+ * headers they need are replaced by the stand-ins under "tools/host", where an entity's CPU
+ * time and priority, and the runtime clock, are set by the harness.
+ *
+ * "check" drives each algorithm with random adds, removes and picks, and checks what it picks
+ * against a reference model.  The SMP round-robin scheduler is run on four simulated CPUs.
+ *
+ * "bench" times the runqueue operations against a baseline round-robin scheduler built on
+ * the kernel's linked list, as the schedulers used to be, and simulates I/O-bound entities
+ * alongside CPU-bound ones to compare wakeup latencies.  It also measures how evenly CFS
+ * shares the CPU out by weight, and what a CFS pick costs, and how many deadlines periodic
+ * tasks miss under EDF and round-robin.
+ *
+ * Build with: c++ -O2 -I tools/host -o sched-harness tools/sched-harness.cpp
+ * Run as: sched-harness check
+ *         sched-harness bench
+ */
+// The SMP round-robin scheduler runs on four simulated CPUs, and the harness says which of
+// them is making each call.
+static unsigned int harness_cpu;
+#define NR_SCHED_CPUS		4
+#define SCHED_CURRENT_CPU()	harness_cpu
+
+#include "../sched-rq.cpp"
+#include "../sched-rr.cpp"
+#include "../sched-fifo.cpp"
+#include "../sched-mlfq.cpp"
+
+#include "../sched-cfs.cpp"
+#include "../sched-edf.cpp"
+
+#include <infos/kernel/kernel.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace infos
+{
+	namespace kernel
+	{
+		Kernel sys;
+		Log syslog, mm_log;
+	}
+}
+
+// The number of array allocations made so far, to check that empty schedulers make none.
+static unsigned long nr_array_allocations;
+
+void *operator new[](size_t size)
+{
+	nr_array_allocations++;
+	return malloc(size);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			exit(1); \
+		} \
+	} while (0)
+
+// Times in the simulations are in nanoseconds, and move on a millisecond at a time.
+#define MS	1000000ull
+
+/**
+ * The harness's view of the schedulers' private state.  Each scheduler that is checked this
+ * closely names this class as a friend.
+ */
+class SchedulerTestHook
+{
+public:
+	static unsigned int smp_queue_length(const SMPRoundRobinScheduler& smp, unsigned int cpu)
+	{
+		return smp._runqueues[cpu].entities.count();
+	}
+
+	/**
+	 * Returns the CPU whose runqueue an entity is on, or -1 if it is on none of them.
+	 */
+	static int smp_queue_of(const SMPRoundRobinScheduler& smp, SchedulingEntity *entity)
+	{
+		for (unsigned int cpu = 0; cpu < NR_SCHED_CPUS; cpu++) {
+			if (smp._runqueues[cpu].entities.contains(entity)) {
+				return cpu;
+			}
+		}
+
+		return -1;
+	}
+
+	static SchedulingEntity *smp_running(const SMPRoundRobinScheduler& smp, unsigned int cpu)
+	{
+		return smp._runqueues[cpu].running;
+	}
+
+	/**
+	 * Returns the MLFQ level an entity is on, or -1 if it is on none of them.
+	 */
+	static int mlfq_level_of(const MLFQScheduler& mlfq, SchedulingEntity *entity)
+	{
+		for (unsigned int level = 0; level < MLFQ_NR_LEVELS; level++) {
+			if (mlfq._levels[level].contains(entity)) {
+				return level;
+			}
+		}
+
+		return -1;
+	}
+
+	/**
+	 * Returns the virtual runtime CFS has for a runnable entity.
+	 */
+	static uint64_t cfs_vruntime_of(const CFSScheduler& cfs, SchedulingEntity *entity)
+	{
+		return cfs._nodes.find(entity)->vruntime;
+	}
+
+	static uint64_t cfs_min_vruntime(const CFSScheduler& cfs) { return cfs._min_vruntime; }
+	static unsigned int cfs_weight_of(SchedulingEntity& entity) { return CFSScheduler::weight_of(entity); }
+	static unsigned int cfs_nr_sleepers(const CFSScheduler& cfs) { return cfs._sleepers.count(); }
+
+	static void check_cfs_tree(const CFSScheduler& cfs)
+	{
+		unsigned int count = 0;
+
+		CHECK(!cfs._root || !cfs._root->red);
+		check_cfs_subtree(cfs._root, NULL, 0, ~0ull, count);
+
+		// every runnable entity is in the tree, apart from the running one
+		CHECK(count + (cfs._current ? 1 : 0) == cfs._nodes.count());
+
+		CFSScheduler::Node *leftmost = cfs._root;
+		while (leftmost && leftmost->left) leftmost = leftmost->left;
+		CHECK(leftmost == cfs._leftmost);
+	}
+
+	/**
+	 * Returns whether an entity has a reservation under EDF, and is throttled.
+	 */
+	static bool edf_throttled(const EDFScheduler& edf, SchedulingEntity *entity)
+	{
+		EDFScheduler::Reservation *res = edf._reservations.find(entity);
+		return res && edf._throttled.contains(res);
+	}
+
+	static uint64_t edf_total_bw(const EDFScheduler& edf) { return edf._total_bw; }
+	static uint64_t edf_deadline_of(const EDFScheduler& edf, SchedulingEntity *entity) { return edf._reservations.find(entity)->deadline_at; }
+
+	/**
+	 * Checks that the EDF ready heap is in deadline order, and that each reservation knows
+	 * where it is in it.
+	 */
+	static void check_edf_heap(const EDFScheduler& edf)
+	{
+		const EDFScheduler::ReservationHeap& ready = edf._ready;
+
+		for (unsigned int k = 0; k < ready._count; k++) {
+			CHECK(ready._items[k]->heap_index == k);
+			CHECK(k == 0 || ready._items[(k - 1) / 2]->deadline_at <= ready._items[k]->deadline_at);
+		}
+	}
+
+private:
+	/**
+	 * Checks the red-black properties of a CFS subtree, that it is ordered by virtual runtime,
+	 * and that its parent links are right.
+	 * @return Returns the number of black nodes on every path down from the subtree.
+	 */
+	static int check_cfs_subtree(CFSScheduler::Node *node, CFSScheduler::Node *parent, uint64_t low, uint64_t high, unsigned int& count)
+	{
+		if (!node) {
+			return 1;
+		}
+
+		CHECK(node->parent == parent);
+		CHECK(node->vruntime >= low && node->vruntime <= high);
+
+		if (node->red) {
+			CHECK(!node->left || !node->left->red);
+			CHECK(!node->right || !node->right->red);
+		}
+
+		count++;
+
+		int left = check_cfs_subtree(node->left, node, low, node->vruntime, count);
+		int right = check_cfs_subtree(node->right, node, node->vruntime, high, count);
+		CHECK(left == right);
+
+		return left + (node->red ? 0 : 1);
+	}
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+/**
+ * Round-robin on the kernel's linked list, where a pick pops the head and appends it again,
+ * and a remove searches the list.
+ */
+class ListRoundRobinScheduler : public SchedulingAlgorithm
+{
+public:
+	const char* name() const override { return "list-rr"; }
+
+	void add_to_runqueue(SchedulingEntity& entity) override { runqueue.enqueue(&entity); }
+	void remove_from_runqueue(SchedulingEntity& entity) override { runqueue.remove(&entity); }
+
+	SchedulingEntity *pick_next_entity() override
+	{
+		if (runqueue.count() == 0) return NULL;
+		if (runqueue.count() == 1) return runqueue.first();
+
+		SchedulingEntity *selected_entity = runqueue.pop();
+		runqueue.enqueue(selected_entity);
+
+		return selected_entity;
+	}
+
+private:
+	List<SchedulingEntity *> runqueue;
+};
+
+/**
+ * Checks round-robin picks against a queue that rotates its head to the tail on each pick.
+ */
+static void check_rr()
+{
+	RoundRobinScheduler rr;
+	std::vector<SchedulingEntity> entities(1000);
+	std::deque<SchedulingEntity *> model;
+	std::mt19937 rng(1);
+
+	for (unsigned int i = 0; i < 400000; i++) {
+		SchedulingEntity *entity = &entities[rng() % entities.size()];
+
+		if (rng() % 2) {
+			auto it = std::find(model.begin(), model.end(), entity);
+
+			if (it != model.end()) {
+				rr.remove_from_runqueue(*entity);
+				model.erase(it);
+			} else {
+				rr.add_to_runqueue(*entity);
+				model.push_back(entity);
+			}
+		}
+
+		SchedulingEntity *expected = NULL;
+		if (model.size() == 1) {
+			expected = model.front();
+		} else if (model.size() > 1) {
+			expected = model.front();
+			model.pop_front();
+			model.push_back(expected);
+		}
+
+		CHECK(rr.pick_next_entity() == expected);
+	}
+
+	printf("rr: picks match the model\n");
+}
+
+/**
+ * Removes every entity that is not on the given CPU's runqueue from an SMP scheduler.
+ */
+static void smp_keep_only(SMPRoundRobinScheduler& smp, std::vector<SchedulingEntity>& entities, int cpu)
+{
+	for (SchedulingEntity& entity : entities) {
+		int queue = SchedulerTestHook::smp_queue_of(smp, &entity);
+
+		if (queue >= 0 && queue != cpu) {
+			smp.remove_from_runqueue(entity);
+		}
+	}
+}
+
+/**
+ * Checks the SMP round-robin scheduler on four CPUs: that new entities are spread over the
+ * runqueues, that each CPU only runs what is on its own runqueue, that an idle CPU steals
+ * work but never an entity another CPU is running, and that rebalancing evens the runqueues
+ * out.
+ */
+static void check_smp()
+{
+	typedef SchedulerTestHook hook;
+	std::vector<SchedulingEntity> entities(80);
+
+	// entities go on the shortest runqueue, whichever CPU adds them
+	{
+		SMPRoundRobinScheduler smp;
+
+		for (size_t i = 0; i < 40; i++) {
+			harness_cpu = i % 3;
+			smp.add_to_runqueue(entities[i]);
+		}
+
+		for (unsigned int cpu = 0; cpu < NR_SCHED_CPUS; cpu++) {
+			CHECK(hook::smp_queue_length(smp, cpu) == 10);
+		}
+
+		smp_keep_only(smp, entities, -1);
+	}
+
+	// random adds, removes and picks, from random CPUs
+	{
+		SMPRoundRobinScheduler smp;
+		std::set<SchedulingEntity *> runnable;
+		std::mt19937 rng(11);
+
+		for (unsigned int i = 0; i < 200000; i++) {
+			SchedulingEntity *entity = &entities[rng() % entities.size()];
+			harness_cpu = rng() % NR_SCHED_CPUS;
+
+			if (rng() % 3 == 0) {
+				if (runnable.count(entity)) {
+					smp.remove_from_runqueue(*entity);
+					runnable.erase(entity);
+				} else {
+					smp.add_to_runqueue(*entity);
+					runnable.insert(entity);
+				}
+			}
+
+			// A CPU runs what is on its own runqueue, and only finds nothing when there is
+			// nothing it could steal either.
+			SchedulingEntity *picked = smp.pick_next_entity();
+			if (picked) {
+				CHECK(runnable.count(picked) == 1);
+				CHECK(hook::smp_queue_of(smp, picked) == (int) harness_cpu);
+			} else {
+				for (unsigned int cpu = 0; cpu < NR_SCHED_CPUS; cpu++) {
+					CHECK(hook::smp_queue_length(smp, cpu) <= 1);
+				}
+			}
+
+			// every runnable entity is on exactly one runqueue, and a CPU's running entity
+			// has not been taken from it
+			if (i % 97 == 0) {
+				unsigned int total = 0;
+				for (unsigned int cpu = 0; cpu < NR_SCHED_CPUS; cpu++) {
+					total += hook::smp_queue_length(smp, cpu);
+
+					SchedulingEntity *running = hook::smp_running(smp, cpu);
+					CHECK(!running || hook::smp_queue_of(smp, running) == (int) cpu);
+				}
+
+				CHECK(total == runnable.size());
+				for (SchedulingEntity *waiting : runnable) {
+					CHECK(hook::smp_queue_of(smp, waiting) >= 0);
+				}
+			}
+		}
+
+		smp_keep_only(smp, entities, -1);
+	}
+
+	// an idle CPU steals from the busiest, leaving alone what that CPU is running
+	{
+		SMPRoundRobinScheduler smp;
+
+		harness_cpu = 0;
+		for (size_t i = 0; i < 8; i++) {
+			smp.add_to_runqueue(entities[i]);
+		}
+
+		smp_keep_only(smp, entities, 0);
+		CHECK(hook::smp_queue_length(smp, 0) == 2);
+
+		SchedulingEntity *running = smp.pick_next_entity();
+
+		harness_cpu = 1;
+		SchedulingEntity *stolen = smp.pick_next_entity();
+		CHECK(stolen && stolen != running);
+		CHECK(hook::smp_queue_of(smp, stolen) == 1 && hook::smp_queue_of(smp, running) == 0);
+
+		// both of the others are running now, so there is nothing left to steal
+		harness_cpu = 2;
+		CHECK(smp.pick_next_entity() == NULL);
+
+		smp_keep_only(smp, entities, -1);
+	}
+
+	// the boot processor evens the runqueues out every so often
+	{
+		SMPRoundRobinScheduler smp;
+
+		harness_cpu = 0;
+		for (size_t i = 0; i < 80; i++) {
+			smp.add_to_runqueue(entities[i]);
+		}
+
+		smp_keep_only(smp, entities, 0);
+		CHECK(hook::smp_queue_length(smp, 0) == 20);
+
+		for (unsigned int i = 0; i < REBALANCE_INTERVAL; i++) {
+			CHECK(smp.pick_next_entity());
+		}
+
+		for (unsigned int cpu = 0; cpu < NR_SCHED_CPUS; cpu++) {
+			CHECK(hook::smp_queue_length(smp, cpu) == 5);
+		}
+
+		smp_keep_only(smp, entities, -1);
+	}
+
+	harness_cpu = 0;
+	printf("smp-rr: %u CPUs spread, steal and rebalance\n", NR_SCHED_CPUS);
+}
+
+/**
+ * Checks that FIFO always picks the entity that has been runnable longest.
+ */
+static void check_fifo()
+{
+	FIFOScheduler fifo;
+	std::vector<SchedulingEntity> entities(300);
+	std::deque<SchedulingEntity *> model;
+	std::mt19937 rng(2);
+
+	for (unsigned int i = 0; i < 200000; i++) {
+		SchedulingEntity *entity = &entities[rng() % entities.size()];
+		auto it = std::find(model.begin(), model.end(), entity);
+
+		if (it != model.end()) {
+			fifo.remove_from_runqueue(*entity);
+			model.erase(it);
+		} else {
+			fifo.add_to_runqueue(*entity);
+			model.push_back(entity);
+		}
+
+		CHECK(fifo.pick_next_entity() == (model.empty() ? NULL : model.front()));
+	}
+
+	printf("fifo: picks match the model\n");
+}
+
+/**
+ * Checks that MLFQ only picks runnable entities, and always picks one if there is any, as
+ * the entities it picks use up to 2 ms of CPU time before the next pick.
+ */
+static void check_mlfq_picks()
+{
+	MLFQScheduler mlfq;
+	std::vector<SchedulingEntity> entities(200);
+	std::set<SchedulingEntity *> runnable;
+	std::mt19937 rng(3);
+
+	for (unsigned int i = 0; i < 300000; i++) {
+		SchedulingEntity *entity = &entities[rng() % entities.size()];
+
+		if (rng() % 3 == 0) {
+			if (runnable.count(entity)) {
+				mlfq.remove_from_runqueue(*entity);
+				runnable.erase(entity);
+			} else {
+				mlfq.add_to_runqueue(*entity);
+				runnable.insert(entity);
+			}
+		}
+
+		SchedulingEntity *picked = mlfq.pick_next_entity();
+		CHECK(picked ? runnable.count(picked) == 1 : runnable.empty());
+
+		if (picked) picked->runtime += rng() % (2 * MS);
+	}
+
+	printf("mlfq: picks are runnable\n");
+}
+
+/**
+ * Checks that MLFQ demotes an entity by the CPU time it uses rather than by how often it is
+ * picked, boosts after a second of CPU time, and only restores the level of an entity that
+ * blocked, not of one that exited.
+ */
+static void check_mlfq_levels()
+{
+	MLFQScheduler mlfq;
+	SchedulingEntity a, b;
+
+	mlfq.add_to_runqueue(a);
+	mlfq.add_to_runqueue(b);
+
+	// picks that use no CPU time never use up the timeslice
+	for (unsigned int i = 0; i < 10000; i++) {
+		CHECK(mlfq.pick_next_entity() == &a);
+	}
+	CHECK(SchedulerTestHook::mlfq_level_of(mlfq, &a) == 0);
+
+	// the top level's timeslice is a millisecond, however it is split up
+	a.runtime += MS / 2;
+	CHECK(mlfq.pick_next_entity() == &a);
+	a.runtime += MS / 2;
+	CHECK(mlfq.pick_next_entity() == &b);
+	CHECK(SchedulerTestHook::mlfq_level_of(mlfq, &a) == 1);
+
+	// blocking keeps the level
+	mlfq.remove_from_runqueue(b);
+	a.entity_state = SchedulingEntityState::SLEEPING;
+	mlfq.remove_from_runqueue(a);
+	a.entity_state = SchedulingEntityState::RUNNABLE;
+	mlfq.add_to_runqueue(a);
+	CHECK(SchedulerTestHook::mlfq_level_of(mlfq, &a) == 1);
+
+	// exiting does not, so whatever is next made at the same address starts at the top
+	a.entity_state = SchedulingEntityState::STOPPED;
+	mlfq.remove_from_runqueue(a);
+	a.entity_state = SchedulingEntityState::RUNNABLE;
+	mlfq.add_to_runqueue(a);
+	CHECK(SchedulerTestHook::mlfq_level_of(mlfq, &a) == 0);
+
+	// nor does exiting while blocked
+	CHECK(mlfq.pick_next_entity() == &a);
+	a.runtime += MS;
+	CHECK(mlfq.pick_next_entity() == &a);
+	CHECK(SchedulerTestHook::mlfq_level_of(mlfq, &a) == 1);
+	a.entity_state = SchedulingEntityState::SLEEPING;
+	mlfq.remove_from_runqueue(a);
+	a.entity_state = SchedulingEntityState::STOPPED;
+	mlfq.remove_from_runqueue(a);
+	a.entity_state = SchedulingEntityState::RUNNABLE;
+	mlfq.add_to_runqueue(a);
+	CHECK(SchedulerTestHook::mlfq_level_of(mlfq, &a) == 0);
+
+	// a hog sinks to the bottom, and is boosted back once a second of CPU time has been used
+	MLFQScheduler hog_mlfq;
+	SchedulingEntity hog;
+	hog_mlfq.add_to_runqueue(hog);
+
+	unsigned int picks = 0;
+	bool sank = false;
+	do {
+		CHECK(hog_mlfq.pick_next_entity() == &hog);
+		hog.runtime += MS;
+		picks++;
+
+		if (SchedulerTestHook::mlfq_level_of(hog_mlfq, &hog) == MLFQ_NR_LEVELS - 1) sank = true;
+	} while (!sank || SchedulerTestHook::mlfq_level_of(hog_mlfq, &hog) != 0);
+
+	CHECK(picks == MLFQ_BOOST_INTERVAL / MS + 1);
+
+	printf("mlfq: levels follow CPU time, and exits are forgotten\n");
+}
+
+/**
+ * Checks that CFS only picks runnable entities, and keeps its tree valid, as entities of
+ * every priority come and go and use random amounts of CPU time.
+ */
+static void check_cfs()
+{
+	CFSScheduler cfs;
+	std::vector<SchedulingEntity> entities(500);
+	std::set<SchedulingEntity *> runnable;
+	std::mt19937 rng(5);
+
+	for (SchedulingEntity& entity : entities) {
+		entity.prio = rng() % ARRAY_SIZE(priority_to_nice);
+	}
+
+	for (unsigned int i = 0; i < 200000; i++) {
+		SchedulingEntity *entity = &entities[rng() % entities.size()];
+
+		if (rng() % 2) {
+			if (runnable.count(entity)) {
+				cfs.remove_from_runqueue(*entity);
+				runnable.erase(entity);
+			} else {
+				cfs.add_to_runqueue(*entity);
+				runnable.insert(entity);
+			}
+		}
+
+		SchedulingEntity *picked = cfs.pick_next_entity();
+		CHECK(picked ? runnable.count(picked) == 1 : runnable.empty());
+
+		if (picked) {
+			picked->runtime += rng() % 2000000;
+		}
+
+		if (i % 97 == 0) {
+			SchedulerTestHook::check_cfs_tree(cfs);
+		}
+	}
+
+	SchedulerTestHook::check_cfs_tree(cfs);
+	printf("cfs: picks are runnable, and the tree is valid\n");
+}
+
+/**
+ * Checks where CFS puts an entity that wakes up.  After a short sleep it carries on with the
+ * virtual runtime it blocked with, which includes its last run.  After a long one it is
+ * placed half the target latency behind the minimum virtual runtime.  An entity that exits
+ * is forgotten, whether it was runnable or blocked.
+ */
+static void check_cfs_wakeup()
+{
+	CFSScheduler cfs;
+	SchedulingEntity a, b;
+
+	cfs.add_to_runqueue(a);
+	cfs.add_to_runqueue(b);
+
+	// a runs for 2 ms, and blocks while it is running
+	CHECK(cfs.pick_next_entity() == &a);
+	a.runtime += 2 * MS;
+	a.entity_state = SchedulingEntityState::SLEEPING;
+	cfs.remove_from_runqueue(a);
+	CHECK(SchedulerTestHook::cfs_nr_sleepers(cfs) == 1);
+
+	// a short sleep keeps the 2 ms that b has not caught up with
+	CHECK(cfs.pick_next_entity() == &b);
+	b.runtime += MS;
+	CHECK(cfs.pick_next_entity() == &b);
+
+	a.entity_state = SchedulingEntityState::RUNNABLE;
+	cfs.add_to_runqueue(a);
+	CHECK(SchedulerTestHook::cfs_vruntime_of(cfs, &a) == 2 * MS);
+	CHECK(SchedulerTestHook::cfs_nr_sleepers(cfs) == 0);
+
+	// a long sleep is only credited with half the target latency
+	a.entity_state = SchedulingEntityState::SLEEPING;
+	cfs.remove_from_runqueue(a);
+	for (unsigned int i = 0; i < 100; i++) {
+		CHECK(cfs.pick_next_entity() == &b);
+		b.runtime += MS;
+	}
+	CHECK(cfs.pick_next_entity() == &b);
+
+	a.entity_state = SchedulingEntityState::RUNNABLE;
+	cfs.add_to_runqueue(a);
+	CHECK(SchedulerTestHook::cfs_vruntime_of(cfs, &a) == SchedulerTestHook::cfs_min_vruntime(cfs) - CFS_TARGET_LATENCY / 2);
+	CHECK(cfs.pick_next_entity() == &a);
+
+	// exiting, whether runnable or blocked, leaves nothing saved
+	a.entity_state = SchedulingEntityState::STOPPED;
+	cfs.remove_from_runqueue(a);
+	CHECK(SchedulerTestHook::cfs_nr_sleepers(cfs) == 0);
+
+	a.entity_state = SchedulingEntityState::RUNNABLE;
+	cfs.add_to_runqueue(a);
+	CHECK(SchedulerTestHook::cfs_vruntime_of(cfs, &a) == SchedulerTestHook::cfs_min_vruntime(cfs));
+
+	a.entity_state = SchedulingEntityState::SLEEPING;
+	cfs.remove_from_runqueue(a);
+	a.entity_state = SchedulingEntityState::STOPPED;
+	cfs.remove_from_runqueue(a);
+	CHECK(SchedulerTestHook::cfs_nr_sleepers(cfs) == 0);
+
+	printf("cfs: woken entities are placed by their saved virtual runtime\n");
+}
+
+/**
+ * Checks that EDF only picks runnable entities, and only picks nothing when every runnable
+ * entity is throttled, as reservations come and go.  The admitted bandwidth never goes over
+ * the limit, and the ready heap stays in deadline order.
+ */
+static void check_edf()
+{
+	EDFScheduler edf;
+	std::vector<SchedulingEntity> entities(100);
+	std::set<SchedulingEntity *> runnable;
+	std::mt19937 rng(9);
+
+	sys.now = 0;
+
+	for (unsigned int i = 0; i < 300000; i++) {
+		sys.now += rng() % (2 * MS);
+
+		SchedulingEntity *entity = &entities[rng() % entities.size()];
+		unsigned int op = rng() % 10;
+
+		if (op < 4) {
+			if (runnable.count(entity)) {
+				edf.remove_from_runqueue(*entity);
+				runnable.erase(entity);
+			} else {
+				edf.add_to_runqueue(*entity);
+				runnable.insert(entity);
+			}
+		} else if (op == 4) {
+			uint64_t period = (1 + (rng() % 50)) * MS;
+			edf.set_parameters(*entity, 1 + (rng() % period), period, period - (rng() % (period / 2)));
+		} else if (op == 5) {
+			edf.clear_parameters(*entity);
+		}
+
+		SchedulingEntity *picked = edf.pick_next_entity();
+		if (picked) {
+			CHECK(runnable.count(picked) == 1);
+			picked->runtime += rng() % (3 * MS);
+		} else {
+			for (SchedulingEntity *waiting : runnable) {
+				CHECK(SchedulerTestHook::edf_throttled(edf, waiting));
+			}
+		}
+
+		CHECK(SchedulerTestHook::edf_total_bw(edf) <= ((uint64_t) EDF_UTILIZATION_LIMIT << EDF_BW_SHIFT) / 1024);
+		SchedulerTestHook::check_edf_heap(edf);
+	}
+
+	// admission stops at the utilisation limit, and rejects parameters that make no sense
+	EDFScheduler admission;
+	SchedulingEntity a, b, c;
+
+	CHECK(admission.set_parameters(a, 5, 10, 10));
+	CHECK(admission.set_parameters(b, 4, 10, 10));
+	CHECK(!admission.set_parameters(c, 2, 10, 10));
+	CHECK(admission.set_parameters(c, 1, 40, 40));
+	CHECK(!admission.set_parameters(c, 0, 40, 40));
+	CHECK(!admission.set_parameters(c, 5, 40, 4));
+	CHECK(!admission.set_parameters(c, 1, 40, 50));
+
+	// A reservation of seconds takes the wakeup check past 64 bits.  Having used 1 ms of 3 s,
+	// and woken 1 s into a 7 s period, it cannot finish by its deadline at its reserved rate,
+	// so it starts a new period.
+	EDFScheduler long_period;
+	SchedulingEntity d;
+
+	sys.now = 0;
+	CHECK(long_period.set_parameters(d, 3000 * MS, 7000 * MS, 7000 * MS));
+
+	long_period.add_to_runqueue(d);
+	CHECK(long_period.pick_next_entity() == &d);
+
+	d.runtime += MS;
+	sys.now = MS;
+	long_period.remove_from_runqueue(d);
+
+	sys.now = 1000 * MS;
+	long_period.add_to_runqueue(d);
+	CHECK(SchedulerTestHook::edf_deadline_of(long_period, &d) == 8000 * MS);
+
+	printf("edf: picks are runnable, admission holds, and the heap is ordered\n");
+}
+
+/**
+ * Checks that constructing an empty scheduler, and picking from and removing from it, does
+ * not allocate, since schedulers are constructed before the kernel heap exists.
+ */
+static void check_empty()
+{
+	unsigned long start = nr_array_allocations;
+
+	RoundRobinScheduler rr;
+	FIFOScheduler fifo;
+	SMPRoundRobinScheduler smp;
+	MLFQScheduler mlfq;
+	CFSScheduler cfs;
+	EDFScheduler edf;
+	SchedulingEntity entity;
+
+	SchedulingAlgorithm *algorithms[] = { &rr, &fifo, &smp, &mlfq, &cfs, &edf };
+	for (SchedulingAlgorithm *algorithm : algorithms) {
+		algorithm->remove_from_runqueue(entity);
+		CHECK(algorithm->pick_next_entity() == NULL);
+	}
+
+	CHECK(nr_array_allocations == start);
+
+	for (SchedulingAlgorithm *algorithm : algorithms) {
+		algorithm->add_to_runqueue(entity);
+		CHECK(algorithm->pick_next_entity() == &entity);
+
+		algorithm->remove_from_runqueue(entity);
+		CHECK(algorithm->pick_next_entity() == NULL);
+	}
+
+	printf("empty schedulers do not allocate\n");
+}
+
+/**
+ * Times a pick, followed by removing and re-adding an entity, with a given number of
+ * entities runnable.
+ */
+static double time_runqueue(SchedulingAlgorithm& algorithm, unsigned int nr_entities, unsigned int iterations)
+{
+	std::vector<SchedulingEntity> entities(nr_entities);
+	for (SchedulingEntity& entity : entities) {
+		algorithm.add_to_runqueue(entity);
+	}
+
+	uint64_t start = now_ns();
+	for (unsigned int i = 0; i < iterations; i++) {
+		SchedulingEntity& entity = entities[(i * 7919ull) % nr_entities];
+
+		algorithm.pick_next_entity();
+		algorithm.remove_from_runqueue(entity);
+		algorithm.add_to_runqueue(entity);
+	}
+
+	double ns = (double) (now_ns() - start) / iterations;
+
+	for (SchedulingEntity& entity : entities) {
+		algorithm.remove_from_runqueue(entity);
+	}
+
+	return ns;
+}
+
+static void bench_runqueue()
+{
+	printf("runnable   list-rr ns/op   rr ns/op\n");
+
+	unsigned int sizes[] = { 10, 1000, 100000 };
+	for (unsigned int n : sizes) {
+		// the list searches for the entity it removes, so gets far fewer iterations
+		ListRoundRobinScheduler list_rr;
+		double before = time_runqueue(list_rr, n, n > 10000 ? 2000 : 200000);
+
+		RoundRobinScheduler rr;
+		double after = time_runqueue(rr, n, 200000);
+
+		printf("%8u   %13.1f   %8.1f\n", n, before, after);
+	}
+}
+
+static long percentile(std::vector<long>& samples, double fraction)
+{
+	if (samples.empty()) {
+		return 0;
+	}
+
+	std::sort(samples.begin(), samples.end());
+	return samples[(size_t) (fraction * (samples.size() - 1))];
+}
+
+/**
+ * Simulates one CPU, picking once per 1 ms tick, with CPU-bound entities that never block
+ * and use the whole tick, and I/O-bound ones that block after 50 us of it, for between 1 and
+ * 20 ticks.  Reports how many ticks an I/O-bound entity waits to run after waking, and how
+ * many ticks pass between the runs of a CPU-bound one, after a warm-up.
+ */
+static void simulate_latency(SchedulingAlgorithm& algorithm, unsigned int nr_cpu, unsigned int nr_io)
+{
+	const long nr_ticks = 200000, warm_up = 1000, max_sleep = 20;
+
+	std::vector<SchedulingEntity> entities(nr_cpu + nr_io);
+	std::vector<long> wake_at(entities.size(), -1), woken_at(entities.size(), 0), last_run(entities.size(), 0);
+	std::vector<long> io_latency, cpu_gap;
+	std::mt19937 rng(7);
+
+	for (SchedulingEntity& entity : entities) {
+		algorithm.add_to_runqueue(entity);
+	}
+
+	for (long t = 0; t < nr_ticks; t++) {
+		for (size_t i = nr_cpu; i < entities.size(); i++) {
+			if (wake_at[i] == t) {
+				algorithm.add_to_runqueue(entities[i]);
+				woken_at[i] = t;
+				wake_at[i] = -1;
+			}
+		}
+
+		// an I/O-bound entity gives the CPU straight back, so the tick goes to the next pick
+		for (;;) {
+			SchedulingEntity *picked = algorithm.pick_next_entity();
+			if (!picked) break;
+
+			size_t i = picked - &entities[0];
+			if (i < nr_cpu) {
+				if (t > warm_up) cpu_gap.push_back(t - last_run[i]);
+				last_run[i] = t;
+				picked->runtime += MS;
+				break;
+			}
+
+			if (t > warm_up) io_latency.push_back(t - woken_at[i]);
+
+			picked->runtime += MS / 20;
+			algorithm.remove_from_runqueue(*picked);
+			wake_at[i] = t + 1 + (rng() % max_sleep);
+		}
+	}
+
+	for (size_t i = 0; i < entities.size(); i++) {
+		if (wake_at[i] < 0) algorithm.remove_from_runqueue(entities[i]);
+	}
+
+	printf("%6u   %-5s   %6ld / %-6ld   %6ld / %ld\n", nr_cpu, algorithm.name(), percentile(io_latency, 0.5), percentile(io_latency, 0.99),
+		percentile(cpu_gap, 0.5), percentile(cpu_gap, 0.99));
+}
+
+static void bench_latency()
+{
+	printf("with 8 I/O-bound entities, in ticks\n");
+	printf("N hogs   alg     io p50 / p99    hog gap p50 / p99\n");
+
+	unsigned int hogs[] = { 4, 16, 64 };
+	for (unsigned int n : hogs) {
+		RoundRobinScheduler rr;
+		simulate_latency(rr, n, 8);
+
+		MLFQScheduler mlfq;
+		simulate_latency(mlfq, n, 8);
+
+		CFSScheduler cfs;
+		simulate_latency(cfs, n, 8);
+	}
+}
+
+/**
+ * Runs 20 always-runnable entities under CFS, in 1 ms ticks, and reports Jain's fairness
+ * index of the CPU time each got over its weighted share, and the furthest any one was from
+ * its share.
+ */
+static void simulate_fairness(bool mixed)
+{
+	const unsigned int nr_ticks = 100000;
+	const uint64_t tick = 1000000;
+
+	CFSScheduler cfs;
+	std::vector<SchedulingEntity> entities(20);
+
+	double total_weight = 0;
+	for (size_t i = 0; i < entities.size(); i++) {
+		entities[i].prio = mixed ? i % ARRAY_SIZE(priority_to_nice) : 2;
+		total_weight += SchedulerTestHook::cfs_weight_of(entities[i]);
+
+		cfs.add_to_runqueue(entities[i]);
+	}
+
+	for (unsigned int t = 0; t < nr_ticks; t++) {
+		cfs.pick_next_entity()->runtime += tick;
+	}
+
+	double sum = 0, sum_of_squares = 0, worst = 0;
+	for (SchedulingEntity& entity : entities) {
+		double share = entity.runtime / ((double) nr_ticks * tick);
+		double relative = share / (SchedulerTestHook::cfs_weight_of(entity) / total_weight);
+
+		sum += relative;
+		sum_of_squares += relative * relative;
+		worst = std::max(worst, fabs(relative - 1));
+	}
+
+	printf("%-16s   %.4f   %5.1f%%\n", mixed ? "mixed priorities" : "equal", (sum * sum) / (entities.size() * sum_of_squares), worst * 100);
+}
+
+/**
+ * Times a CFS pick, charging each pick a 1 ms tick, with a given number of entities runnable.
+ */
+static void time_cfs_pick(unsigned int nr_entities)
+{
+	const unsigned int iterations = 1000000;
+
+	CFSScheduler cfs;
+	std::vector<SchedulingEntity> entities(nr_entities);
+	for (SchedulingEntity& entity : entities) {
+		cfs.add_to_runqueue(entity);
+	}
+
+	uint64_t start = now_ns();
+	for (unsigned int i = 0; i < iterations; i++) {
+		cfs.pick_next_entity()->runtime += 1000000;
+	}
+
+	printf("%8u   %8.1f\n", nr_entities, (double) (now_ns() - start) / iterations);
+
+	for (SchedulingEntity& entity : entities) {
+		cfs.remove_from_runqueue(entity);
+	}
+}
+
+static void bench_cfs()
+{
+	printf("20 tasks           jain     worst deviation from weighted share\n");
+	simulate_fairness(false);
+	simulate_fairness(true);
+
+	printf("runnable   cfs ns/pick\n");
+
+	unsigned int sizes[] = { 10, 1000, 10000 };
+	for (unsigned int n : sizes) {
+		time_cfs_pick(n);
+	}
+}
+
+/**
+ * A periodic task in the deadline simulation.  Each job needs 'demand' ticks of CPU, which
+ * is more than the reserved runtime for a task that overruns.
+ */
+struct PeriodicTask
+{
+	uint64_t runtime, period, deadline, demand;
+
+	// the simulation's state, which the task list leaves out
+	uint64_t next_release = 0, released = 0, left = 0;
+	bool active = false;
+	unsigned int jobs = 0, misses = 0;
+	uint64_t worst_response = 0;
+};
+
+/**
+ * Simulates one CPU in 1 ms ticks, running periodic tasks next to CPU-bound ones that never
+ * block.  Under EDF the periodic tasks have reservations.  A job that has not finished when
+ * the next one is released is dropped, and counted as a miss.
+ */
+static void simulate_deadlines(SchedulingAlgorithm& algorithm, EDFScheduler *edf, std::vector<PeriodicTask> tasks, unsigned int nr_hogs)
+{
+	const uint64_t nr_ticks = 100000;
+
+	std::vector<SchedulingEntity> entities(tasks.size() + nr_hogs);
+
+	sys.now = 0;
+
+	for (size_t i = 0; i < tasks.size(); i++) {
+		if (edf) {
+			CHECK(edf->set_parameters(entities[i], tasks[i].runtime * MS, tasks[i].period * MS, tasks[i].deadline * MS));
+		}
+	}
+
+	for (size_t i = tasks.size(); i < entities.size(); i++) {
+		algorithm.add_to_runqueue(entities[i]);
+	}
+
+	for (uint64_t t = 0; t < nr_ticks; t++) {
+		sys.now = t * MS;
+
+		for (size_t i = 0; i < tasks.size(); i++) {
+			PeriodicTask& task = tasks[i];
+			if (task.next_release != t) continue;
+
+			task.next_release += task.period;
+
+			if (task.active) {
+				task.jobs++;
+				task.misses++;
+			} else {
+				task.active = true;
+				algorithm.add_to_runqueue(entities[i]);
+			}
+
+			task.left = task.demand;
+			task.released = t;
+		}
+
+		SchedulingEntity *picked = algorithm.pick_next_entity();
+		if (!picked) continue;
+
+		picked->runtime += MS;
+
+		size_t i = picked - &entities[0];
+		if (i >= tasks.size()) continue;
+
+		PeriodicTask& task = tasks[i];
+		if (--task.left == 0) {
+			uint64_t response = t + 1 - task.released;
+
+			task.jobs++;
+			if (response > task.deadline) task.misses++;
+			if (response > task.worst_response) task.worst_response = response;
+
+			task.active = false;
+
+			sys.now = (t + 1) * MS;
+			algorithm.remove_from_runqueue(*picked);
+		}
+	}
+
+	for (size_t i = 0; i < tasks.size(); i++) {
+		const PeriodicTask& task = tasks[i];
+
+		char parameters[32];
+		snprintf(parameters, sizeof(parameters), "%lu/%lu/%lu", task.runtime, task.period, task.deadline);
+
+		printf("%-5s   %-9s   %-8s   %5u / %-5u   %8lu   %5.1f%%\n", algorithm.name(), parameters,
+			task.demand > task.runtime ? "overruns" : "", task.misses, task.jobs, task.worst_response,
+			(entities[i].runtime * 100.0) / (nr_ticks * MS));
+	}
+}
+
+static void bench_deadlines()
+{
+	// runtime, period and deadline in ms, and the CPU each job wants
+	std::vector<PeriodicTask> tasks = {
+		{ 2, 10, 10, 2 },
+		{ 3, 20, 15, 3 },
+		{ 10, 50, 40, 10 },
+		{ 4, 40, 40, 12 },
+	};
+
+	printf("four periodic tasks and 4 CPU hogs\n");
+	printf("alg     C/T/D ms               misses / jobs    worst ms     CPU\n");
+
+	RoundRobinScheduler rr;
+	simulate_deadlines(rr, NULL, tasks, 4);
+
+	EDFScheduler edf;
+	simulate_deadlines(edf, &edf, tasks, 4);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && strcmp(argv[1], "check") == 0) {
+		check_empty();
+		check_rr();
+		check_smp();
+		check_fifo();
+		check_mlfq_picks();
+		check_mlfq_levels();
+		check_cfs();
+		check_cfs_wakeup();
+		check_edf();
+		return 0;
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+		bench_runqueue();
+		bench_latency();
+		bench_cfs();
+		bench_deadlines();
+		return 0;
+	}
+
+	fprintf(stderr, "usage: %s check\n", argv[0]);
+	fprintf(stderr, "       %s bench\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,949 @@
+/*
+ * TarFS Test Harness
+ *
+ * A host-side program that runs the TarFS driver in "tarfs.cpp" outside the kernel, on a
+ * block device held in memory.  The kernel headers it needs are replaced by the stand-ins
+ * under "tools/host", and pages come from the buddy allocator over simulated memory.
+ *
+ * The archives are generated, so the contents of every member are known.  The one that is
+ * checked holds a directory of small members, members whose paths are too long for a ustar
+ * header and are named by pax and GNU long name headers instead, and one large member.
+ *
+ * "check" reads every member with read(), pread(), preadv() and read_batch(), and compares
+ * what comes back with what was archived.  It does so for the plain archive, for the archive
+ * with an index appended, as tools/tarfs-mkindex would, and for the archive compressed with
+ * gzip.  It also checks that the index spares the mount from reading headers, that a damaged
+ * index or gzip stream is noticed, and that mapped files fault in the right pages.
+ *
+ * "bench" streams a 256 MiB member with read() and pread(), reporting device requests and
+ * throughput, counts the device requests made reading every small member one at a time and
+ * as a single batch, measures inflating throughput and the time to the first read of a gzip
+ * compressed archive, and times mounting an archive of a million members.
+ *
+ * Build with: c++ -O2 -I tools/host -o tarfs-harness tools/tarfs-harness.cpp -lz
+ * Run as: tarfs-harness check [seed]
+ *         tarfs-harness bench
+ * Set LAZY in the environment to mount the archives lazily.
+ */
+#include "../buddy.cpp"
+#include "../slab.cpp"
+#include "../block-cache.cpp"
+#include "../gzip-device.cpp"
+#include "../tarfs.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace infos
+{
+	namespace kernel
+	{
+		Kernel sys;
+		Log syslog, mm_log;
+	}
+
+	namespace drivers
+	{
+		namespace block
+		{
+			DeviceClass BlockDevice::BlockDeviceClass;
+		}
+	}
+}
+
+// The pages of simulated memory, for the driver's caches and nodes.  Only the pages that are
+// touched take host memory, and a million member archive needs a lot of nodes.
+#define HARNESS_MEMORY_PAGES	262144
+
+// The members of the archive that is checked.
+#define HARNESS_NR_SMALL	200
+#define HARNESS_SMALL_SIZE	3000
+#define HARNESS_NR_LONG		8
+#define HARNESS_LARGE_SIZE	8000000
+
+// The archives that are benchmarked.
+#define HARNESS_BENCH_LARGE_SIZE	(256ul << 20)
+#define HARNESS_BENCH_DIRS		1000
+#define HARNESS_BENCH_PER_DIR		1000
+
+// Where the mmap check maps files.
+#define HARNESS_MAP_BASE	0x40000000ul
+
+namespace LongName
+{
+	enum LongName
+	{
+		NONE,		// the path fits in the ustar header
+		PAX,		// a pax extended header carries the path
+		GNU		// a GNU long name header carries the path
+	};
+}
+
+struct Member
+{
+	std::string path;
+	std::string header_name;	// the name in the member's own header, which may be cut short
+	size_t size;
+	unsigned int id;
+};
+
+/**
+ * A header that names a node, as the index records it.
+ */
+struct Record
+{
+	std::string path;
+	size_t header_block;
+	size_t size;
+	char typeflag;
+};
+
+struct Archive
+{
+	BlockDevice device;
+	std::vector<Member> members;
+	std::vector<Record> records;
+};
+
+static BuddyPageAllocator buddy;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+static double mb_per_second(uint64_t bytes, uint64_t ns)
+{
+	return ns ? ((double) bytes / (1 << 20)) / ((double) ns / 1e9) : 0;
+}
+
+/**
+ * Returns the byte at the given offset of a member, which depends on both so that reading
+ * from the wrong place, or the wrong member, is noticed.
+ */
+static uint8_t member_byte(unsigned int id, size_t offset)
+{
+	uint32_t x = (uint32_t) offset * 0x9e3779b1u ^ (id * 0x85ebca6bu);
+	x ^= x >> 15;
+
+	return (uint8_t) x;
+}
+
+static void write_octal(char *field, size_t width, uint64_t value)
+{
+	snprintf(field, width, "%0*lo", (int) width - 1, (unsigned long) value);
+}
+
+/**
+ * Appends a header to an image.
+ * @return Returns the block the header is in.
+ */
+static size_t append_header(std::vector<uint8_t>& image, const std::string& name, char typeflag, size_t size)
+{
+	posix_header header;
+	memset(&header, 0, sizeof(header));
+
+	// a name that fills the field has no terminator
+	memcpy(header.name, name.c_str(), std::min(name.size(), sizeof(header.name)));
+	write_octal(header.mode, sizeof(header.mode), typeflag == '5' ? 0755 : 0644);
+	write_octal(header.uid, sizeof(header.uid), 0);
+	write_octal(header.gid, sizeof(header.gid), 0);
+	write_octal(header.size, sizeof(header.size), size);
+	write_octal(header.mtime, sizeof(header.mtime), 0);
+	header.typeflag = typeflag;
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+
+	// the checksum is taken with its own field full of spaces
+	memset(header.chksum, ' ', sizeof(header.chksum));
+
+	unsigned int sum = 0;
+	for (size_t i = 0; i < sizeof(header); i++) {
+		sum += ((uint8_t *) &header)[i];
+	}
+
+	snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+
+	size_t block = image.size() / 512;
+
+	uint8_t data[512] = { 0 };
+	memcpy(data, &header, sizeof(header));
+	image.insert(image.end(), data, data + 512);
+
+	return block;
+}
+
+/**
+ * Appends the data of a metadata header to an image, padded to whole blocks.
+ */
+static void append_data(std::vector<uint8_t>& image, const std::string& data)
+{
+	image.insert(image.end(), data.begin(), data.end());
+	image.resize((image.size() + 511) & ~(size_t) 511, 0);
+}
+
+/**
+ * Builds a pax record, whose length counts the digits of the length itself.
+ */
+static std::string pax_record(const std::string& keyword, const std::string& value)
+{
+	size_t length = keyword.size() + value.size() + 3;
+	while (std::to_string(length).size() + keyword.size() + value.size() + 3 != length) {
+		length++;
+	}
+
+	return std::to_string(length) + " " + keyword + "=" + value + "\n";
+}
+
+static void append_directory(Archive& a, const std::string& path)
+{
+	size_t block = append_header(a.device.image, path + "/", '5', 0);
+	a.records.push_back({ path, block, 0, '5' });
+}
+
+static void append_member(Archive& a, const std::string& path, size_t size, LongName::LongName long_name = LongName::NONE)
+{
+	std::vector<uint8_t>& image = a.device.image;
+	Member m = { path, path, size, (unsigned int) a.members.size() };
+
+	// the member's own header gets whatever of the path fits
+	if (long_name != LongName::NONE) {
+		m.header_name = path.substr(0, 99);
+	}
+
+	if (long_name == LongName::PAX) {
+		std::string records = pax_record("path", path);
+		append_header(image, "PaxHeader/" + std::to_string(m.id), 'x', records.size());
+		append_data(image, records);
+	} else if (long_name == LongName::GNU) {
+		append_header(image, "././@LongLink", 'L', path.size() + 1);
+		append_data(image, path + '\0');
+	}
+
+	size_t block = append_header(image, m.header_name, '0', size);
+	a.records.push_back({ path, block, size, '0' });
+	a.members.push_back(m);
+
+	size_t start = image.size();
+	image.resize(start + ((size + 511) & ~(size_t) 511), 0);
+
+	for (size_t i = 0; i < size; i++) {
+		image[start + i] = member_byte(m.id, i);
+	}
+}
+
+/**
+ * Marks the end of an archive, with two empty blocks.
+ */
+static void end_archive(Archive& a)
+{
+	a.device.image.resize(a.device.image.size() + 1024, 0);
+}
+
+static void build_archive(Archive& a)
+{
+	append_directory(a, "small");
+	for (unsigned int i = 0; i < HARNESS_NR_SMALL; i++) {
+		append_member(a, "small/" + std::to_string(i), HARNESS_SMALL_SIZE + (i * 7));
+	}
+
+	// members whose paths only fit in a pax or GNU long name header
+	append_directory(a, "long");
+	for (unsigned int i = 0; i < HARNESS_NR_LONG; i++) {
+		std::string path = "long/" + std::string(100 + (i * 20), 'a' + i) + "/" + std::to_string(i);
+		append_member(a, path, 1000 + (i * 1500), i % 2 ? LongName::GNU : LongName::PAX);
+	}
+
+	append_directory(a, "large");
+	append_member(a, "large/blob", HARNESS_LARGE_SIZE);
+
+	end_archive(a);
+}
+
+/**
+ * Appends an index of an archive's members to an image of it, laid out as tools/tarfs-mkindex
+ * lays it out.  The archive must already have been ended.
+ */
+static void append_index(const Archive& a, std::vector<uint8_t>& image)
+{
+	std::vector<uint8_t> entries;
+
+	for (const Record& r : a.records) {
+		index_entry entry;
+		entry.header_block = r.header_block;
+		entry.data_block = r.header_block + 1;
+		entry.size = r.size;
+		entry.typeflag = r.typeflag;
+		entry.reserved = 0;
+		entry.path_length = r.path.size();
+
+		entries.insert(entries.end(), (uint8_t *) &entry, (uint8_t *) (&entry + 1));
+		entries.insert(entries.end(), r.path.begin(), r.path.end());
+	}
+
+	index_trailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	memcpy(trailer.magic, TARFS_INDEX_MAGIC, sizeof(trailer.magic));
+	trailer.version = TARFS_INDEX_VERSION;
+	trailer.index_block = image.size() / 512;
+	trailer.index_bytes = entries.size();
+	trailer.nr_entries = a.records.size();
+	trailer.checksum = index_checksum(entries.data(), entries.size());
+
+	image.insert(image.end(), entries.begin(), entries.end());
+	image.resize((image.size() + 511) & ~(size_t) 511, 0);
+
+	uint8_t block[512] = { 0 };
+	memcpy(block, &trailer, sizeof(trailer));
+	image.insert(image.end(), block, block + 512);
+}
+
+/**
+ * Compresses an image with gzip, as a number of concatenated gzip members, and pads the
+ * result to whole blocks as a device would.
+ */
+static void gzip_image(const std::vector<uint8_t>& image, std::vector<uint8_t>& out, unsigned int nr_members, int level)
+{
+	size_t chunk = (image.size() + nr_members - 1) / nr_members;
+
+	for (size_t start = 0; start < image.size(); start += chunk) {
+		size_t length = std::min(chunk, image.size() - start);
+
+		z_stream z;
+		memset(&z, 0, sizeof(z));
+		deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+
+		size_t pos = out.size();
+		out.resize(pos + deflateBound(&z, length));
+
+		z.next_in = (Bytef *) &image[start];
+		z.avail_in = length;
+		z.next_out = &out[pos];
+		z.avail_out = out.size() - pos;
+
+		deflate(&z, Z_FINISH);
+		out.resize(out.size() - z.avail_out);
+		deflateEnd(&z);
+	}
+
+	out.resize((out.size() + 511) & ~(size_t) 511, 0);
+}
+
+static PFSNode *lookup(PFSNode *root, const std::string& path)
+{
+	PFSNode *node = root;
+	size_t start = 0;
+
+	while (node && start < path.size()) {
+		size_t end = path.find('/', start);
+		if (end == std::string::npos) {
+			end = path.size();
+		}
+
+		node = node->get_child(String(path.substr(start, end - start).c_str()));
+		start = end + 1;
+	}
+
+	return node;
+}
+
+static bool check_data(const Member& m, const uint8_t *data, size_t offset, size_t size, const char *how)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (data[i] != member_byte(m.id, offset + i)) {
+			fprintf(stderr, "error: %s of %s returned the wrong data at offset %lu\n", how, m.path.c_str(), offset + i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Returns how many bytes of a read at an offset a member can satisfy.
+ */
+static size_t expected_length(const Member& m, size_t offset, size_t size)
+{
+	if (offset >= m.size) {
+		return 0;
+	}
+
+	return size < m.size - offset ? size : m.size - offset;
+}
+
+static TarFS *mount_archive(BlockDevice& device, PFSNode *& root)
+{
+	TarFS *fs = create_archive_fs(device, getenv("LAZY") != NULL);
+
+	root = fs->mount();
+	if (!root) {
+		fprintf(stderr, "error: unable to mount the archive\n");
+		exit(1);
+	}
+
+	return fs;
+}
+
+/**
+ * Reads every member of an archive in every way there is, and compares what comes back
+ * with what was archived.
+ * @param device The device holding the archive, which may be indexed or compressed.
+ * @param a The archive.
+ * @param seed Seeds the sizes and offsets of the reads.
+ * @param what What the device holds, for the report.
+ * @return Returns zero if everything matched.
+ */
+static int check_archive(BlockDevice& device, const Archive& a, unsigned long seed, const char *what)
+{
+	PFSNode *root;
+	TarFS *fs = mount_archive(device, root);
+
+	std::mt19937_64 rng(seed);
+	std::vector<uint8_t> buffer(HARNESS_LARGE_SIZE + 4096);
+
+	for (const Member& m : a.members) {
+		PFSNode *node = lookup(root, m.path);
+		if (!node) {
+			fprintf(stderr, "error: %s is missing from the %s\n", m.path.c_str(), what);
+			return 1;
+		}
+
+		// a member named by a metadata header must not also appear under its cut short name
+		if (m.header_name != m.path && lookup(root, m.header_name)) {
+			fprintf(stderr, "error: %s is also in the %s as %s\n", m.path.c_str(), what, m.header_name.c_str());
+			return 1;
+		}
+
+		TarFSFile *file = (TarFSFile *) node->open();
+
+		// sequentially, in reads of assorted sizes
+		size_t offset = 0;
+		int rc;
+		while ((rc = file->read(&buffer[0], 1 + (rng() % 20000))) > 0) {
+			if (!check_data(m, &buffer[0], offset, rc, "read")) return 1;
+			offset += rc;
+		}
+
+		if (offset != m.size) {
+			fprintf(stderr, "error: read returned %lu bytes of %s, not %lu\n", offset, m.path.c_str(), m.size);
+			return 1;
+		}
+
+		// at random offsets, including some past the end
+		for (unsigned int i = 0; i < 50; i++) {
+			size_t off = rng() % (m.size + 1024);
+			size_t size = rng() % 2 ? rng() % 1024 : rng() % 40000;
+
+			rc = file->pread(&buffer[0], size, off);
+			if ((size_t) rc != expected_length(m, off, size)) {
+				fprintf(stderr, "error: pread of %lu bytes at %lu of %s returned %d\n", size, off, m.path.c_str(), rc);
+				return 1;
+			}
+
+			if (!check_data(m, &buffer[0], off, rc, "pread")) return 1;
+		}
+
+		// into three buffers at once
+		size_t off = rng() % m.size;
+		size_t lengths[3] = { rng() % 700, rng() % 5000, rng() % 700 };
+		IOVector iov[3] = {
+			{ &buffer[0], lengths[0] },
+			{ &buffer[lengths[0]], lengths[1] },
+			{ &buffer[lengths[0] + lengths[1]], lengths[2] },
+		};
+
+		rc = file->preadv(iov, 3, off);
+		if ((size_t) rc != expected_length(m, off, lengths[0] + lengths[1] + lengths[2]) || !check_data(m, &buffer[0], off, rc, "preadv")) {
+			fprintf(stderr, "error: preadv at %lu of %s returned %d\n", off, m.path.c_str(), rc);
+			return 1;
+		}
+
+		delete file;
+	}
+
+	// a batch of reads from members all over the archive, submitted in no particular order
+	const unsigned int nr_requests = 300;
+	TarFSReadRequest requests[nr_requests];
+	std::vector<std::vector<uint8_t>> buffers(nr_requests);
+
+	for (unsigned int i = 0; i < nr_requests; i++) {
+		const Member& m = a.members[rng() % a.members.size()];
+
+		buffers[i].resize(1 + (rng() % 9000));
+		requests[i].node = lookup(root, m.path);
+		requests[i].buffer = &buffers[i][0];
+		requests[i].size = buffers[i].size();
+		requests[i].offset = rng() % m.size;
+	}
+
+	fs->read_batch(requests, nr_requests);
+
+	for (unsigned int i = 0; i < nr_requests; i++) {
+		const Member *m = NULL;
+		for (const Member& candidate : a.members) {
+			if (lookup(root, candidate.path) == requests[i].node) m = &candidate;
+		}
+
+		if ((size_t) requests[i].result != expected_length(*m, requests[i].offset, requests[i].size)
+			|| !check_data(*m, &buffers[i][0], requests[i].offset, requests[i].result, "read_batch")) {
+			fprintf(stderr, "error: batched read %u of %s returned %d\n", i, m->path.c_str(), requests[i].result);
+			return 1;
+		}
+	}
+
+	printf("%s: %lu members and %u batched reads match\n", what, a.members.size(), nr_requests);
+
+	delete fs;
+
+	// unmounting gives every node, and the slabs that held them, back
+	ObjectCacheStats st;
+	tarfs_node_cache.stats(st);
+	if (st.slabs != 0 || st.in_use != 0) {
+		fprintf(stderr, "error: the node cache still has %lu slabs and %lu nodes after unmounting\n", st.slabs, st.in_use);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Mounts a device eagerly, and returns the number of device requests the mount made.
+ */
+static unsigned long mount_requests(BlockDevice& device)
+{
+	unsigned long start = device.nr_requests;
+
+	TarFS *fs = create_archive_fs(device, false);
+	if (!fs->mount()) {
+		fprintf(stderr, "error: unable to mount the archive\n");
+		exit(1);
+	}
+
+	unsigned long nr = device.nr_requests - start;
+	delete fs;
+
+	return nr;
+}
+
+/**
+ * Checks that an index at the end of the archive replaces the header scan, and that an
+ * index that has been damaged is passed over for one.
+ */
+static int check_index(Archive& a, unsigned long seed)
+{
+	BlockDevice indexed;
+	indexed.image = a.device.image;
+	append_index(a, indexed.image);
+
+	// looking for a gzip header, reading the trailer, then the entries, is all an indexed
+	// mount does
+	unsigned long scanned = mount_requests(a.device);
+	unsigned long nr = mount_requests(indexed);
+	if (nr > 3) {
+		fprintf(stderr, "error: mounting with the index made %lu device requests\n", nr);
+		return 1;
+	}
+
+	printf("index: mounting made %lu device requests, against %lu without it\n", nr, scanned);
+
+	if (check_archive(indexed, a, seed, "indexed archive")) return 1;
+
+	// a flipped bit in the first entry fails the checksum
+	index_trailer trailer;
+	memcpy(&trailer, &indexed.image[indexed.image.size() - 512], sizeof(trailer));
+	indexed.image[(size_t) trailer.index_block * 512] ^= 1;
+
+	if (mount_requests(indexed) <= 3) {
+		fprintf(stderr, "error: a damaged index was used to mount the archive\n");
+		return 1;
+	}
+
+	return check_archive(indexed, a, seed, "archive with a damaged index");
+}
+
+/**
+ * Checks the gzip device on its own, against the image it was made from, and then TarFS
+ * on top of it.  The stream is in several members, so that moving between them is covered.
+ */
+static int check_gzip(const Archive& a, unsigned long seed)
+{
+	BlockDevice compressed;
+	gzip_image(a.device.image, compressed.image, 3, 6);
+
+	GzipBlockDevice *inflated = new GzipBlockDevice(compressed);
+	if (!inflated->valid() || inflated->block_count() != a.device.image.size() / 512) {
+		fprintf(stderr, "error: the gzip device has %lu blocks, not %lu\n", inflated->block_count(), a.device.image.size() / 512);
+		return 1;
+	}
+
+	// runs of blocks at random, backwards as well as forwards, to make it use its checkpoints
+	std::mt19937_64 rng(seed);
+	std::vector<uint8_t> buffer(64 * 512);
+
+	for (unsigned int i = 0; i < 200; i++) {
+		size_t count = 1 + (rng() % 64);
+		size_t block = rng() % (inflated->block_count() - count + 1);
+
+		if (!inflated->read_blocks(&buffer[0], block, count) || memcmp(&buffer[0], &a.device.image[block * 512], count * 512)) {
+			fprintf(stderr, "error: reading %lu blocks at %lu of the gzip device returned the wrong data\n", count, block);
+			return 1;
+		}
+	}
+
+	delete inflated;
+
+	if (check_archive(compressed, a, seed, "gzip archive")) return 1;
+
+	// damaging a member's CRC, or cutting the stream short, must be noticed
+	BlockDevice damaged;
+	gzip_image(a.device.image, damaged.image, 1, 6);
+
+	size_t end = damaged.image.size();
+	while (damaged.image[end - 1] == 0) end--;
+
+	damaged.image[end - 8] ^= 1;
+	inflated = new GzipBlockDevice(damaged);
+	bool bad_crc = !inflated->valid();
+	delete inflated;
+
+	damaged.image[end - 8] ^= 1;
+	damaged.image.resize(((end / 2) + 511) & ~(size_t) 511);
+	inflated = new GzipBlockDevice(damaged);
+	bool truncated = !inflated->valid();
+	delete inflated;
+
+	if (!bad_crc || !truncated) {
+		fprintf(stderr, "error: a gzip stream with a %s was accepted\n", bad_crc ? "missing end" : "bad CRC");
+		return 1;
+	}
+
+	printf("gzip: 200 runs of blocks match, and a bad CRC and a truncated stream are rejected\n");
+	return 0;
+}
+
+/**
+ * Faults in every page of a mapping, and checks that each holds the right data, with the
+ * part of the last page past the end of the file zeroed.
+ * @param offset The offset within the file that the mapping starts at.
+ */
+static bool check_mapping(const Member& m, TarFSMapping *mapping, VMA& vma, size_t offset)
+{
+	for (size_t page = 0; page < mapping->length(); page += 0x1000) {
+		bool inside = offset + page < m.size;
+
+		// fault somewhere in the middle of the page, not at its start
+		if (mapping->fault(mapping->base() + page + 123) != inside) {
+			fprintf(stderr, "error: a fault at %lu of a mapping of %s %s\n", page, m.path.c_str(), inside ? "failed" : "succeeded");
+			return false;
+		}
+
+		if (!inside) {
+			continue;
+		}
+
+		phys_addr_t pa = vma.mappings[mapping->base() + page];
+		const uint8_t *data = (const uint8_t *) sys.mm().pgalloc().pgd_to_kva(sys.mm().pgalloc().pfn_to_pgd(pa >> 12));
+
+		size_t valid = std::min((size_t) 0x1000, m.size - (offset + page));
+		if (!check_data(m, data, offset + page, valid, "a mapping")) {
+			return false;
+		}
+
+		for (size_t i = valid; i < 0x1000; i++) {
+			if (data[i]) {
+				fprintf(stderr, "error: the last page of a mapping of %s is not zeroed past the end\n", m.path.c_str());
+				return false;
+			}
+		}
+	}
+
+	return !mapping->fault(mapping->base() - 1) && !mapping->fault(mapping->base() + mapping->length());
+}
+
+/**
+ * Maps some of the members twice, once whole and once from an offset, and checks that the
+ * two mappings share the file's page cache, which goes with the last of them.
+ */
+static int check_mmap(Archive& a)
+{
+	PFSNode *root;
+	TarFS *fs = mount_archive(a.device, root);
+
+	// look every member up first, as a lazy mount takes pages for the nodes as it goes
+	std::vector<PFSNode *> nodes;
+	for (const Member& m : a.members) {
+		nodes.push_back(lookup(root, m.path));
+	}
+
+	uint64_t free_before = buddy.nr_free_pages();
+	unsigned int nr_mapped = 0;
+
+	for (const Member& m : a.members) {
+		if (m.id % 16 && m.size < HARNESS_LARGE_SIZE) continue;
+
+		TarFSFile *file = (TarFSFile *) nodes[m.id]->open();
+
+		VMA unused;
+		if (file->mmap(unused, HARNESS_MAP_BASE + 1, 0x1000, 0) || file->mmap(unused, HARNESS_MAP_BASE, 0x1000, 100)) {
+			fprintf(stderr, "error: an unaligned mapping of %s was allowed\n", m.path.c_str());
+			return 1;
+		}
+
+		// the window runs a page past the end of the file
+		size_t length = (m.size + 0xfff) & ~(size_t) 0xfff;
+		size_t offset = m.size > 0x2000 ? 0x2000 : 0;
+
+		VMA whole, window;
+		TarFSMapping *first = file->mmap(whole, HARNESS_MAP_BASE, length, 0);
+		TarFSMapping *second = file->mmap(window, HARNESS_MAP_BASE * 2, length - offset + 0x1000, offset);
+
+		if (!check_mapping(m, first, whole, 0) || !check_mapping(m, second, window, offset)) return 1;
+
+		if (whole.mappings[HARNESS_MAP_BASE + offset] != window.mappings[HARNESS_MAP_BASE * 2]) {
+			fprintf(stderr, "error: two mappings of %s do not share their pages\n", m.path.c_str());
+			return 1;
+		}
+
+		delete first;
+		delete second;
+		delete file;
+
+		nr_mapped++;
+	}
+
+	if (buddy.nr_free_pages() != free_before) {
+		fprintf(stderr, "error: %ld pages were not given back after unmapping\n", (long) (free_before - buddy.nr_free_pages()));
+		return 1;
+	}
+
+	printf("mmap: %u files map the right pages, and give them back when unmapped\n", nr_mapped);
+
+	delete fs;
+	return 0;
+}
+
+static int check(unsigned long seed)
+{
+	Archive a;
+	build_archive(a);
+
+	if (check_archive(a.device, a, seed, "archive")) return 1;
+	if (check_index(a, seed)) return 1;
+	if (check_gzip(a, seed)) return 1;
+	if (check_mmap(a)) return 1;
+
+	return 0;
+}
+
+/**
+ * Streams the large member in reads of the given size, from a freshly mounted file-system,
+ * and reports the device requests made and the throughput.
+ */
+static void stream_large(BlockDevice& device, const char *how, size_t read_size, bool sequential)
+{
+	PFSNode *root;
+	TarFS *fs = mount_archive(device, root);
+
+	TarFSFile *file = (TarFSFile *) lookup(root, "large/blob")->open();
+	std::vector<uint8_t> buffer(read_size);
+
+	unsigned long start = device.nr_requests;
+	uint64_t start_ns = now_ns();
+
+	// pread does not move the file position, so does not read ahead
+	size_t offset = 0;
+	int rc;
+	while ((rc = sequential ? file->read(&buffer[0], read_size) : file->pread(&buffer[0], read_size, offset)) > 0) {
+		offset += rc;
+	}
+
+	uint64_t ns = now_ns() - start_ns;
+
+	printf("  %-10s in %2lu KiB reads: %6lu device requests, %6.0f MB/s\n", how, read_size >> 10,
+		device.nr_requests - start, mb_per_second(offset, ns));
+
+	delete file;
+	delete fs;
+}
+
+/**
+ * Reads every small member, from a freshly mounted file-system, either one at a time or as
+ * a single batch, and returns the number of device requests made.
+ */
+static unsigned long read_small(Archive& a, bool batched)
+{
+	PFSNode *root;
+	TarFS *fs = mount_archive(a.device, root);
+
+	std::vector<TarFSReadRequest> requests;
+	std::vector<std::vector<uint8_t>> buffers;
+
+	for (const Member& m : a.members) {
+		if (m.path.compare(0, 6, "small/")) continue;
+
+		buffers.push_back(std::vector<uint8_t>(m.size));
+		requests.push_back({ lookup(root, m.path), &buffers.back()[0], m.size, 0, 0 });
+	}
+
+	unsigned long start = a.device.nr_requests;
+
+	if (batched) {
+		fs->read_batch(&requests[0], requests.size());
+	} else {
+		for (TarFSReadRequest& request : requests) {
+			TarFSFile *file = (TarFSFile *) request.node->open();
+			request.result = file->pread(request.buffer, request.size, request.offset);
+			delete file;
+		}
+	}
+
+	unsigned long nr = a.device.nr_requests - start;
+	delete fs;
+
+	return nr;
+}
+
+/**
+ * Mounts a device eagerly, and returns the time taken in nanoseconds.
+ */
+static uint64_t time_mount(BlockDevice& device)
+{
+	uint64_t start = now_ns();
+
+	TarFS *fs = create_archive_fs(device, false);
+	if (!fs->mount()) {
+		fprintf(stderr, "error: unable to mount the archive\n");
+		exit(1);
+	}
+
+	uint64_t ns = now_ns() - start;
+	delete fs;
+
+	return ns;
+}
+
+/**
+ * Returns the time in nanoseconds from creating a file-system on a device to having the
+ * first byte of a member.  The mount is lazy, so only the headers up to the member are read.
+ */
+static uint64_t time_first_read(BlockDevice& device, const char *path)
+{
+	uint64_t start = now_ns();
+
+	TarFS *fs = create_archive_fs(device, true);
+	PFSNode *root = fs->mount();
+	TarFSFile *file = (TarFSFile *) lookup(root, path)->open();
+
+	uint8_t byte;
+	file->read(&byte, 1);
+
+	uint64_t ns = now_ns() - start;
+
+	delete file;
+	delete fs;
+
+	return ns;
+}
+
+static int bench()
+{
+	Archive large;
+	append_directory(large, "small");
+	for (unsigned int i = 0; i < HARNESS_NR_SMALL; i++) {
+		append_member(large, "small/" + std::to_string(i), HARNESS_SMALL_SIZE + (i * 7));
+	}
+
+	append_directory(large, "large");
+	append_member(large, "large/blob", HARNESS_BENCH_LARGE_SIZE);
+	end_archive(large);
+
+	printf("streaming a %lu MiB member\n", HARNESS_BENCH_LARGE_SIZE >> 20);
+	stream_large(large.device, "pread", 4096, false);
+	stream_large(large.device, "pread", 65536, false);
+	stream_large(large.device, "read", 4096, true);
+	stream_large(large.device, "read", 65536, true);
+
+	printf("reading %u members of about %u bytes\n", HARNESS_NR_SMALL, HARNESS_SMALL_SIZE);
+	printf("  one at a time: %lu device requests\n", read_small(large, false));
+	printf("  as one batch:  %lu device requests\n", read_small(large, true));
+
+	// The members are random bytes, which barely compress, so this is the inflater's speed
+	// over stored and literal data rather than over long matches.
+	BlockDevice compressed;
+	gzip_image(large.device.image, compressed.image, 1, 1);
+
+	uint64_t start = now_ns();
+	GzipBlockDevice *inflated = new GzipBlockDevice(compressed);
+	uint64_t ns = now_ns() - start;
+	delete inflated;
+
+	printf("inflating %lu MiB from %lu MiB of gzip\n", large.device.image.size() >> 20, compressed.image.size() >> 20);
+	printf("  creating the device: %6.0f MB/s\n", mb_per_second(large.device.image.size(), ns));
+	stream_large(compressed, "read", 65536, true);
+	printf("  first read, plain:   %8.3f ms\n", time_first_read(large.device, "small/0") / 1e6);
+	printf("  first read, gzip:    %8.3f ms\n", time_first_read(compressed, "small/0") / 1e6);
+
+	large.device.image.clear();
+	large.device.image.shrink_to_fit();
+	compressed.image.clear();
+	compressed.image.shrink_to_fit();
+
+	// a million empty members, so the archive is all headers
+	Archive many;
+	for (unsigned int d = 0; d < HARNESS_BENCH_DIRS; d++) {
+		std::string dir = "dir" + std::to_string(d);
+
+		append_directory(many, dir);
+		for (unsigned int i = 0; i < HARNESS_BENCH_PER_DIR; i++) {
+			append_member(many, dir + "/" + std::to_string(i), 0);
+		}
+	}
+
+	end_archive(many);
+
+	BlockDevice indexed;
+	indexed.image = many.device.image;
+	append_index(many, indexed.image);
+
+	size_t nr_headers = many.records.size();
+	uint64_t scan_ns = time_mount(many.device);
+	uint64_t index_ns = time_mount(indexed);
+
+	printf("mounting %lu members\n", nr_headers);
+	printf("  reading headers: %6.0f ms, %8.0f headers/s\n", scan_ns / 1e6, nr_headers / (scan_ns / 1e9));
+	printf("  from the index:  %6.0f ms, %8.0f entries/s\n", index_ns / 1e6, nr_headers / (index_ns / 1e9));
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	buddy.set_bookkeeping_range(0, HARNESS_MEMORY_PAGES);
+
+	if (!sys.mm().pgalloc().init(buddy, HARNESS_MEMORY_PAGES)) {
+		fprintf(stderr, "error: unable to initialise the page allocator\n");
+		return 1;
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "check") == 0) {
+		return check(argc > 2 ? strtoul(argv[2], NULL, 0) : 1);
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+		return bench();
+	}
+
+	fprintf(stderr, "usage: %s check [seed]\n", argv[0]);
+	fprintf(stderr, "       %s bench\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,452 @@
+/*
+ * TarFS Index Generator
+ *
+ * A host-side tool that appends an index of every member of a TAR archive to the end of it,
+ * so that the TarFS driver can mount the archive without reading each header.  The archive
+ * itself is left intact, and still reads normally with tar.  Running the tool again on an
+ * archive that already has an index replaces it.
+ *
+ * The index must be the last thing on the device the archive is mounted from, so the image
+ * should not be padded after the tool has run.
+ *
+ * Build with: c++ -O2 -o tarfs-mkindex tarfs-mkindex.cpp
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+
+// These layouts must match the ones in tarfs.cpp.
+#define TARFS_INDEX_MAGIC	"TARFSIDX"
+#define TARFS_INDEX_VERSION	1
+
+struct posix_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+} __attribute__((packed));
+
+struct index_trailer {
+	char magic[8];
+	uint32_t version;
+	uint32_t index_block;
+	uint32_t index_bytes;
+	uint32_t nr_entries;
+	uint32_t checksum;
+} __attribute__((packed));
+
+struct index_entry {
+	uint32_t header_block;
+	uint32_t data_block;
+	uint32_t size;
+	char typeflag;
+	uint8_t reserved;
+	uint16_t path_length;
+} __attribute__((packed));
+
+static bool is_zero_block(const uint8_t *block)
+{
+	for (unsigned int i = 0; i < 512; i++) {
+		if (block[i] != 0) return false;
+	}
+
+	return true;
+}
+
+/**
+ * Parses a numeric header field, which is either octal, or base-256 for large values.
+ */
+static bool header_number(const char *field, unsigned int width, uint64_t& value)
+{
+	const uint8_t *data = (const uint8_t *) field;
+	value = 0;
+
+	if (data[0] & 0x80) {
+		if (data[0] & 0x40) {
+			return false;
+		}
+
+		value = data[0] & 0x3f;
+		for (unsigned int i = 1; i < width; i++) {
+			if (value >> 56) {
+				return false;
+			}
+
+			value = (value << 8) | data[i];
+		}
+
+		return true;
+	}
+
+	unsigned int i = 0;
+	while (i < width && data[i] == ' ') {
+		i++;
+	}
+
+	for (; i < width && data[i] && data[i] != ' '; i++) {
+		unsigned int digit = data[i] - '0';
+		if (digit > 7) {
+			return false;
+		}
+
+		value = (value << 3) | digit;
+	}
+
+	return true;
+}
+
+/**
+ * Checks a header against its checksum, accepting either the unsigned or the signed sum.
+ */
+static bool header_checksum_ok(const posix_header *header)
+{
+	uint64_t stored;
+	if (!header_number(header->chksum, sizeof(header->chksum), stored)) {
+		return false;
+	}
+
+	const uint8_t *block = (const uint8_t *) header;
+	int64_t unsigned_sum = 0, signed_sum = 0;
+
+	for (unsigned int i = 0; i < 512; i++) {
+		bool in_chksum = i >= offsetof(posix_header, chksum) && i < offsetof(posix_header, chksum) + sizeof(header->chksum);
+		uint8_t ch = in_chksum ? ' ' : block[i];
+
+		unsigned_sum += ch;
+		signed_sum += (int8_t) ch;
+	}
+
+	return (int64_t) stored == unsigned_sum || (int64_t) stored == signed_sum;
+}
+
+static unsigned int field_length(const char *field, unsigned int size)
+{
+	unsigned int length = 0;
+	while (length < size && field[length]) {
+		length++;
+	}
+
+	return length;
+}
+
+/**
+ * Drops any leading "./" or '/' and any trailing '/' from a path, in place.
+ */
+static unsigned int trim_path(char *path, unsigned int length)
+{
+	unsigned int start = 0;
+	while (start < length) {
+		if (path[start] == '/') {
+			start++;
+		} else if (path[start] == '.' && start + 1 < length && path[start + 1] == '/') {
+			start += 2;
+		} else {
+			break;
+		}
+	}
+
+	while (length > start && path[length - 1] == '/') {
+		length--;
+	}
+
+	length -= start;
+	memmove(path, path + start, length);
+
+	return length;
+}
+
+/**
+ * Builds the full path of a member in the same way as the driver does, so that lookups find
+ * the same nodes whether or not the archive was indexed.
+ */
+static unsigned int header_path(const posix_header *header, char *path)
+{
+	unsigned int length = 0;
+
+	if (!memcmp(header->magic, "ustar", 6)) {
+		unsigned int prefix_length = field_length(header->prefix, sizeof(header->prefix));
+
+		if (prefix_length) {
+			memcpy(path, header->prefix, prefix_length);
+			path[prefix_length] = '/';
+			length = prefix_length + 1;
+		}
+	}
+
+	unsigned int name_length = field_length(header->name, sizeof(header->name));
+	memcpy(path + length, header->name, name_length);
+	length += name_length;
+
+	return trim_path(path, length);
+}
+
+/**
+ * Finds the value of the last record with the given keyword in the data of a pax extended
+ * header, as the driver does.
+ */
+static const char *pax_value(const char *data, size_t size, const char *keyword, unsigned int& value_length)
+{
+	size_t keyword_length = strlen(keyword);
+	const char *value = NULL;
+
+	size_t pos = 0;
+	while (pos < size) {
+		size_t record_length = 0, i = pos;
+		while (i < size && data[i] >= '0' && data[i] <= '9') {
+			record_length = (record_length * 10) + (data[i++] - '0');
+		}
+
+		if (i >= size || data[i] != ' ' || record_length <= i - pos || record_length > size - pos || data[pos + record_length - 1] != '\n') {
+			break;
+		}
+
+		const char *key = data + i + 1;
+		size_t rest = (pos + record_length - 1) - (i + 1);
+
+		if (rest > keyword_length && !memcmp(key, keyword, keyword_length) && key[keyword_length] == '=') {
+			value = key + keyword_length + 1;
+			value_length = rest - keyword_length - 1;
+		}
+
+		pos += record_length;
+	}
+
+	return value;
+}
+
+static uint32_t index_checksum(const uint8_t *data, size_t length)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static bool read_file(const char *filename, std::vector<uint8_t>& data)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		return false;
+	}
+
+	uint8_t buffer[65536];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		data.insert(data.end(), buffer, buffer + n);
+	}
+
+	bool ok = !ferror(f);
+	fclose(f);
+
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <archive.tar> [output.tar]\n", argv[0]);
+		return 1;
+	}
+
+	const char *input = argv[1];
+	const char *output = argc == 3 ? argv[2] : argv[1];
+
+	std::vector<uint8_t> archive;
+	if (!read_file(input, archive)) {
+		fprintf(stderr, "%s: unable to read %s\n", argv[0], input);
+		return 1;
+	}
+
+	// round the archive up to whole blocks
+	archive.resize((archive.size() + 511) & ~(size_t) 511, 0);
+	size_t nr_blocks = archive.size() / 512;
+
+	// drop any index the archive already has
+	if (nr_blocks > 0) {
+		index_trailer trailer;
+		memcpy(&trailer, &archive[(nr_blocks - 1) * 512], sizeof(trailer));
+
+		if (!memcmp(trailer.magic, TARFS_INDEX_MAGIC, sizeof(trailer.magic)) && trailer.index_block < nr_blocks) {
+			nr_blocks = trailer.index_block;
+			archive.resize(nr_blocks * 512);
+		}
+	}
+
+	std::vector<uint8_t> entries;
+	unsigned int nr_entries = 0;
+	bool terminated = false;
+
+	// what a pax extended header or a GNU long name says about the next member
+	char next_path[256];
+	int next_path_length = -1;
+	uint64_t next_size = 0;
+	bool has_next_size = false;
+
+	size_t idx = 0;
+	while (idx < nr_blocks) {
+		const uint8_t *block = &archive[idx * 512];
+
+		if (is_zero_block(block)) {
+			if (idx + 1 < nr_blocks && is_zero_block(block + 512)) {
+				terminated = true;
+				break;
+			}
+
+			idx++;
+			continue;
+		}
+
+		const posix_header *header = (const posix_header *) block;
+
+		// the driver stops at a corrupt header, so the index does too
+		uint64_t size;
+		if (!header_checksum_ok(header) || !header_number(header->size, sizeof(header->size), size)) {
+			fprintf(stderr, "%s: corrupt header at block %lu, ignoring the rest of the archive\n", argv[0], (unsigned long) idx);
+			terminated = true;
+			break;
+		}
+
+		// metadata headers are not members, and the driver reads them in the same way
+		if (header->typeflag == 'x' || header->typeflag == 'L') {
+			size_t available = idx + 1 < nr_blocks ? (nr_blocks - idx - 1) * 512 : 0;
+			size_t data_size = size < 4096 ? size : 4096;
+			if (data_size > available) {
+				data_size = available;
+			}
+
+			const char *data = (const char *) block + 512;
+			const char *long_path = NULL;
+			unsigned int long_path_length = 0;
+
+			if (header->typeflag == 'L') {
+				long_path = data;
+				long_path_length = field_length(data, data_size);
+			} else {
+				long_path = pax_value(data, data_size, "path", long_path_length);
+
+				unsigned int size_length;
+				const char *size_value = pax_value(data, data_size, "size", size_length);
+
+				if (size_value) {
+					next_size = 0;
+					has_next_size = size_length > 0 && size_length <= 19;
+
+					for (unsigned int i = 0; i < size_length; i++) {
+						if (size_value[i] < '0' || size_value[i] > '9') {
+							has_next_size = false;
+							break;
+						}
+
+						next_size = (next_size * 10) + (size_value[i] - '0');
+					}
+				}
+			}
+
+			if (long_path) {
+				if (long_path_length < sizeof(next_path)) {
+					memcpy(next_path, long_path, long_path_length);
+					next_path_length = trim_path(next_path, long_path_length);
+				} else {
+					fprintf(stderr, "%s: the path of the member after block %lu is too long, skipping it\n", argv[0], (unsigned long) idx);
+					next_path_length = 0;
+				}
+			}
+
+			idx += 1 + (size + 511) / 512;
+			continue;
+		}
+
+		if (header->typeflag == 'g' || header->typeflag == 'K') {
+			idx += 1 + (size + 511) / 512;
+			continue;
+		}
+
+		char path[256];
+		unsigned int length;
+
+		if (next_path_length >= 0) {
+			memcpy(path, next_path, next_path_length);
+			length = next_path_length;
+		} else {
+			length = header_path(header, path);
+		}
+
+		if (has_next_size) {
+			size = next_size;
+		}
+
+		next_path_length = -1;
+		has_next_size = false;
+
+		if (length && size <= 0xffffffffull) {
+			index_entry entry;
+			entry.header_block = idx;
+			entry.data_block = idx + 1;
+			entry.size = size;
+			entry.typeflag = header->typeflag;
+			entry.reserved = 0;
+			entry.path_length = length;
+
+			entries.insert(entries.end(), (uint8_t *) &entry, (uint8_t *) (&entry + 1));
+			entries.insert(entries.end(), (uint8_t *) path, (uint8_t *) path + length);
+			nr_entries++;
+		}
+
+		idx += 1 + (size + 511) / 512;
+	}
+
+	if (idx > nr_blocks) {
+		fprintf(stderr, "%s: %s is truncated\n", argv[0], input);
+		return 1;
+	}
+
+	// make sure tar sees the end of the archive before it reaches the index
+	if (!terminated) {
+		archive.resize(archive.size() + 1024, 0);
+		nr_blocks += 2;
+	}
+
+	index_trailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	memcpy(trailer.magic, TARFS_INDEX_MAGIC, sizeof(trailer.magic));
+	trailer.version = TARFS_INDEX_VERSION;
+	trailer.index_block = nr_blocks;
+	trailer.index_bytes = entries.size();
+	trailer.nr_entries = nr_entries;
+	trailer.checksum = index_checksum(entries.data(), entries.size());
+
+	archive.insert(archive.end(), entries.begin(), entries.end());
+	archive.resize((archive.size() + 511) & ~(size_t) 511, 0);
+
+	uint8_t trailer_block[512];
+	memset(trailer_block, 0, sizeof(trailer_block));
+	memcpy(trailer_block, &trailer, sizeof(trailer));
+	archive.insert(archive.end(), trailer_block, trailer_block + sizeof(trailer_block));
+
+	FILE *f = fopen(output, "wb");
+	if (!f || fwrite(archive.data(), 1, archive.size(), f) != archive.size() || fclose(f)) {
+		fprintf(stderr, "%s: unable to write %s\n", argv[0], output);
+		return 1;
+	}
+
+	printf("%s: indexed %u members in %u bytes\n", output, nr_entries, trailer.index_bytes);
+	return 0;
+}